@@ -14,6 +14,8 @@
 #include "driver/uart.h"
 #include "osapi.h"
 #include "driver/uart_register.h"
+#include "user_interface.h"
+#include "spsc.h"
 //#include "ssc.h"
 
 
@@ -23,6 +25,15 @@ extern UartDevice    UartDev;
 
 LOCAL void uart0_rx_intr_handler(void *para);
 
+#define UART0_RX_TASK_PRIO 1
+#define UART0_RX_RING_SIZE 256		// Power of two
+
+LOCAL uint8 uart0RxBuf[UART0_RX_RING_SIZE];
+LOCAL SPSC uart0RxRing;				// Filled by the interrupt handler, emptied by uart0_rx_task
+LOCAL uint32 uart0RxOverruns;		// Bytes lost because the ring was full
+LOCAL uart0_rx_callback uart0RxCb;
+LOCAL os_event_t uart0RxTaskQueue[1];
+
 /******************************************************************************
  * FunctionName : uart_config
  * Description  : Internal used function
@@ -219,62 +230,65 @@ uart0_rx_intr_handler(void *para)
     WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_FRM_ERR_INT_CLR);
   }
 
-  if(UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST))
+  if(READ_PERI_REG(UART_INT_ST(uart_no)) & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST))
   {
-//    os_printf("fifo full\r\n");
-    ETS_UART_INTR_DISABLE();/////////
-
-    //system_os_post(at_recvTaskPrio, 0, 0);
-
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-//    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//    {
-////      at_recvTask();
-//      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//      system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    }
+    // Empty the FIFO into the ring, the task hands it on
+    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
+    {
+      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
+      if(!spsc_put(&uart0RxRing, RcvChar))
+        uart0RxOverruns++;
+    }
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR);
+    // Fails harmlessly if a post is already waiting
+    system_os_post(UART0_RX_TASK_PRIO, 0, 0);
   }
-  else if(UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
-  {
-    ETS_UART_INTR_DISABLE();/////////
+}
 
-    //system_os_post(at_recvTaskPrio, 0, 0);
+/******************************************************************************
+ * FunctionName : uart0_rx_task
+ * Description  : Internal used function
+ *                Hands the bytes received by the interrupt handler to the
+ *                receive callback, or drops them if there is none
+ * Parameters   : os_event_t *e - unused
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_FLASH_ATTR
+uart0_rx_task(os_event_t *e)
+{
+  uint8 buf[32];
+  uint16 len;
 
-//    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_TOUT_INT_CLR);
-////    os_printf("rx time over\r\n");
-//    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//    {
-////      os_printf("process recv\r\n");
-////      at_recvTask();
-//      RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//      system_os_post(at_recvTaskPrio, NULL, RcvChar);
-//    }
+  while ((len = spsc_read(&uart0RxRing, buf, sizeof(buf))) > 0)
+  {
+    if (uart0RxCb)
+      uart0RxCb(buf, len);
   }
+}
 
-//  WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR);
-
-//  if (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S))
-//  {
-//    RcvChar = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
-//    at_recvTask();
-//    *(pRxBuff->pWritePos) = RcvChar;
-
-//    system_os_post(at_recvTaskPrio, NULL, RcvChar);
+/******************************************************************************
+ * FunctionName : uart0_set_rx_callback
+ * Description  : Set the function called, from a task, with received bytes
+ * Parameters   : uart0_rx_callback cb - callback, NULL to drop the bytes
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_set_rx_callback(uart0_rx_callback cb)
+{
+  uart0RxCb = cb;
+}
 
-//    //insert here for get one command line from uart
-//    if (RcvChar == '\r')
-//    {
-//      pRxBuff->BuffState = WRITE_OVER;
-//    }
-//
-//    pRxBuff->pWritePos++;
-//
-//    if (pRxBuff->pWritePos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE))
-//    {
-//      // overflow ...we may need more error handle here.
-//      pRxBuff->pWritePos = pRxBuff->pRcvMsgBuff ;
-//    }
-//  }
+/******************************************************************************
+ * FunctionName : uart0_rx_overruns
+ * Description  : Bytes dropped since start up because the receive ring
+ *                was full
+ * Parameters   : NONE
+ * Returns      : count
+*******************************************************************************/
+uint32 ICACHE_FLASH_ATTR
+uart0_rx_overruns(void)
+{
+  return uart0RxOverruns;
 }
 
 /******************************************************************************
@@ -288,6 +302,8 @@ uart0_init(UartBautRate uart0_br)
 {
   // rom use 74880 baut_rate, here reinitialize
   UartDev.baut_rate = uart0_br;
+  spsc_init(&uart0RxRing, uart0RxBuf, UART0_RX_RING_SIZE);
+  system_os_task(uart0_rx_task, UART0_RX_TASK_PRIO, uart0RxTaskQueue, 1);
   uart_config(UART0);
   ETS_UART_INTR_ENABLE();
 
@@ -95,7 +95,11 @@ typedef struct {
     int                      buff_uart_no;  //indicate which uart use tx/rx buffer
 } UartDevice;
 
+typedef void (*uart0_rx_callback)(const uint8 *data, uint16 len);
+
 void uart0_init(UartBautRate uart0_br);
 void uart0_sendStr(const char *str);
+void uart0_set_rx_callback(uart0_rx_callback cb);
+uint32 uart0_rx_overruns(void);
 #endif
 
@@ -1,7 +1,7 @@
 #ifndef _USER_CONFIG_H_
 #define _USER_CONFIG_H_
 
-#define PROTOCOL_NAMEv31
+#define MQTT_PROTOCOL_VERSION	5	/* 3 (3.1), 4 (3.1.1) or 5. Falls back if the broker refuses it */
 
 #define CFG_HOLDER	0x00FF55A4	/* Change this value to load default configurations */
 #define CFG_LOCATION	0x3C	/* Please don't change or if you know what you doing */
@@ -13,6 +13,8 @@
 #define MQTT_PORT			1880
 #define MQTT_BUF_SIZE		1024
 #define MQTT_KEEPALIVE		120	 /*second*/
+#define MQTT_KEEPALIVE_MIN	30	/* Shortest keepalive tried after unanswered pings, seconds */
+#define MQTT_PING_TIMEOUT	5	/* Seconds to wait for a PINGRESP before reconnecting */
 
 #define MQTT_CLIENT_ID		"DVES_%08X"
 #define MQTT_USER			"DVES_USER"
@@ -23,8 +25,23 @@
 #define STA_TYPE AUTH_WPA2_PSK
 
 #define MQTT_RECONNECT_TIMEOUT 	5	/*second*/
+#define MQTT_RECONNECT_MAX		120	/* Longest wait between attempts, seconds */
+#define MQTT_DNS_TTL			600	/* Seconds a resolved broker address is reused */
+#define MQTT_SESSION_EXPIRY		3600	/* Seconds the broker keeps our session, MQTT 5 */
+#define MQTT_FAILOVER_ATTEMPTS	3	/* Failed attempts in a row before trying the next broker */
+#define MQTT_FAILOVER_RTT		1000	/* A PINGRESP slower than this many ms counts as slow */
+#define MQTT_FAILOVER_SLOW_PINGS	3	/* Slow PINGRESPs in a row before moving to the next broker */
+#define MQTT_PROBE_TIMEOUT		3	/* Seconds each broker has to answer the probe */
+#define MQTT_SEND_RETRIES		4	/* Writes espconn refuses in a row before reconnecting */
 
 #define DEFAULT_SECURITY	0
-#define QUEUE_BUFFER_SIZE		 		2048
+#define MQTT_CONTROL_QUEUE_SIZE			256		/* Acks, pings and subscriptions */
+#define QUEUE_BUFFER_SIZE		 		2048	/* Command responses and events */
+#define MQTT_TELEMETRY_QUEUE_SIZE		1536	/* Bulk telemetry */
+#define MQTT_INFLIGHT_BUF_SIZE			2048	/* Copies of unacknowledged QoS 1/2 publishes */
+#define MQTT_RETRANSMIT_TIMEOUT	10	/*second*/
+
+#define MQTT_METRICS		/* Keep packet, queue and reconnect counters for the stats topic */
+//#define MQTT_PROFILE		/* Print cycles per publish for the outbound queue */
 
 #endif
@@ -31,6 +31,7 @@
 #define USER_AT_MQTT_H_
 #include "mqtt_msg.h"
 #include "user_interface.h"
+#include "user_config.h"
 
 #include "queue.h"
 typedef struct mqtt_event_data_t
@@ -48,12 +49,13 @@ typedef struct mqtt_state_t
   uint16_t port;
   int auto_reconnect;
   mqtt_connect_info_t* connect_info;
-  uint8_t* in_buffer;
-  uint8_t* out_buffer;
+  uint8_t* in_buffer;          // Receive buffer, also holds the CONNECT while it is sent
   int in_buffer_length;
-  int out_buffer_length;
   uint16_t message_length;
   uint16_t message_length_read;
+  uint8_t rx_state;           // Receive parser state
+  uint8_t rx_shift;           // Bit position of the next remaining length byte
+  uint32_t rx_remaining;      // Remaining length being decoded, then bytes left to read or skip
   mqtt_message_t* outbound_message;
   mqtt_connection_t mqtt_connection;
   uint16_t pending_msg_id;
@@ -79,12 +81,165 @@ typedef enum {
 	MQTT_SUBSCIBE_SENDING,
 	MQTT_DATA,
 	MQTT_PUBLISH_RECV,
-	MQTT_PUBLISHING
+	MQTT_PUBLISHING,
+	BROKER_PROBING
 } tConnState;
 
+/*
+ * Outbound QoS 1 and 2 publishes which haven't been acknowledged. A copy
+ * of each is kept in the in-flight queue, with its state in a table in the
+ * same order, until the exchange with the broker completes.
+ */
+
+#define MQTT_MAX_INFLIGHT 8
+
+typedef enum {
+	MQTT_INFLIGHT_UNSENT,		// Waiting in the outbound queue
+	MQTT_INFLIGHT_SENDING,		// In the write in progress
+	MQTT_INFLIGHT_PUBACK,		// Waiting for PUBACK (QoS 1) or PUBREC (QoS 2)
+	MQTT_INFLIGHT_PUBCOMP,		// PUBREL sent, waiting for PUBCOMP
+	MQTT_INFLIGHT_RESEND,		// Ack timed out or connection lost, send again
+	MQTT_INFLIGHT_RESENDING,	// Being sent again from the in-flight queue
+	MQTT_INFLIGHT_DONE			// Acknowledged, removed once at the head
+} tInflightState;
+
+typedef struct {
+	uint16_t id;
+	uint8_t state;
+	uint8_t ticks;				// Seconds waiting for an ack
+} MQTT_INFLIGHT;
+
+/*
+ * MQTT 5 topic aliases for outbound QoS 0 publishes. The first publish to
+ * a topic on a connection carries the topic and its alias, later ones only
+ * the alias.
+ */
+
+#define MQTT_MAX_TOPIC_ALIAS 4
+
+typedef struct {
+	char *topic;				// Copy of the topic, NULL if the alias is free
+	uint8_t lanes;				// Lanes the topic has been queued in with the alias on this connection
+} MQTT_TOPIC_ALIAS;
+
+/*
+ * Outbound queue lanes, sent in priority order. Each lane has its own
+ * buffer and its own policy for when it is full, so telemetry can't
+ * crowd out acks or command responses.
+ */
+
+enum {MQTT_LANE_CONTROL = 0, MQTT_LANE_EVENT, MQTT_LANE_TELEMETRY, MQTT_LANES};
+
+typedef enum {
+	MQTT_DROP_OLDEST,			// Drop the oldest messages to make room
+	MQTT_DROP_NEWEST,			// Refuse the new message
+	MQTT_COALESCE_LATEST		// Replace a queued QoS 0 publish to the same topic, and drop the oldest when full
+} tLanePolicy;
+
+typedef struct {
+	QUEUE queue;
+	uint8_t policy;
+	uint8_t stale;				// Messages queued before the current connection
+	uint32_t dropped;			// Messages lost because the lane was full
+	uint32_t coalesced;			// Publishes replaced by a newer one to the same topic
+} MQTT_LANE;
+
+/*
+ * Subscriptions, so they can be renewed when the broker has no session
+ * for the client, and skipped when it has.
+ */
+
+#define MQTT_MAX_SUBSCRIPTIONS 4
+
+typedef enum {
+	MQTT_SUB_NONE,				// Needs sending
+	MQTT_SUB_PENDING,			// SUBSCRIBE queued or sent, waiting for SUBACK
+	MQTT_SUB_ACTIVE				// Granted by the broker
+} tSubState;
+
+typedef struct {
+	char *topic;				// Copy of the topic, NULL if the entry is free
+	uint16_t id;				// Message id of the last SUBSCRIBE
+	uint8_t qos;
+	uint8_t state;
+} MQTT_SUBSCRIPTION;
+
 typedef void (*MqttCallback)(uint32_t *args);
 typedef void (*MqttDataCallback)(uint32_t *args, const char* topic, uint32_t topic_len, const char *data, uint32_t lengh);
 
+/*
+ * Streamed publish, for payloads too big to queue. The payload is asked
+ * for a chunk at a time as the socket takes it, so no buffer the size of
+ * the message is needed. The fill callback must copy exactly len bytes
+ * from offset into buf. It may be asked for the same bytes again if the
+ * connection is lost part way. When the publish has been sent, or is
+ * abandoned, it is called once more with buf NULL and offset the
+ * payload bytes sent, so the source can be released.
+ */
+
+typedef uint16_t (*MqttFillCallback)(void *arg, uint32_t offset, uint8_t *buf, uint16_t len);
+
+typedef struct {
+	MqttFillCallback fill;		// NULL when no publish is being streamed
+	void *arg;
+	char *topic;
+	uint32_t length;			// Payload length
+	uint32_t offset;			// Payload bytes sent on this connection
+	uint16_t chunk;				// Payload bytes in the write in progress
+	uint8_t retain;
+	BOOL started;				// Header sent, the rest must follow before anything else
+	uint8_t *buf;				// Chunk buffer
+} MQTT_STREAM;
+
+/*
+ * Client metrics, kept when MQTT_METRICS is defined. Counts run from
+ * start up. Times are in microseconds.
+ */
+
+#ifdef MQTT_METRICS
+enum {
+	MQTT_CAUSE_CLOSED = 0,		// Closed by the broker or the network
+	MQTT_CAUSE_ERROR,			// Connection failed or was reset
+	MQTT_CAUSE_REFUSED,			// CONNACK refused or invalid
+	MQTT_CAUSE_MALFORMED,		// Unparseable data from the broker
+	MQTT_CAUSE_SEND_TIMEOUT,	// A write wasn't acknowledged in time
+	MQTT_CAUSE_PING_TIMEOUT,	// A PINGREQ wasn't answered in time
+	MQTT_CAUSE_FAILOVER,		// Left for the next broker because the pings were slow
+	MQTT_CAUSE_SEND_REFUSED,	// espconn kept refusing writes
+	MQTT_CAUSES
+};
+
+typedef struct {
+	uint32_t txPackets[16];		// Packets written, by type
+	uint32_t rxPackets[16];		// Packets received, by type
+	uint32_t txBytes;
+	uint32_t rxBytes;
+	uint16_t laneHigh[MQTT_LANES];	// Most bytes queued in each lane
+	uint32_t reconnects[MQTT_CAUSES];	// Connections lost, by cause
+	uint8_t cause;				// Cause of the disconnect we asked for
+	uint32_t pingStart;			// system_get_time() when the PINGREQ was written, 0 for none
+	uint32_t pingUs;			// Last PINGREQ to PINGRESP round trip
+	uint32_t pingMaxUs;
+	uint32_t sendStart;			// system_get_time() when the write in progress started
+	uint32_t sendUs;			// Last time from a write to its sent callback
+	uint32_t sendMaxUs;
+} MQTT_STATS;
+#endif
+
+/*
+ * Brokers to fail over between. Before the first connection each one is
+ * probed and they are ranked by TCP connect time, fastest first.
+ */
+
+#define MQTT_MAX_BROKERS 4
+
+typedef struct {
+	uint8_t *host;
+	uint32_t port;
+	ip_addr_t ip;				// Address found by the probe, 0 once used
+	uint32_t rttUs;				// TCP connect time at the last probe, 0 if it didn't answer
+} MQTT_BROKER;
+
 typedef struct  {
 	struct espconn *pCon;
 	uint8_t security;
@@ -98,11 +253,61 @@ typedef struct  {
 	MqttCallback publishedCb;
 	MqttDataCallback dataCb;
 	ETSTimer mqttTimer;
-	uint32_t keepAliveTick;
+	uint32_t keepAliveTick;		// Seconds since the last write
+	uint16_t keepAlive;			// Keepalive in force on this connection
+	uint16_t keepAliveMax;		// Keepalive asked for by the application
+	BOOL keepAliveProven;		// A ping was answered at the keepalive asked for
+	uint8_t pingTick;			// Seconds since a PINGREQ went unanswered, 0 for none
 	uint32_t reconnectTick;
+	uint32_t reconnectDelay;	// Seconds to wait before the next attempt
+	uint8_t reconnectAttempts;	// Attempts since the last accepted CONNACK
+	BOOL dnsValid;				// ip holds the broker's address
+	uint32_t dnsAge;			// Seconds since the broker's address was resolved
+	BOOL linkTiming;			// Waiting for the first publish after link up
+	uint32_t linkUpTime;		// system_get_time() when the connection attempts started
+	uint32_t connectMs;			// Last time from link up to first publish sent
 	uint32_t sendTimeout;
 	tConnState connState;
-	QUEUE msgQueue;
+	MQTT_LANE lanes[MQTT_LANES];
+	uint8_t sendLane;			// Lane of the write in progress
+	uint8_t sendCount;			// Queued messages in the write in progress
+	uint8_t sendPublishes;		// PUBLISH messages among them
+	BOOL sendInflight;			// Write in progress is a resend from the in-flight queue
+	BOOL sendStream;			// Write in progress is a chunk of the streamed publish
+	uint8_t sendRetries;		// Writes espconn refused in a row
+	uint8_t sendBackoff;		// Seconds before trying a refused write again
+	MQTT_STREAM stream;
+	QUEUE inflightQueue;
+	MQTT_INFLIGHT inflight[MQTT_MAX_INFLIGHT];
+	uint8_t inflightMax;		// In-flight window, limited by the broker's receive maximum
+	uint8_t aliasMax;			// Topic aliases the broker accepts, up to MQTT_MAX_TOPIC_ALIAS
+	uint32_t maxPacketSize;		// Largest packet the broker accepts, 0 for no limit
+	MQTT_TOPIC_ALIAS aliases[MQTT_MAX_TOPIC_ALIAS];
+	MQTT_SUBSCRIPTION subs[MQTT_MAX_SUBSCRIPTIONS];
+	char *birthTopic;			// Birth message, sent with each CONNECT
+	char *birthData;
+	uint16_t birthLength;
+	uint8_t birthRetain;
+	BOOL birthSent;				// Went with the CONNECT on this connection
+	MQTT_BROKER brokers[MQTT_MAX_BROKERS];
+	uint8_t brokerCount;
+	uint8_t rank[MQTT_MAX_BROKERS];	// Broker indexes, fastest first
+	uint8_t brokerRank;			// Position in rank of the broker in use
+	BOOL ranked;				// Probed since start up or the last round of failovers
+	BOOL failover;				// Move to the next broker on the next attempt
+	uint8_t slowPings;			// PINGRESPs in a row slower than MQTT_FAILOVER_RTT
+	uint32_t pingSentTime;		// system_get_time() when the PINGREQ was queued, 0 for none
+	struct espconn *probeCon;	// One per broker, so a late callback can't be taken for another's
+	uint8_t probe;				// Broker being probed
+	uint8_t probeTick;			// Seconds it has had to answer
+	uint8_t probeBusy;			// Probe connections espconn still holds, one bit each
+	uint8_t probeOpen;			// Probe connections which answered, to be closed from the task
+	BOOL probeNext;				// The task is to start the next probe
+	uint32_t probeStart;
+	MqttCallback brokerCb;
+#ifdef MQTT_METRICS
+	MQTT_STATS metrics;
+#endif
 } MQTT_Client;
 
 #define SEC_NONSSL 0
@@ -123,15 +328,22 @@ typedef struct  {
 #define MQTT_EVENT_TYPE_PUBLISH_CONTINUATION 8
 
 void ICACHE_FLASH_ATTR MQTT_InitConnection(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t security);
+BOOL ICACHE_FLASH_ATTR MQTT_AddBroker(MQTT_Client *mqttClient, uint8_t* host, uint32 port);
 void ICACHE_FLASH_ATTR MQTT_InitClient(MQTT_Client *mqttClient, uint8_t* client_id, uint8_t* client_user, uint8_t* client_pass, uint32_t keepAliveTime, uint8_t cleanSession);
 void ICACHE_FLASH_ATTR MQTT_InitLWT(MQTT_Client *mqttClient, uint8_t* will_topic, uint8_t* will_msg, uint8_t will_qos, uint8_t will_retain);
 void ICACHE_FLASH_ATTR MQTT_OnConnected(MQTT_Client *mqttClient, MqttCallback connectedCb);
 void ICACHE_FLASH_ATTR MQTT_OnDisconnected(MQTT_Client *mqttClient, MqttCallback disconnectedCb);
 void ICACHE_FLASH_ATTR MQTT_OnPublished(MQTT_Client *mqttClient, MqttCallback publishedCb);
+void ICACHE_FLASH_ATTR MQTT_OnBroker(MQTT_Client *mqttClient, MqttCallback brokerCb);
 void ICACHE_FLASH_ATTR MQTT_OnData(MQTT_Client *mqttClient, MqttDataCallback dataCb);
 BOOL ICACHE_FLASH_ATTR MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t qos);
 void ICACHE_FLASH_ATTR MQTT_Connect(MQTT_Client *mqttClient);
 void ICACHE_FLASH_ATTR MQTT_Disconnect(MQTT_Client *mqttClient);
 BOOL ICACHE_FLASH_ATTR MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain);
+BOOL ICACHE_FLASH_ATTR MQTT_PublishWithExpiry(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain, uint32_t expiry);
+BOOL ICACHE_FLASH_ATTR MQTT_PublishStream(MQTT_Client *client, const char* topic, uint32_t length, int retain, MqttFillCallback fill, void *arg);
+BOOL ICACHE_FLASH_ATTR MQTT_PublishLane(MQTT_Client *client, uint8_t lane, const char* topic, const char* data, int data_length, int qos, int retain, uint32_t expiry);
+void ICACHE_FLASH_ATTR MQTT_SetBirth(MQTT_Client *client, const char* topic, const char* data, int data_length, int retain);
+void ICACHE_FLASH_ATTR MQTT_SetLanePolicy(MQTT_Client *client, uint8_t lane, uint8_t policy);
 
 #endif /* USER_AT_MQTT_H_ */
@@ -65,6 +65,9 @@ enum mqtt_message_type
   MQTT_MSG_TYPE_DISCONNECT = 14
 };
 
+/* Largest remaining length, four length bytes */
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+
 typedef struct mqtt_message
 {
   uint8_t* data;
@@ -72,6 +75,32 @@ typedef struct mqtt_message
 
 } mqtt_message_t;
 
+enum mqtt_protocol_version
+{
+  MQTT_PROTOCOL_V31 = 3,
+  MQTT_PROTOCOL_V311 = 4,
+  MQTT_PROTOCOL_V5 = 5
+};
+
+enum mqtt_connack_return_code
+{
+  MQTT_CONNACK_ACCEPTED = 0,
+  MQTT_CONNACK_REFUSED_PROTOCOL_VERSION = 1,
+  MQTT_CONNACK_V5_UNSUPPORTED_PROTOCOL_VERSION = 0x84
+};
+
+/* MQTT 5 property identifiers */
+enum mqtt_property
+{
+  MQTT_PROP_MESSAGE_EXPIRY_INTERVAL = 0x02,
+  MQTT_PROP_SESSION_EXPIRY_INTERVAL = 0x11,
+  MQTT_PROP_SERVER_KEEP_ALIVE = 0x13,
+  MQTT_PROP_RECEIVE_MAXIMUM = 0x21,
+  MQTT_PROP_TOPIC_ALIAS_MAXIMUM = 0x22,
+  MQTT_PROP_TOPIC_ALIAS = 0x23,
+  MQTT_PROP_MAXIMUM_PACKET_SIZE = 0x27
+};
+
 typedef struct mqtt_connection
 {
   mqtt_message_t message;
@@ -79,9 +108,29 @@ typedef struct mqtt_connection
   uint16_t message_id;
   uint8_t* buffer;
   uint16_t buffer_length;
+  uint8_t protocol_version;   // Set by mqtt_msg_connect, selects the packet layouts
 
 } mqtt_connection_t;
 
+/* MQTT 5 publish properties, ignored for earlier versions */
+typedef struct mqtt_publish_properties
+{
+  uint32_t message_expiry;    // Seconds, 0 for none
+  uint16_t topic_alias;       // 0 for none
+  uint8_t alias_only;         // Send the alias in place of the topic
+} mqtt_publish_properties_t;
+
+/* CONNACK result, with the MQTT 5 server limits or their defaults */
+typedef struct mqtt_connack
+{
+  uint8_t session_present;
+  uint8_t return_code;
+  uint16_t receive_maximum;
+  uint16_t topic_alias_maximum;
+  uint16_t server_keepalive;   // 0 if the server didn't override the keepalive
+  uint32_t maximum_packet_size;  // 0 for no limit
+} mqtt_connack_t;
+
 typedef struct mqtt_connect_info
 {
   char* client_id;
@@ -93,6 +142,10 @@ typedef struct mqtt_connect_info
   int will_qos;
   int will_retain;
   int clean_session;
+  int protocol_version;
+  uint16_t receive_maximum;    // MQTT 5, inbound QoS 1/2 publishes we accept at once
+  uint32_t session_expiry;     // MQTT 5, seconds the broker keeps a persistent session
+  uint32_t maximum_packet_size;  // MQTT 5, largest packet we accept
 
 } mqtt_connect_info_t;
 
@@ -103,18 +156,26 @@ static inline int ICACHE_FLASH_ATTR mqtt_get_qos(uint8_t* buffer) { return (buff
 static inline int ICACHE_FLASH_ATTR mqtt_get_retain(uint8_t* buffer) { return (buffer[0] & 0x01); }
 
 void ICACHE_FLASH_ATTR mqtt_msg_init(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length);
+void ICACHE_FLASH_ATTR mqtt_msg_set_buffer(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length);
+int ICACHE_FLASH_ATTR mqtt_msg_encode_length(uint8_t* buffer, uint32_t length);
 int ICACHE_FLASH_ATTR mqtt_get_total_length(uint8_t* buffer, uint16_t length);
 const char* ICACHE_FLASH_ATTR mqtt_get_publish_topic(uint8_t* buffer, uint16_t* length);
-const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* length);
+const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* length, int version);
+uint16_t ICACHE_FLASH_ATTR mqtt_get_publish_alias(uint8_t* buffer, uint16_t length);
+uint16_t ICACHE_FLASH_ATTR mqtt_msg_strip_properties(uint8_t* buffer, uint16_t length, int alias_only);
 uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length);
+int ICACHE_FLASH_ATTR mqtt_get_connack(uint8_t* buffer, uint16_t length, int version, mqtt_connack_t* connack);
+int ICACHE_FLASH_ATTR mqtt_get_suback_codes(uint8_t* buffer, uint16_t length, int version, const uint8_t** codes);
 
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info);
-mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id);
+mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id, const mqtt_publish_properties_t* properties);
+mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish_header(mqtt_connection_t* connection, const char* topic, uint32_t data_length, int qos, int retain, uint16_t* message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pubrec(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pubrel(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pubcomp(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id);
+mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_subscribe_multi(mqtt_connection_t* connection, const char** topics, const uint8_t* qos, int count, uint16_t* message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_unsubscribe(mqtt_connection_t* connection, const char* topic, uint16_t* message_id);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pingreq(mqtt_connection_t* connection);
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pingresp(mqtt_connection_t* connection);
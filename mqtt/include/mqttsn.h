@@ -0,0 +1,77 @@
+#ifndef _MQTTSN_H_
+#define _MQTTSN_H_
+
+#include "user_interface.h"
+#include "espconn.h"
+
+/*
+ * MQTT-SN 1.2 client over UDP, for telemetry through an MQTT-SN gateway.
+ *
+ * Topics are registered with the gateway once per connection, and
+ * publishes then carry the 2 byte topic ID in place of the topic name.
+ * Topics with an ID predefined on the gateway can be published at QoS -1,
+ * which needs no connection at all. Only QoS -1 and 0 are sent, so there
+ * is nothing to resend. Subscriptions are to topic names, and inbound
+ * publishes are delivered with the name.
+ */
+
+#define MQTTSN_MAX_TOPICS 8
+#define MQTTSN_BUF_SIZE 512			// Largest packet sent or received
+
+typedef enum {
+	MQTTSN_IDLE,				// Not started, or stopped
+	MQTTSN_RESOLVING,			// Looking up the gateway
+	MQTTSN_CONNECTING,			// CONNECT sent, waiting for CONNACK
+	MQTTSN_REGISTERING,			// Registering topics and subscribing, one at a time
+	MQTTSN_ACTIVE,				// Ready to publish
+	MQTTSN_WAITING				// Waiting before the next connection attempt
+} tMqttSnState;
+
+// Topic flags
+#define MQTTSN_TOPIC_PREDEFINED 0x01	// ID set on the gateway, not registered
+#define MQTTSN_TOPIC_SUBSCRIBE 0x02		// Subscribed to on each connection
+#define MQTTSN_TOPIC_READY 0x04			// ID valid on this connection
+
+typedef struct {
+	char *name;					// NULL if the entry is free
+	uint16_t id;
+	uint8_t flags;
+} MQTTSN_TOPIC;
+
+typedef void (*MqttSnDataCallback)(uint32_t *args, const char* topic, uint32_t topic_len, const char *data, uint32_t length);
+
+typedef struct {
+	struct espconn conn;
+	esp_udp udp;
+	char *host;
+	uint16_t port;
+	ip_addr_t ip;
+	char *clientId;
+	uint16_t keepAlive;			// Seconds
+	BOOL created;				// conn has been made
+	uint8_t state;
+	uint8_t ticks;				// Seconds waiting for an answer, or before the next attempt
+	uint8_t retries;			// Times the request waiting for an answer has been sent
+	uint8_t waitDelay;			// Seconds to wait before the next connection attempt
+	uint8_t pendingType;		// Request waiting for an answer, 0 for none
+	uint16_t pendingId;
+	uint8_t pendingTopic;		// Topic the request is for
+	uint16_t msgId;
+	uint32_t keepAliveTick;		// Seconds since the last packet was sent
+	BOOL pingSent;				// PINGREQ waiting for PINGRESP
+	MQTTSN_TOPIC topics[MQTTSN_MAX_TOPICS];
+	MqttSnDataCallback dataCb;
+	ETSTimer timer;
+	uint8_t *buf;				// Packet being built
+} MQTTSN_Client;
+
+void ICACHE_FLASH_ATTR MQTTSN_Init(MQTTSN_Client *client, const char *host, uint16_t port, const char *clientId, uint16_t keepAlive);
+BOOL ICACHE_FLASH_ATTR MQTTSN_AddTopic(MQTTSN_Client *client, const char *topic, uint16_t predefinedId);
+BOOL ICACHE_FLASH_ATTR MQTTSN_Subscribe(MQTTSN_Client *client, const char *topic);
+void ICACHE_FLASH_ATTR MQTTSN_OnData(MQTTSN_Client *client, MqttSnDataCallback dataCb);
+void ICACHE_FLASH_ATTR MQTTSN_Connect(MQTTSN_Client *client);
+void ICACHE_FLASH_ATTR MQTTSN_Disconnect(MQTTSN_Client *client);
+BOOL ICACHE_FLASH_ATTR MQTTSN_Ready(MQTTSN_Client *client);
+BOOL ICACHE_FLASH_ATTR MQTTSN_Publish(MQTTSN_Client *client, const char *topic, const char *data, uint16_t data_length, int qos, int retain);
+
+#endif
@@ -31,14 +31,50 @@
 #ifndef USER_QUEUE_H_
 #define USER_QUEUE_H_
 #include "os_type.h"
-#include "ringbuf.h"
+
+/*
+ * Message queue.
+ *
+ * Message bytes are stored back to back in a ring, with the offset and
+ * length of each message kept in a separate descriptor table. A message
+ * is never split: if it won't fit before the end of the buffer it is
+ * written at the start instead. The peek functions return pointers into
+ * the ring, so queued messages can be handed directly to espconn_sent,
+ * and consecutive messages which are contiguous can be sent in one write.
+ * A message can also be built in place: reserve space for it, write it,
+ * then commit it with its final length.
+ * A message behind the oldest can be discarded. Its space is reclaimed
+ * when it reaches the head of the queue. A message can be shortened in
+ * place, which leaves a gap until it is popped.
+ */
+
+#define QUEUE_MAX_MSGS 32
+
+typedef struct {
+	uint16_t offset;
+	uint16_t len;
+} QUEUE_ENTRY;
+
 typedef struct {
 	uint8_t *buf;
-	RINGBUF rb;
+	uint16_t size;
+	uint16_t tail;			// Offset the next message is written at
+	uint8_t first;			// Descriptor of the oldest message
+	uint8_t count;			// Messages queued, including discarded ones
+	uint32_t discarded;		// Discarded descriptors, one bit each
+	QUEUE_ENTRY entries[QUEUE_MAX_MSGS];
 } QUEUE;
 
 void ICACHE_FLASH_ATTR QUEUE_Init(QUEUE *queue, int bufferSize);
-int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, uint8_t* buffer, uint16_t len);
-int32_t ICACHE_FLASH_ATTR QUEUE_Gets(QUEUE *queue, uint8_t* buffer, uint16_t* len, uint16_t maxLen);
+int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, const uint8_t* buffer, uint16_t len);
+uint8_t * ICACHE_FLASH_ATTR QUEUE_Reserve(QUEUE *queue, uint16_t len);
+void ICACHE_FLASH_ATTR QUEUE_Commit(QUEUE *queue, uint8_t *data, uint16_t len);
+BOOL ICACHE_FLASH_ATTR QUEUE_Peek(QUEUE *queue, uint8_t **buffer, uint16_t *len);
+BOOL ICACHE_FLASH_ATTR QUEUE_PeekAt(QUEUE *queue, uint8_t index, uint8_t **buffer, uint16_t *len);
+uint8_t ICACHE_FLASH_ATTR QUEUE_PeekRun(QUEUE *queue, uint16_t maxLen, uint8_t **buffer, uint16_t *len);
+void ICACHE_FLASH_ATTR QUEUE_Pop(QUEUE *queue);
+void ICACHE_FLASH_ATTR QUEUE_Discard(QUEUE *queue, uint8_t index);
+void ICACHE_FLASH_ATTR QUEUE_Trim(QUEUE *queue, uint8_t index, uint16_t len);
+uint16_t ICACHE_FLASH_ATTR QUEUE_Used(QUEUE *queue);
 BOOL ICACHE_FLASH_ATTR QUEUE_IsEmpty(QUEUE *queue);
 #endif /* USER_QUEUE_H_ */
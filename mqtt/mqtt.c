@@ -44,16 +44,1217 @@
 #define MQTT_TASK_QUEUE_SIZE    	1
 #define MQTT_SEND_TIMOUT			5
 
+#ifndef MQTT_CONTROL_QUEUE_SIZE
+#define MQTT_CONTROL_QUEUE_SIZE		256
+#endif
+
 #ifndef QUEUE_BUFFER_SIZE
 #define QUEUE_BUFFER_SIZE		 	2048
 #endif
 
-unsigned char *default_certificate;
-unsigned int default_certificate_len = 0;
-unsigned char *default_private_key;
-unsigned int default_private_key_len = 0;
+#ifndef MQTT_TELEMETRY_QUEUE_SIZE
+#define MQTT_TELEMETRY_QUEUE_SIZE	1536
+#endif
+
+/* Receive parser states */
+enum {MQTT_RX_HEADER = 0, MQTT_RX_LENGTH, MQTT_RX_BODY, MQTT_RX_SKIP};
+
+/* Fixed header: type byte and up to four remaining length bytes */
+#define MQTT_MAX_FIXED_HEADER_LEN	5
+
+#ifndef MQTT_INFLIGHT_BUF_SIZE
+#define MQTT_INFLIGHT_BUF_SIZE		2048
+#endif
+
+#ifndef MQTT_RETRANSMIT_TIMEOUT
+#define MQTT_RETRANSMIT_TIMEOUT		10
+#endif
+
+#define MQTT_DUP_FLAG				0x08
+
+/* Room needed to build a message besides its topic and payload: the
+   longest fixed header, topic length, message id and MQTT 5 properties */
+#define MQTT_BUILD_OVERHEAD			24
+
+#ifndef MQTT_PROTOCOL_VERSION
+#define MQTT_PROTOCOL_VERSION		MQTT_PROTOCOL_V5
+#endif
+
+#ifndef MQTT_RECONNECT_MAX
+#define MQTT_RECONNECT_MAX			120
+#endif
+
+#ifndef MQTT_DNS_TTL
+#define MQTT_DNS_TTL				600
+#endif
+
+#ifndef MQTT_FAILOVER_ATTEMPTS
+#define MQTT_FAILOVER_ATTEMPTS		3
+#endif
+
+#ifndef MQTT_FAILOVER_RTT
+#define MQTT_FAILOVER_RTT			1000
+#endif
+
+#ifndef MQTT_FAILOVER_SLOW_PINGS
+#define MQTT_FAILOVER_SLOW_PINGS	3
+#endif
+
+#ifndef MQTT_PROBE_TIMEOUT
+#define MQTT_PROBE_TIMEOUT			3
+#endif
+
+#ifndef MQTT_SEND_RETRIES
+#define MQTT_SEND_RETRIES			4
+#endif
+
+#ifndef MQTT_SESSION_EXPIRY
+#define MQTT_SESSION_EXPIRY			3600
+#endif
+
+#ifndef MQTT_RECEIVE_MAXIMUM
+#define MQTT_RECEIVE_MAXIMUM		8
+#endif
+
+#ifndef MQTT_SEND_BUF_SIZE
+#define MQTT_SEND_BUF_SIZE			2920	/* lwIP TCP_SND_BUF, 2 * TCP_MSS */
+#endif
+
+#ifndef MQTT_STREAM_CHUNK
+#define MQTT_STREAM_CHUNK			1024	/* Bytes per write of a streamed publish */
+#endif
+
+unsigned char *default_certificate;
+unsigned int default_certificate_len = 0;
+unsigned char *default_private_key;
+unsigned int default_private_key_len = 0;
+
+os_event_t mqtt_procTaskQueue[MQTT_TASK_QUEUE_SIZE];
+
+#ifdef MQTT_PROFILE
+/*
+ * Publish path benchmark. Cycle counts for queuing a publish and for
+ * handing it to espconn are averaged and printed every MQTT_PROFILE_COUNT
+ * publishes.
+ */
+
+#define MQTT_PROFILE_COUNT 32
+
+LOCAL uint32_t profQueueCycles, profSendCycles;
+LOCAL uint32_t profQueued, profSent;
+
+LOCAL inline uint32_t mqtt_ccount(void)
+{
+	uint32_t ccount;
+	__asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+	return ccount;
+}
+#endif
+
+#ifdef MQTT_METRICS
+#define MQTT_METRIC(x) x
+#else
+#define MQTT_METRIC(x)
+#endif
+
+LOCAL BOOL mqtt_reserve(MQTT_Client *client, uint8_t lane, uint16_t len);
+LOCAL BOOL mqtt_commit(MQTT_Client *client, uint8_t lane);
+
+#ifdef MQTT_METRICS
+/**
+  * @brief  Count a write about to be handed to espconn, and the packets
+  *         in it, and start timing it to the sent callback.
+  * @param  client: 	MQTT_Client reference
+  * @param  data: 		write
+  * @param  len: 		write length
+  * @param  packets: 	TRUE if the write starts with a packet, FALSE for
+  *                  	the rest of a streamed publish
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_metrics_write(MQTT_Client *client, uint8_t *data, uint16_t len, BOOL packets)
+{
+	MQTT_STATS *m = &client->metrics;
+	uint8_t type;
+	int n;
+
+	m->txBytes += len;
+	m->sendStart = system_get_time();
+	while(packets && len){
+		type = mqtt_get_type(data);
+		m->txPackets[type]++;
+		if(type == MQTT_MSG_TYPE_PINGREQ)
+			m->pingStart = m->sendStart;
+		n = mqtt_get_total_length(data, len);
+		// A streamed publish runs past the end of its first write
+		if(n >= len)
+			break;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+  * @brief  Time the write just acknowledged.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_metrics_sent(MQTT_Client *client)
+{
+	MQTT_STATS *m = &client->metrics;
+
+	m->sendUs = system_get_time() - m->sendStart;
+	if(m->sendUs > m->sendMaxUs)
+		m->sendMaxUs = m->sendUs;
+}
+#endif
+
+/**
+  * @brief  Pop the oldest message from a lane.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_queue_pop(MQTT_Client *client, uint8_t lane)
+{
+	MQTT_LANE *l = &client->lanes[lane];
+	uint8_t count = l->queue.count;
+
+	// Discarded messages behind the oldest go with it
+	QUEUE_Pop(&l->queue);
+	count -= l->queue.count;
+	l->stale = (l->stale > count) ? l->stale - count : 0;
+}
+
+/**
+  * @brief  Forget which topic aliases have been queued in a lane. Messages
+  *         already in the lane may use aliases the broker doesn't know, so
+  *         they are marked stale.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_alias_invalidate(MQTT_Client *client, uint8_t lane)
+{
+	uint8_t i;
+
+	for(i = 0; i < MQTT_MAX_TOPIC_ALIAS; i++)
+		client->aliases[i].lanes &= ~(1 << lane);
+	client->lanes[lane].stale = client->lanes[lane].queue.count;
+}
+
+/**
+  * @brief  Check for a queued publish which carries a topic alias.
+  * @param  client: 	MQTT_Client reference
+  * @param  msg: 		message
+  * @param  len: 		message length
+  * @retval TRUE if it does
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_has_alias(MQTT_Client *client, uint8_t *msg, uint16_t len)
+{
+	return client->mqtt_state.mqtt_connection.protocol_version == MQTT_PROTOCOL_V5 &&
+		mqtt_get_type(msg) == MQTT_MSG_TYPE_PUBLISH && mqtt_get_publish_alias(msg, len) != 0;
+}
+
+/**
+  * @brief  Rewrite the messages in a lane in place. With aliasOnly set,
+  *         the stale messages lose their topic aliases, for a broker which
+  *         no longer knows them: a publish which also carries its topic
+  *         keeps it, and one with only an alias is dropped. Otherwise every
+  *         message loses its MQTT 5 properties, for a broker which only
+  *         speaks 3.1.x.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @param  aliasOnly: TRUE to strip only the topic aliases of stale messages
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_lane_strip(MQTT_Client *client, uint8_t lane, BOOL aliasOnly)
+{
+	MQTT_LANE *l = &client->lanes[lane];
+	uint8_t *msg;
+	uint16_t msgLen, len;
+	uint8_t i = 0;
+
+	while(i < (aliasOnly ? l->stale : l->queue.count)){
+		if(!QUEUE_PeekAt(&l->queue, i, &msg, &msgLen) || (aliasOnly && !mqtt_has_alias(client, msg, msgLen))){
+			i++;
+			continue;
+		}
+		len = mqtt_msg_strip_properties(msg, msgLen, aliasOnly);
+		if(len){
+			QUEUE_Trim(&l->queue, i++, len);
+			continue;
+		}
+		INFO("MQTT: Dropping publish with stale topic alias\r\n");
+		if(i)
+			QUEUE_Discard(&l->queue, i++);
+		else
+			mqtt_queue_pop(client, lane);
+	}
+	if(aliasOnly)
+		l->stale = 0;
+}
+
+/**
+  * @brief  Choose the topic alias for a QoS 0 publish. A free alias is
+  *         assigned to a new topic while there are any left. Lanes are sent
+  *         out of order, so the alias is only used alone once the topic has
+  *         been queued with it in the same lane.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane the publish is for
+  * @param  topic: 	topic
+  * @param  props: 	publish properties to fill in
+  * @retval Alias table index, or -1 if the topic has no alias
+  */
+LOCAL int8_t ICACHE_FLASH_ATTR
+mqtt_topic_alias(MQTT_Client *client, uint8_t lane, const char *topic, mqtt_publish_properties_t *props)
+{
+	MQTT_TOPIC_ALIAS *a;
+	int8_t i, unused = -1;
+
+	for(i = 0; i < client->aliasMax; i++){
+		a = &client->aliases[i];
+		if(a->topic && !os_strcmp(a->topic, topic))
+			break;
+		if(!a->topic && unused < 0)
+			unused = i;
+	}
+	if(i == client->aliasMax){
+		if(unused < 0)
+			return -1;
+		i = unused;
+		a = &client->aliases[i];
+		a->topic = (char *)os_zalloc(os_strlen(topic) + 1);
+		os_strcpy(a->topic, topic);
+		a->lanes = 0;
+	}
+	props->topic_alias = i + 1;
+	props->alias_only = (a->lanes >> lane) & 1;
+	return i;
+}
+
+/**
+  * @brief  Check whether a queued publish is to a topic, following its
+  *         topic alias if it only carries that.
+  * @param  client: 	MQTT_Client reference
+  * @param  msg: 		message
+  * @param  len: 		message length
+  * @param  topic: 	topic
+  * @retval TRUE if it is
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_same_topic(MQTT_Client *client, uint8_t *msg, uint16_t len, const char *topic)
+{
+	const char *t;
+	uint16_t tlen = len;
+	uint16_t alias;
+
+	t = mqtt_get_publish_topic(msg, &tlen);
+	if(!t)
+		return FALSE;
+	if(!tlen){
+		alias = mqtt_get_publish_alias(msg, len);
+		if(!alias || alias > MQTT_MAX_TOPIC_ALIAS || !client->aliases[alias - 1].topic)
+			return FALSE;
+		t = client->aliases[alias - 1].topic;
+		tlen = os_strlen(t);
+	}
+	return tlen == os_strlen(topic) && !os_memcmp(t, topic, tlen);
+}
+
+/**
+  * @brief  Discard the queued QoS 0 publishes to a topic which haven't
+  *         started sending, for a lane which keeps only the latest.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @param  topic: 	topic
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_coalesce(MQTT_Client *client, uint8_t lane, const char *topic)
+{
+	MQTT_LANE *l = &client->lanes[lane];
+	uint8_t *msg;
+	uint16_t msgLen;
+	uint8_t i, j;
+
+	i = (client->sendCount && client->sendLane == lane) ? client->sendCount : 0;
+	while(i < l->queue.count){
+		if(!QUEUE_PeekAt(&l->queue, i, &msg, &msgLen) || mqtt_get_type(msg) != MQTT_MSG_TYPE_PUBLISH ||
+			mqtt_get_qos(msg) > 0 || !mqtt_same_topic(client, msg, msgLen, topic)){
+			i++;
+			continue;
+		}
+		l->coalesced++;
+		if(i)
+			QUEUE_Discard(&l->queue, i++);
+		else
+			mqtt_queue_pop(client, lane);
+		// The discarded publish may have set up the alias, so the next one has to
+		for(j = 0; j < MQTT_MAX_TOPIC_ALIAS; j++){
+			if(client->aliases[j].topic && !os_strcmp(client->aliases[j].topic, topic))
+				client->aliases[j].lanes &= ~(1 << lane);
+		}
+	}
+}
+
+/**
+  * @brief  Find an unacknowledged publish in the in-flight table.
+  * @param  client: 	MQTT_Client reference
+  * @param  id: 		message id
+  * @retval Table index, or -1 if not found
+  */
+LOCAL int8_t ICACHE_FLASH_ATTR
+mqtt_inflight_find(MQTT_Client *client, uint16_t id)
+{
+	uint8_t i;
+
+	for(i = 0; i < client->inflightQueue.count; i++){
+		if(client->inflight[i].id == id && client->inflight[i].state != MQTT_INFLIGHT_DONE)
+			return i;
+	}
+	return -1;
+}
+
+/**
+  * @brief  Keep a copy of a QoS 1 or 2 publish about to be sent.
+  * @param  client: 	MQTT_Client reference
+  * @param  data: 	message
+  * @param  len: 		message length
+  * @param  id: 		message id
+  * @retval FALSE if the in-flight window is full
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_inflight_add(MQTT_Client *client, const uint8_t *data, uint16_t len, uint16_t id)
+{
+	uint8_t n = client->inflightQueue.count;
+
+	if(n >= client->inflightMax || QUEUE_Puts(&client->inflightQueue, data, len) == -1)
+		return FALSE;
+	client->inflight[n].id = id;
+	client->inflight[n].state = MQTT_INFLIGHT_SENDING;
+	client->inflight[n].ticks = 0;
+	return TRUE;
+}
+
+/**
+  * @brief  Free acknowledged publishes at the head of the in-flight queue.
+  *         Nothing is freed while espconn may be sending from the queue.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_inflight_purge(MQTT_Client *client)
+{
+	if(client->sendInflight)
+		return;
+	while(client->inflightQueue.count && client->inflight[0].state == MQTT_INFLIGHT_DONE){
+		QUEUE_Pop(&client->inflightQueue);
+		os_memmove(&client->inflight[0], &client->inflight[1], client->inflightQueue.count * sizeof(MQTT_INFLIGHT));
+	}
+}
+
+/**
+  * @brief  Update the in-flight table for a PUBACK, PUBREC or PUBCOMP.
+  * @param  client: 	MQTT_Client reference
+  * @param  type: 	message type
+  * @param  id: 		message id
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_inflight_ack(MQTT_Client *client, uint8_t type, uint16_t id)
+{
+	int8_t i = mqtt_inflight_find(client, id);
+
+	if(i < 0){
+		INFO("MQTT: Ack type: %d for unknown id: %04X\r\n", type, id);
+		return;
+	}
+	if(type == MQTT_MSG_TYPE_PUBREC){
+		client->inflight[i].state = MQTT_INFLIGHT_PUBCOMP;
+		client->inflight[i].ticks = 0;
+	}
+	else {
+		client->inflight[i].state = MQTT_INFLIGHT_DONE;
+		mqtt_inflight_purge(client);
+	}
+}
+
+/**
+  * @brief  One second tick for the in-flight table. Publishes not
+  *         acknowledged within MQTT_RETRANSMIT_TIMEOUT are sent again with
+  *         the DUP flag set, and a PUBREL without a PUBCOMP is repeated.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_inflight_timer(MQTT_Client *client)
+{
+	MQTT_INFLIGHT *e;
+	uint8_t i;
+
+	for(i = 0; i < client->inflightQueue.count; i++){
+		e = &client->inflight[i];
+		if(e->state != MQTT_INFLIGHT_PUBACK && e->state != MQTT_INFLIGHT_PUBCOMP)
+			continue;
+		if(++e->ticks < MQTT_RETRANSMIT_TIMEOUT)
+			continue;
+		e->ticks = 0;
+		if(e->state == MQTT_INFLIGHT_PUBACK){
+			INFO("MQTT: No ack for id: %04X, resending\r\n", e->id);
+			e->state = MQTT_INFLIGHT_RESEND;
+		}
+		else {
+			INFO("MQTT: No PUBCOMP for id: %04X, resending PUBREL\r\n", e->id);
+			if(mqtt_reserve(client, MQTT_LANE_CONTROL, MQTT_BUILD_OVERHEAD)){
+				client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, e->id);
+				mqtt_commit(client, MQTT_LANE_CONTROL);
+			}
+		}
+		system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	}
+}
+
+/**
+  * @brief  Prepare the in-flight table for a new connection. Publishes
+  *         which were sent but not acknowledged are delivered again, and
+  *         those in the interrupted write go again from the outbound queue.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_inflight_reconnect(MQTT_Client *client)
+{
+	MQTT_INFLIGHT *e;
+	uint8_t i;
+
+	client->sendInflight = FALSE;
+	for(i = 0; i < client->inflightQueue.count; i++){
+		e = &client->inflight[i];
+		switch(e->state){
+		case MQTT_INFLIGHT_SENDING:
+			e->state = MQTT_INFLIGHT_UNSENT;
+			break;
+		case MQTT_INFLIGHT_PUBACK:
+		case MQTT_INFLIGHT_RESENDING:
+			e->state = MQTT_INFLIGHT_RESEND;
+			break;
+		case MQTT_INFLIGHT_PUBCOMP:
+			// Repeat the PUBREL on the first tick
+			e->ticks = MQTT_RETRANSMIT_TIMEOUT - 1;
+			break;
+		}
+	}
+	mqtt_inflight_purge(client);
+}
+
+/**
+  * @brief  Make room in a lane for a message of up to len bytes, and point
+  *         the message builder at it so the message is built in place.
+  *         When the lane is full, the lane's policy either drops the oldest
+  *         messages to make room or refuses the new one. A message being
+  *         sent can't be dropped. A dropped QoS 1 or 2 publish is sent from
+  *         the in-flight queue.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @param  len: 		most the message can take
+  * @retval TRUE if there is room, the message is then added by mqtt_commit
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_reserve(MQTT_Client *client, uint8_t lane, uint16_t len)
+{
+	MQTT_LANE *l = &client->lanes[lane];
+	uint8_t *p, *msg;
+	uint16_t msgLen;
+	BOOL alias;
+	int8_t i;
+
+	while(!(p = QUEUE_Reserve(&l->queue, len))){
+		l->dropped++;
+		if(l->policy == MQTT_DROP_NEWEST || QUEUE_IsEmpty(&l->queue) || (client->sendCount && client->sendLane == lane)){
+			INFO("MQTT: Lane %d full, message dropped\r\n", lane);
+			return FALSE;
+		}
+		INFO("MQTT: Lane %d full, dropping oldest\r\n", lane);
+		QUEUE_Peek(&l->queue, &msg, &msgLen);
+		if(mqtt_get_type(msg) == MQTT_MSG_TYPE_PUBLISH && mqtt_get_qos(msg) > 0){
+			i = mqtt_inflight_find(client, mqtt_get_id(msg, msgLen));
+			if(i >= 0 && client->inflight[i].state == MQTT_INFLIGHT_UNSENT)
+				client->inflight[i].state = MQTT_INFLIGHT_RESEND;
+		}
+		alias = mqtt_has_alias(client, msg, msgLen);
+		mqtt_queue_pop(client, lane);
+		// Later publishes may rely on an alias set up by this one
+		if(alias)
+			mqtt_alias_invalidate(client, lane);
+	}
+	mqtt_msg_set_buffer(&client->mqtt_state.mqtt_connection, p, len);
+	return TRUE;
+}
+
+/**
+  * @brief  Add the message just built by mqtt_reserve to its lane. The
+  *         builder leaves room for the longest fixed header, so a message
+  *         with a shorter one is moved down to keep the lane contiguous.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @retval TRUE if queued, FALSE if the message couldn't be built
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_commit(MQTT_Client *client, uint8_t lane)
+{
+	mqtt_message_t *m = client->mqtt_state.outbound_message;
+	uint8_t *p = client->mqtt_state.mqtt_connection.buffer;
+
+	client->mqtt_state.outbound_message = NULL;
+	if(!m || !m->length)
+		return FALSE;
+	if(m->data != p)
+		os_memmove(p, m->data, m->length);
+	QUEUE_Commit(&client->lanes[lane].queue, p, m->length);
+#ifdef MQTT_METRICS
+	if(QUEUE_Used(&client->lanes[lane].queue) > client->metrics.laneHigh[lane])
+		client->metrics.laneHigh[lane] = QUEUE_Used(&client->lanes[lane].queue);
+#endif
+	return TRUE;
+}
+
+/**
+  * @brief  Note the time from link up to the first publish handed to
+  *         espconn, once per run of connection attempts.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_link_timed(MQTT_Client *client)
+{
+	if(!client->linkTiming)
+		return;
+	client->linkTiming = FALSE;
+	client->connectMs = (system_get_time() - client->linkUpTime) / 1000;
+	INFO("MQTT: First publish %d ms after link up\r\n", client->connectMs);
+}
+
+/**
+  * @brief  Close the TCP connection. The disconnect callback starts the
+  *         reconnect.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_tcp_disconnect(MQTT_Client *client)
+{
+	if(client->security){
+		espconn_secure_disconnect(client->pCon);
+	}
+	else {
+		espconn_disconnect(client->pCon);
+	}
+}
+
+/**
+  * @brief  Hand a write to espconn.
+  * @param  client: 	MQTT_Client reference
+  * @param  data: 		write
+  * @param  len: 		write length
+  * @retval TRUE if espconn took it
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_espconn_send(MQTT_Client *client, uint8_t *data, uint16_t len)
+{
+	sint8 err;
+
+	if(client->security){
+		err = espconn_secure_sent(client->pCon, data, len);
+	}
+	else{
+		err = espconn_sent(client->pCon, data, len);
+	}
+	if(err != ESPCONN_OK){
+		INFO("MQTT: espconn refused %d bytes, error %d\r\n", len, err);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+  * @brief  Undo a write espconn refused, so the same messages go in the
+  *         next one, and wait before trying again. ESPCONN_MEM usually
+  *         clears once lwIP has freed some buffers; after
+  *         MQTT_SEND_RETRIES refusals in a row the connection is dropped.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_send_refused(MQTT_Client *client)
+{
+	uint8_t i;
+
+	client->sendTimeout = 0;
+	client->sendCount = 0;
+	client->sendPublishes = 0;
+	if(client->sendInflight){
+		client->sendInflight = FALSE;
+		for(i = 0; i < client->inflightQueue.count; i++){
+			if(client->inflight[i].state == MQTT_INFLIGHT_RESENDING)
+				client->inflight[i].state = MQTT_INFLIGHT_RESEND;
+		}
+	}
+	if(client->sendStream){
+		client->sendStream = FALSE;
+		client->stream.chunk = 0;
+		// The header is built again with the first chunk
+		if(client->stream.offset == 0)
+			client->stream.started = FALSE;
+	}
+	if(++client->sendRetries > MQTT_SEND_RETRIES){
+		INFO("MQTT: Writes refused, reconnecting\r\n");
+		client->sendRetries = 0;
+		MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_SEND_REFUSED);
+		mqtt_tcp_disconnect(client);
+		return;
+	}
+	client->sendBackoff = 1 << (client->sendRetries - 1);
+	INFO("MQTT: Trying again in %d s\r\n", client->sendBackoff);
+}
+
+/**
+  * @brief  Send a publish which needs resending, straight from the
+  *         in-flight queue, with the DUP flag set.
+  * @param  client: 	MQTT_Client reference
+  * @retval TRUE if a resend was started, or refused by espconn
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_send_inflight(MQTT_Client *client)
+{
+	uint8_t *data;
+	uint16_t dataLen;
+	uint8_t i;
+
+	for(i = 0; i < client->inflightQueue.count; i++){
+		if(client->inflight[i].state == MQTT_INFLIGHT_RESEND)
+			break;
+	}
+	if(i == client->inflightQueue.count)
+		return FALSE;
+
+	QUEUE_PeekAt(&client->inflightQueue, i, &data, &dataLen);
+	data[0] |= MQTT_DUP_FLAG;
+	client->inflight[i].state = MQTT_INFLIGHT_RESENDING;
+	client->mqtt_state.pending_msg_type = MQTT_MSG_TYPE_PUBLISH;
+	client->mqtt_state.pending_msg_id = client->inflight[i].id;
+
+	client->sendTimeout = MQTT_SEND_TIMOUT;
+	client->keepAliveTick = 0;
+	client->sendInflight = TRUE;
+	INFO("MQTT: Resending id: %04X\r\n", client->inflight[i].id);
+	if(!mqtt_espconn_send(client, data, dataLen)){
+		mqtt_send_refused(client);
+		return TRUE;
+	}
+	MQTT_METRIC(mqtt_metrics_write(client, data, dataLen, TRUE));
+	mqtt_link_timed(client);
+	return TRUE;
+}
+
+/**
+  * @brief  Send the oldest messages in a lane which are contiguous in the
+  *         queue and fit in the TCP send buffer, in one write. They are sent
+  *         straight from the queue and popped in the sent callback. QoS 1
+  *         and 2 publishes are copied to the in-flight queue, and the write
+  *         stops short at one which doesn't fit in the in-flight window.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 	lane
+  * @retval TRUE if a write was started, or refused by espconn
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_send_lane(MQTT_Client *client, uint8_t lane)
+{
+	MQTT_LANE *l = &client->lanes[lane];
+	uint8_t *data, *msg;
+	uint16_t dataLen, msgLen, len;
+	uint16_t id;
+	uint8_t i, n, type;
+	int8_t j;
+#ifdef MQTT_PROFILE
+	uint32_t start = mqtt_ccount();
+#endif
+
+	// Topic aliases from before this connection mean nothing to the broker
+	if(l->stale)
+		mqtt_lane_strip(client, lane, TRUE);
+	n = QUEUE_PeekRun(&l->queue, MQTT_SEND_BUF_SIZE, &data, &dataLen);
+	if(!n)
+		return FALSE;
+
+	client->sendPublishes = 0;
+	len = 0;
+	for(i = 0; i < n; i++){
+		QUEUE_PeekAt(&l->queue, i, &msg, &msgLen);
+		type = mqtt_get_type(msg);
+		id = mqtt_get_id(msg, msgLen);
+		if(type == MQTT_MSG_TYPE_PUBLISH && mqtt_get_qos(msg) > 0){
+			j = mqtt_inflight_find(client, id);
+			if(j >= 0)
+				client->inflight[j].state = MQTT_INFLIGHT_SENDING;
+			else if(!mqtt_inflight_add(client, msg, msgLen, id))
+				break;
+		}
+		client->mqtt_state.pending_msg_type = type;
+		client->mqtt_state.pending_msg_id = id;
+		if(type == MQTT_MSG_TYPE_PUBLISH)
+			client->sendPublishes++;
+		len += msgLen;
+	}
+	if(!i){
+		INFO("MQTT: In-flight window full, lane %d waiting\r\n", lane);
+		return FALSE;
+	}
+	n = i;
+	dataLen = len;
+
+	client->sendTimeout = MQTT_SEND_TIMOUT;
+	client->keepAliveTick = 0;
+	client->sendCount = n;
+	client->sendLane = lane;
+	INFO("MQTT: Sending %d message(s) from lane %d, %d bytes, last type: %d, id: %04X\r\n", n, lane, dataLen, client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
+	client->mqtt_state.outbound_message = NULL;
+	if(!mqtt_espconn_send(client, data, dataLen)){
+		mqtt_send_refused(client);
+		return TRUE;
+	}
+	MQTT_METRIC(mqtt_metrics_write(client, data, dataLen, TRUE));
+	if(client->sendPublishes)
+		mqtt_link_timed(client);
+
+#ifdef MQTT_PROFILE
+	profSendCycles += mqtt_ccount() - start;
+	profSent += n;
+	if(profSent >= MQTT_PROFILE_COUNT){
+		INFO("MQTT: profile, %d cycles/queue, %d cycles/send\r\n",
+			profQueueCycles / (profQueued ? profQueued : 1), profSendCycles / profSent);
+		profQueueCycles = profSendCycles = 0;
+		profQueued = profSent = 0;
+	}
+#endif
+	return TRUE;
+}
+
+/**
+  * @brief  Finish with the streamed publish, sent or not, and let the
+  *         source go.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_stream_end(MQTT_Client *client)
+{
+	MQTT_STREAM *s = &client->stream;
+
+	if(!s->fill)
+		return;
+	s->fill(s->arg, s->offset, NULL, 0);
+	os_free(s->topic);
+	os_free(s->buf);
+	os_memset(s, 0, sizeof(MQTT_STREAM));
+}
+
+/**
+  * @brief  Send the next chunk of the streamed publish, the fixed header
+  *         and topic first. Once the header is out the broker expects the
+  *         whole payload, so a source which comes up short ends the
+  *         connection.
+  * @param  client: 	MQTT_Client reference
+  * @retval TRUE if a write was started, or refused by espconn
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_send_stream(MQTT_Client *client)
+{
+	MQTT_STREAM *s = &client->stream;
+	mqtt_message_t *m;
+	uint16_t len = 0, n, id;
+
+	if(!s->fill)
+		return FALSE;
+	if(!s->started){
+		mqtt_msg_set_buffer(&client->mqtt_state.mqtt_connection, s->buf, MQTT_STREAM_CHUNK);
+		m = mqtt_msg_publish_header(&client->mqtt_state.mqtt_connection, s->topic, s->length, 0, s->retain, &id);
+		if(!m->length || (client->maxPacketSize && m->length + s->length > client->maxPacketSize)){
+			INFO("MQTT: Streamed publish too big for the broker\r\n");
+			mqtt_stream_end(client);
+			return FALSE;
+		}
+		os_memmove(s->buf, m->data, m->length);
+		len = m->length;
+	}
+	n = MQTT_STREAM_CHUNK - len;
+	if(n > s->length - s->offset)
+		n = s->length - s->offset;
+	if(n && s->fill(s->arg, s->offset, s->buf + len, n) != n){
+		INFO("MQTT: Streamed publish source failed at %d\r\n", s->offset);
+		if(s->started)
+			mqtt_tcp_disconnect(client);
+		mqtt_stream_end(client);
+		return FALSE;
+	}
+	s->started = TRUE;
+	s->chunk = n;
+	len += n;
+
+	client->mqtt_state.pending_msg_type = MQTT_MSG_TYPE_PUBLISH;
+	client->mqtt_state.pending_msg_id = 0;
+	client->sendPublishes = (s->offset + n == s->length) ? 1 : 0;
+	client->sendTimeout = MQTT_SEND_TIMOUT;
+	client->keepAliveTick = 0;
+	client->sendStream = TRUE;
+	INFO("MQTT: Streaming %d of %d bytes\r\n", s->offset + n, s->length);
+	if(!mqtt_espconn_send(client, s->buf, len)){
+		mqtt_send_refused(client);
+		return TRUE;
+	}
+	MQTT_METRIC(mqtt_metrics_write(client, s->buf, len, s->offset == 0));
+	mqtt_link_timed(client);
+	return TRUE;
+}
+
+/**
+  * @brief  Start the next write: protocol control messages first, then
+  *         resends, then the other lanes in priority order, then the
+  *         streamed publish. A lane held up by the in-flight window doesn't
+  *         block the lanes below it. Nothing can go between the chunks of
+  *         a streamed publish once it has started.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_send_queued(MQTT_Client *client)
+{
+	uint8_t lane;
+
+	if(client->connState != MQTT_DATA || !client->pCon || client->sendCount || client->sendInflight || client->sendStream || client->sendTimeout != 0 || client->sendBackoff)
+		return;
+	if(client->stream.started){
+		mqtt_send_stream(client);
+		return;
+	}
+	if(mqtt_send_lane(client, MQTT_LANE_CONTROL))
+		return;
+	if(mqtt_send_inflight(client))
+		return;
+	for(lane = MQTT_LANE_CONTROL + 1; lane < MQTT_LANES; lane++){
+		if(mqtt_send_lane(client, lane))
+			return;
+	}
+	mqtt_send_stream(client);
+}
+
+/**
+  * @brief  Choose the wait before the next connection attempt. It doubles
+  *         with each attempt which isn't accepted, up to MQTT_RECONNECT_MAX,
+  *         and a random part of it is taken off so nodes which lost the
+  *         broker together don't all come back together.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_backoff(MQTT_Client *client)
+{
+	uint32_t delay = MQTT_RECONNECT_TIMEOUT;
+	uint8_t i;
+
+	for(i = 0; i < client->reconnectAttempts && delay < MQTT_RECONNECT_MAX; i++)
+		delay <<= 1;
+	if(delay > MQTT_RECONNECT_MAX)
+		delay = MQTT_RECONNECT_MAX;
+	client->reconnectDelay = delay - os_random() % (delay / 2 + 1);
+	if(client->reconnectAttempts < 255)
+		client->reconnectAttempts++;
+}
+
+/**
+  * @brief  Make the broker at a position in the ranking the one connected
+  *         to. The address found by its probe is used if there is one.
+  * @param  client: 	MQTT_Client reference
+  * @param  rank: 		position in rank
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_broker_use(MQTT_Client *client, uint8_t rank)
+{
+	MQTT_BROKER *b = &client->brokers[client->rank[rank]];
+
+	client->brokerRank = rank;
+	client->host = b->host;
+	client->port = b->port;
+	client->dnsValid = FALSE;
+	if(b->ip.addr){
+		client->ip.addr = b->ip.addr;
+		client->dnsValid = TRUE;
+		client->dnsAge = 0;
+		b->ip.addr = 0;
+	}
+	client->reconnectAttempts = 0;
+	client->slowPings = 0;
+	INFO("MQTT: Using broker %s:%d\r\n", client->host, client->port);
+	if(client->brokerCb)
+		client->brokerCb((uint32_t*)client);
+}
+
+/**
+  * @brief  Move to the next broker in the ranking. After the last one the
+  *         brokers are probed and ranked again before the next attempt.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_broker_next(MQTT_Client *client)
+{
+	client->failover = FALSE;
+	if(client->brokerRank + 1 >= client->brokerCount){
+		INFO("MQTT: Tried every broker, probing again\r\n");
+		client->ranked = FALSE;
+		return;
+	}
+	mqtt_broker_use(client, client->brokerRank + 1);
+}
+
+/**
+  * @brief  Rank the brokers by probe time, fastest first. Those which
+  *         didn't answer go last, and ties keep the configured order.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_broker_rank(MQTT_Client *client)
+{
+	uint8_t i, j, t;
+	uint32_t rtt;
+
+	for(i = 0; i < client->brokerCount; i++)
+		client->rank[i] = i;
+	for(i = 1; i < client->brokerCount; i++){
+		t = client->rank[i];
+		rtt = client->brokers[t].rttUs;
+		for(j = i; j > 0 && rtt; j--){
+			if(client->brokers[client->rank[j - 1]].rttUs && client->brokers[client->rank[j - 1]].rttUs <= rtt)
+				break;
+			client->rank[j] = client->rank[j - 1];
+		}
+		client->rank[j] = t;
+	}
+	for(i = 0; i < client->brokerCount; i++)
+		INFO("MQTT: Broker %d %s:%d, %d us\r\n", i, client->brokers[client->rank[i]].host,
+			client->brokers[client->rank[i]].port, client->brokers[client->rank[i]].rttUs);
+}
 
-os_event_t mqtt_procTaskQueue[MQTT_TASK_QUEUE_SIZE];
+LOCAL void ICACHE_FLASH_ATTR mqtt_probe_next(MQTT_Client *client);
+
+/**
+  * @brief  Finish the probe of a broker. The next one is started from the
+  *         task, as espconn can't be asked to connect or disconnect from
+  *         inside its own callbacks. Callbacks from an earlier probe are
+  *         ignored.
+  * @param  client: 	MQTT_Client reference
+  * @param  pCon: 		probe connection of the broker
+  * @param  rtt: 		connect time in microseconds, 0 if it didn't answer
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_done(MQTT_Client *client, struct espconn *pCon, uint32_t rtt)
+{
+	if(client->connState != BROKER_PROBING || pCon != &client->probeCon[client->probe] || client->probeNext)
+		return;
+	client->brokers[client->probe].rttUs = rtt;
+	client->probe++;
+	client->probeNext = TRUE;
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+}
+
+/**
+  * @brief  Close the probe connections which answered. Called from the
+  *         task; each stays busy until its disconnect callback.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_close(MQTT_Client *client)
+{
+	uint8_t i;
+
+	for(i = 0; client->probeOpen; i++){
+		if(client->probeOpen & (1 << i)){
+			client->probeOpen &= ~(1 << i);
+			espconn_disconnect(&client->probeCon[i]);
+		}
+	}
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_connect_cb(void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
+	uint32_t rtt = system_get_time() - client->probeStart;
+
+	// Even a late answer has to be closed
+	client->probeOpen |= 1 << (pCon - client->probeCon);
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	mqtt_probe_done(client, pCon, rtt ? rtt : 1);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_discon_cb(void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
+
+	client->probeBusy &= ~(1 << (pCon - client->probeCon));
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_recon_cb(void *arg, sint8 errType)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
+
+	// The connection is gone, no disconnect callback follows
+	client->probeBusy &= ~(1 << (pCon - client->probeCon));
+	mqtt_probe_done(client, pCon, 0);
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	struct espconn *pCon = (struct espconn *)arg;
+	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
+	MQTT_BROKER *b;
+
+	if(client->connState != BROKER_PROBING || pCon != &client->probeCon[client->probe] || client->probeNext ||
+		ipaddr == NULL || ipaddr->addr == 0){
+		client->probeBusy &= ~(1 << (pCon - client->probeCon));
+		mqtt_probe_done(client, pCon, 0);
+		return;
+	}
+	b = &client->brokers[client->probe];
+	b->ip.addr = ipaddr->addr;
+	os_memcpy(pCon->proto.tcp->remote_ip, &b->ip.addr, 4);
+	client->probeStart = system_get_time();
+	espconn_connect(pCon);
+}
+
+/**
+  * @brief  Probe the next broker, timing how long it takes to accept a
+  *         TCP connection. Once they have all been probed, rank them and
+  *         connect to the fastest.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_next(MQTT_Client *client)
+{
+	struct espconn *pCon;
+	esp_tcp *tcp;
+	MQTT_BROKER *b;
+
+	client->probeTick = 0;
+	// A connection from the last round still closing can't be set up again
+	while(client->probe < client->brokerCount && (client->probeBusy & (1 << client->probe))){
+		INFO("MQTT: Broker %s still closing its last probe\r\n", client->brokers[client->probe].host);
+		client->brokers[client->probe].rttUs = 0;
+		client->probe++;
+	}
+	if(client->probe >= client->brokerCount){
+		mqtt_broker_rank(client);
+		client->ranked = TRUE;
+		mqtt_broker_use(client, 0);
+		client->connState = TCP_RECONNECT;
+		system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+		return;
+	}
+	b = &client->brokers[client->probe];
+	pCon = &client->probeCon[client->probe];
+	tcp = pCon->proto.tcp;
+	os_memset(pCon, 0, sizeof(struct espconn));
+	os_memset(tcp, 0, sizeof(esp_tcp));
+	pCon->proto.tcp = tcp;
+	pCon->type = ESPCONN_TCP;
+	pCon->state = ESPCONN_NONE;
+	pCon->reverse = client;
+	tcp->local_port = espconn_port();
+	tcp->remote_port = b->port;
+	espconn_regist_connectcb(pCon, mqtt_probe_connect_cb);
+	espconn_regist_disconcb(pCon, mqtt_probe_discon_cb);
+	espconn_regist_reconcb(pCon, mqtt_probe_recon_cb);
+	b->ip.addr = 0;
+	INFO("MQTT: Probing broker %s:%d\r\n", b->host, b->port);
+	client->probeBusy |= 1 << client->probe;
+	if(UTILS_StrToIP(b->host, &tcp->remote_ip)){
+		client->probeStart = system_get_time();
+		espconn_connect(pCon);
+		return;
+	}
+	switch(espconn_gethostbyname(pCon, b->host, &b->ip, mqtt_probe_dns_found)){
+	case ESPCONN_OK:
+		mqtt_probe_dns_found(b->host, &b->ip, pCon);
+		break;
+	case ESPCONN_INPROGRESS:
+		break;
+	default:
+		client->probeBusy &= ~(1 << client->probe);
+		mqtt_probe_done(client, pCon, 0);
+		break;
+	}
+}
+
+/**
+  * @brief  Start probing the brokers.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_probe_start(MQTT_Client *client)
+{
+	uint8_t i;
+
+	// Already under way
+	if(client->connState == BROKER_PROBING)
+		return;
+	// Kept from one round to the next, as a late callback may still refer to them
+	if(!client->probeCon){
+		client->probeCon = (struct espconn *)os_zalloc(MQTT_MAX_BROKERS * sizeof(struct espconn));
+		for(i = 0; i < MQTT_MAX_BROKERS; i++)
+			client->probeCon[i].proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
+	}
+	client->connState = BROKER_PROBING;
+	client->probe = 0;
+	client->probeNext = FALSE;
+	mqtt_probe_next(client);
+}
+
+/**
+  * @brief  Open the TCP connection to the broker's address in ip.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_tcp_connect(MQTT_Client *client)
+{
+	os_memcpy(client->pCon->proto.tcp->remote_ip, &client->ip.addr, 4);
+	if(client->security){
+		espconn_secure_connect(client->pCon);
+	}
+	else {
+		espconn_connect(client->pCon);
+	}
+
+	client->connState = TCP_CONNECTING;
+	INFO("TCP: connecting...\r\n");
+}
 
 LOCAL void ICACHE_FLASH_ATTR
 mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
@@ -62,7 +1263,7 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 	MQTT_Client* client = (MQTT_Client *)pConn->reverse;
 
 
-	if(ipaddr == NULL)
+	if(ipaddr == NULL || ipaddr->addr == 0)
 	{
 		INFO("DNS: Found, but got no ip, try to reconnect\r\n");
 		client->connState = TCP_RECONNECT_REQ;
@@ -75,43 +1276,470 @@ mqtt_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
 			*((uint8 *) &ipaddr->addr + 2),
 			*((uint8 *) &ipaddr->addr + 3));
 
-	if(client->ip.addr == 0 && ipaddr->addr != 0)
-	{
-		os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
-		if(client->security){
-			espconn_secure_connect(client->pCon);
-		}
-		else {
-			espconn_connect(client->pCon);
+	if(client->connState == DNS_RESOLVE)
+	{
+		client->ip.addr = ipaddr->addr;
+		client->dnsValid = TRUE;
+		client->dnsAge = 0;
+		mqtt_tcp_connect(client);
+	}
+
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+}
+
+
+
+LOCAL void ICACHE_FLASH_ATTR
+deliver_publish(MQTT_Client* client, uint8_t* message, int length)
+{
+	mqtt_event_data_t event_data;
+
+	event_data.topic_length = length;
+	event_data.topic = mqtt_get_publish_topic(message, &event_data.topic_length);
+	event_data.data_length = length;
+	event_data.data = mqtt_get_publish_data(message, &event_data.data_length, client->mqtt_state.mqtt_connection.protocol_version);
+
+	if(client->dataCb)
+		client->dataCb((uint32_t*)client, event_data.topic, event_data.topic_length, event_data.data, event_data.data_length);
+
+}
+
+
+/**
+  * @brief  Find a tracked subscription.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 	topic filter
+  * @retval Table index, or -1 if not found
+  */
+LOCAL int8_t ICACHE_FLASH_ATTR
+mqtt_sub_find(MQTT_Client *client, const char *topic)
+{
+	int8_t i;
+
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		if(client->subs[i].topic && !os_strcmp(client->subs[i].topic, topic))
+			return i;
+	}
+	return -1;
+}
+
+/**
+  * @brief  Start tracking a subscription.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 	topic filter
+  * @retval Table index, or -1 if the table is full
+  */
+LOCAL int8_t ICACHE_FLASH_ATTR
+mqtt_sub_add(MQTT_Client *client, const char *topic)
+{
+	MQTT_SUBSCRIPTION *s;
+	int8_t i;
+
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		s = &client->subs[i];
+		if(!s->topic){
+			s->topic = (char *)os_zalloc(os_strlen(topic) + 1);
+			os_strcpy(s->topic, topic);
+			s->state = MQTT_SUB_NONE;
+			return i;
+		}
+	}
+	INFO("MQTT: Subscription table full, %s not tracked\r\n", topic);
+	return -1;
+}
+
+/**
+  * @brief  Build one SUBSCRIBE for every subscription which needs sending,
+  *         in the buffer the message builder points at, and mark them
+  *         waiting for the SUBACK.
+  * @param  client: 	MQTT_Client reference
+  * @retval Length of the SUBSCRIBE, 0 if there was nothing to send or it didn't fit
+  */
+LOCAL uint16_t ICACHE_FLASH_ATTR
+mqtt_sub_build(MQTT_Client *client)
+{
+	const char *topics[MQTT_MAX_SUBSCRIPTIONS];
+	uint8_t qos[MQTT_MAX_SUBSCRIPTIONS];
+	mqtt_message_t *m;
+	uint16_t id;
+	uint8_t i, n = 0;
+
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		if(client->subs[i].topic && client->subs[i].state == MQTT_SUB_NONE){
+			topics[n] = client->subs[i].topic;
+			qos[n++] = client->subs[i].qos;
+		}
+	}
+	if(!n)
+		return 0;
+	m = mqtt_msg_subscribe_multi(&client->mqtt_state.mqtt_connection, topics, qos, n, &id);
+	client->mqtt_state.outbound_message = m;
+	if(!m->length)
+		return 0;
+	INFO("MQTT: subscribe to %d topic(s), id: %d\r\n", n, id);
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		if(client->subs[i].topic && client->subs[i].state == MQTT_SUB_NONE){
+			client->subs[i].id = id;
+			client->subs[i].state = MQTT_SUB_PENDING;
+		}
+	}
+	return m->length;
+}
+
+/**
+  * @brief  Queue one SUBSCRIBE in the control lane for every subscription
+  *         which needs sending.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_sub_queue(MQTT_Client *client)
+{
+	uint16_t len = MQTT_BUILD_OVERHEAD;
+	uint8_t i;
+
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		if(client->subs[i].topic && client->subs[i].state == MQTT_SUB_NONE)
+			len += os_strlen(client->subs[i].topic) + 3;
+	}
+	if(len == MQTT_BUILD_OVERHEAD || !mqtt_reserve(client, MQTT_LANE_CONTROL, len))
+		return;
+	if(mqtt_sub_build(client))
+		mqtt_commit(client, MQTT_LANE_CONTROL);
+	else
+		client->mqtt_state.outbound_message = NULL;
+}
+
+/**
+  * @brief  Renew subscriptions after a CONNACK. With no session on the
+  *         broker, those granted before go again. Those sent with the
+  *         CONNECT are already in the new session.
+  * @param  client: 	MQTT_Client reference
+  * @param  sessionPresent: the broker kept our session
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_resubscribe(MQTT_Client *client, BOOL sessionPresent)
+{
+	uint8_t i;
+
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		if(!sessionPresent && client->subs[i].state == MQTT_SUB_ACTIVE)
+			client->subs[i].state = MQTT_SUB_NONE;
+	}
+	mqtt_sub_queue(client);
+}
+
+/**
+  * @brief  Mark subscriptions granted or refused by a SUBACK. The return
+  *         codes are in the order the topics were subscribed in.
+  * @param  client: 	MQTT_Client reference
+  * @param  buffer: 	packet
+  * @param  length: 	packet length
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_suback(MQTT_Client *client, uint8_t *buffer, uint16_t length)
+{
+	MQTT_SUBSCRIPTION *s;
+	const uint8_t *codes;
+	uint16_t id = mqtt_get_id(buffer, length);
+	int n = mqtt_get_suback_codes(buffer, length, client->connect_info.protocol_version, &codes);
+	uint8_t i, k = 0;
+
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		s = &client->subs[i];
+		if(!s->topic || s->state != MQTT_SUB_PENDING || s->id != id)
+			continue;
+		if(k >= n || codes[k] >= 0x80){
+			INFO("MQTT: Subscribe to %s refused\r\n", s->topic);
+			// Try again on the next connection
+			s->state = MQTT_SUB_NONE;
+		}
+		else {
+			INFO("MQTT: Subscribe to %s successful\r\n", s->topic);
+			s->state = MQTT_SUB_ACTIVE;
+		}
+		k++;
+	}
+}
+
+/**
+  * @brief  Follow the CONNECT with the SUBSCRIBE for subscriptions which
+  *         need sending and the birth message, so they all go in one write
+  *         and the broker has handled them by the time the CONNACK is back.
+  * @param  client: 	MQTT_Client reference
+  * @param  buf: 		where to put them, just after the CONNECT
+  * @param  size: 	room at buf
+  * @retval Bytes added
+  */
+LOCAL uint16_t ICACHE_FLASH_ATTR
+mqtt_pipeline(MQTT_Client *client, uint8_t *buf, uint16_t size)
+{
+	mqtt_connection_t *conn = &client->mqtt_state.mqtt_connection;
+	mqtt_message_t *m;
+	uint16_t used = 0, id;
+
+	client->birthSent = FALSE;
+	if(size > MQTT_BUILD_OVERHEAD){
+		mqtt_msg_set_buffer(conn, buf, size);
+		if(mqtt_sub_build(client)){
+			m = client->mqtt_state.outbound_message;
+			os_memmove(buf, m->data, m->length);
+			used = m->length;
+		}
+	}
+	// Topic aliases aren't set up until the CONNACK, so the birth message has none
+	if(client->birthTopic && size - used > MQTT_BUILD_OVERHEAD){
+		mqtt_msg_set_buffer(conn, buf + used, size - used);
+		m = mqtt_msg_publish(conn, client->birthTopic, client->birthData, client->birthLength, 0, client->birthRetain, &id, NULL);
+		if(m->length){
+			os_memmove(buf + used, m->data, m->length);
+			used += m->length;
+			client->birthSent = TRUE;
+		}
+	}
+	client->mqtt_state.outbound_message = NULL;
+	return used;
+}
+
+/**
+  * @brief  Build messages from now on for the protocol version being
+  *         fallen back to. Messages already queued for MQTT 5 lose their
+  *         properties, and publishes with only a topic alias are dropped,
+  *         as a 3.1.x broker would read the properties as payload. The
+  *         3.1 and 3.1.1 layouts are the same.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_protocol_fallback(MQTT_Client *client)
+{
+	uint8_t *msg;
+	uint16_t msgLen, len;
+	uint8_t i;
+
+	if(client->mqtt_state.mqtt_connection.protocol_version == MQTT_PROTOCOL_V5){
+		for(i = 0; i < MQTT_LANES; i++)
+			mqtt_lane_strip(client, i, FALSE);
+		// Only QoS 0 publishes use topic aliases, so every copy keeps its topic
+		for(i = 0; i < client->inflightQueue.count; i++){
+			if(!QUEUE_PeekAt(&client->inflightQueue, i, &msg, &msgLen))
+				continue;
+			len = mqtt_msg_strip_properties(msg, msgLen, FALSE);
+			if(len)
+				QUEUE_Trim(&client->inflightQueue, i, len);
+			else
+				client->inflight[i].state = MQTT_INFLIGHT_DONE;
+		}
+		mqtt_inflight_purge(client);
+	}
+	client->mqtt_state.mqtt_connection.protocol_version = client->connect_info.protocol_version;
+}
+
+/**
+  * @brief  Check the CONNACK and take up the broker's limits. If the
+  *         protocol version is refused, the next connection tries the
+  *         version below it.
+  * @param  client: 	MQTT_Client reference
+  * @param  buffer: 	packet
+  * @param  length: 	packet length
+  * @retval TRUE if the connection was accepted
+  */
+LOCAL BOOL ICACHE_FLASH_ATTR
+mqtt_connack(MQTT_Client *client, uint8_t *buffer, uint16_t length)
+{
+	mqtt_connack_t connack;
+	uint8_t i;
+
+	if(mqtt_get_connack(buffer, length, client->connect_info.protocol_version, &connack) < 0){
+		INFO("MQTT: Malformed CONNACK\r\n");
+		return FALSE;
+	}
+	if(connack.return_code == MQTT_CONNACK_REFUSED_PROTOCOL_VERSION ||
+		connack.return_code == MQTT_CONNACK_V5_UNSUPPORTED_PROTOCOL_VERSION){
+		if(client->connect_info.protocol_version > MQTT_PROTOCOL_V31){
+			client->connect_info.protocol_version--;
+			INFO("MQTT: Protocol refused, falling back to version %d\r\n", client->connect_info.protocol_version);
+			mqtt_protocol_fallback(client);
+		}
+		return FALSE;
+	}
+	if(connack.return_code != MQTT_CONNACK_ACCEPTED){
+		INFO("MQTT: Connection refused, code: %d\r\n", connack.return_code);
+		return FALSE;
+	}
+
+	client->inflightMax = MQTT_MAX_INFLIGHT;
+	if(connack.receive_maximum && connack.receive_maximum < MQTT_MAX_INFLIGHT)
+		client->inflightMax = connack.receive_maximum;
+	client->aliasMax = 0;
+	if(client->connect_info.protocol_version == MQTT_PROTOCOL_V5)
+		client->aliasMax = (connack.topic_alias_maximum < MQTT_MAX_TOPIC_ALIAS) ? connack.topic_alias_maximum : MQTT_MAX_TOPIC_ALIAS;
+	client->maxPacketSize = connack.maximum_packet_size;
+	client->keepAlive = connack.server_keepalive ? connack.server_keepalive : client->connect_info.keepalive;
+	// Aliases start afresh on each connection
+	for(i = 0; i < MQTT_LANES; i++)
+		mqtt_alias_invalidate(client, i);
+	INFO("MQTT: Protocol version %d, window %d, aliases %d, keepalive %d, session present: %d\r\n",
+		client->connect_info.protocol_version, client->inflightMax, client->aliasMax, client->keepAlive, connack.session_present);
+	client->reconnectAttempts = 0;
+	mqtt_resubscribe(client, connack.session_present && !client->connect_info.clean_session);
+	// Sent now if it didn't fit with the CONNECT
+	if(client->birthTopic && !client->birthSent)
+		MQTT_Publish(client, client->birthTopic, client->birthData, client->birthLength, 0, client->birthRetain);
+	return TRUE;
+}
+
+/**
+  * @brief  Check the round trip time of a PINGREQ. A broker which keeps
+  *         answering slowly is left for the next one in the ranking.
+  * @param  client: 	MQTT_Client reference
+  * @param  rtt: 		microseconds from queueing the PINGREQ to the PINGRESP
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_ping_rtt(MQTT_Client *client, uint32_t rtt)
+{
+	if(client->brokerCount < 2 || rtt <= MQTT_FAILOVER_RTT * 1000UL){
+		client->slowPings = 0;
+		return;
+	}
+	INFO("MQTT: Slow PINGRESP from %s, %d ms\r\n", client->host, rtt / 1000);
+	if(++client->slowPings < MQTT_FAILOVER_SLOW_PINGS)
+		return;
+	client->failover = TRUE;
+	client->reconnectDelay = 1;
+	MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_FAILOVER);
+	mqtt_tcp_disconnect(client);
+}
+
+/**
+  * @brief  Handle one complete packet from the receive parser.
+  * @param  client: 	MQTT_Client reference
+  * @param  buffer: 	packet, starting at the fixed header
+  * @param  length: 	packet length
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_handle_packet(MQTT_Client *client, uint8_t *buffer, uint16_t length)
+{
+	uint8_t msg_type;
+	uint8_t msg_qos;
+	uint16_t msg_id;
+
+	msg_type = mqtt_get_type(buffer);
+	msg_qos = mqtt_get_qos(buffer);
+	msg_id = mqtt_get_id(buffer, length);
+	// Anything from the broker shows the connection is alive
+	client->pingTick = 0;
+	switch(client->connState){
+	case MQTT_CONNECT_SENDING:
+		if(msg_type == MQTT_MSG_TYPE_CONNACK){
+			if(client->mqtt_state.pending_msg_type != MQTT_MSG_TYPE_CONNECT || !mqtt_connack(client, buffer, length)){
+				INFO("MQTT: Invalid packet\r\n");
+				MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_REFUSED);
+				mqtt_tcp_disconnect(client);
+			} else {
+				INFO("MQTT: Connected to %s:%d\r\n", client->host, client->port);
+				client->connState = MQTT_DATA;
+				if(client->connectedCb)
+					client->connectedCb((uint32_t*)client);
+			}
+
 		}
+		break;
+	case MQTT_DATA:
+		client->mqtt_state.message_length_read = length;
+		client->mqtt_state.message_length = length;
 
-		client->connState = TCP_CONNECTING;
-		INFO("TCP: connecting...\r\n");
-	}
-
-	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
-}
+		switch(msg_type)
+		{
 
+		  case MQTT_MSG_TYPE_SUBACK:
+			mqtt_suback(client, buffer, length);
+			break;
+		  case MQTT_MSG_TYPE_UNSUBACK:
+			if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id)
+			  INFO("MQTT: UnSubscribe successful\r\n");
+			break;
+		  case MQTT_MSG_TYPE_PUBLISH:
+			if((msg_qos == 1 || msg_qos == 2) && mqtt_reserve(client, MQTT_LANE_CONTROL, MQTT_BUILD_OVERHEAD)){
+				INFO("MQTT: Queue response QoS: %d\r\n", msg_qos);
+				if(msg_qos == 1)
+					client->mqtt_state.outbound_message = mqtt_msg_puback(&client->mqtt_state.mqtt_connection, msg_id);
+				else
+					client->mqtt_state.outbound_message = mqtt_msg_pubrec(&client->mqtt_state.mqtt_connection, msg_id);
+				mqtt_commit(client, MQTT_LANE_CONTROL);
+			}
 
+			deliver_publish(client, buffer, length);
+			break;
+		  case MQTT_MSG_TYPE_PUBACK:
+			INFO("MQTT: received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish, id: %04X\r\n", msg_id);
+			mqtt_inflight_ack(client, msg_type, msg_id);
+			break;
+		  case MQTT_MSG_TYPE_PUBREC:
+			  mqtt_inflight_ack(client, msg_type, msg_id);
+			  if(mqtt_reserve(client, MQTT_LANE_CONTROL, MQTT_BUILD_OVERHEAD)){
+				  client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
+				  mqtt_commit(client, MQTT_LANE_CONTROL);
+			  }
+			break;
+		  case MQTT_MSG_TYPE_PUBREL:
+			  if(mqtt_reserve(client, MQTT_LANE_CONTROL, MQTT_BUILD_OVERHEAD)){
+				  client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
+				  mqtt_commit(client, MQTT_LANE_CONTROL);
+			  }
+			break;
+		  case MQTT_MSG_TYPE_PUBCOMP:
+			INFO("MQTT: receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish, id: %04X\r\n", msg_id);
+			mqtt_inflight_ack(client, msg_type, msg_id);
+			break;
+		  case MQTT_MSG_TYPE_PINGREQ:
+			  if(mqtt_reserve(client, MQTT_LANE_CONTROL, MQTT_BUILD_OVERHEAD)){
+				  client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
+				  mqtt_commit(client, MQTT_LANE_CONTROL);
+			  }
+			break;
+		  case MQTT_MSG_TYPE_PINGRESP:
+			if(client->keepAlive >= client->connect_info.keepalive)
+				client->keepAliveProven = TRUE;
+#ifdef MQTT_METRICS
+			if(client->metrics.pingStart){
+				client->metrics.pingUs = system_get_time() - client->metrics.pingStart;
+				if(client->metrics.pingUs > client->metrics.pingMaxUs)
+					client->metrics.pingMaxUs = client->metrics.pingUs;
+				client->metrics.pingStart = 0;
+			}
+#endif
+			if(client->pingSentTime)
+				mqtt_ping_rtt(client, system_get_time() - client->pingSentTime);
+			client->pingSentTime = 0;
+			break;
+		}
+		break;
+	}
+}
 
+/**
+  * @brief  Reset the receive parser to expect the start of a packet.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
 LOCAL void ICACHE_FLASH_ATTR
-deliver_publish(MQTT_Client* client, uint8_t* message, int length)
+mqtt_rx_reset(MQTT_Client *client)
 {
-	mqtt_event_data_t event_data;
-
-	event_data.topic_length = length;
-	event_data.topic = mqtt_get_publish_topic(message, &event_data.topic_length);
-	event_data.data_length = length;
-	event_data.data = mqtt_get_publish_data(message, &event_data.data_length);
-
-	if(client->dataCb)
-		client->dataCb((uint32_t*)client, event_data.topic, event_data.topic_length, event_data.data, event_data.data_length);
-
+	client->mqtt_state.rx_state = MQTT_RX_HEADER;
+	client->mqtt_state.message_length_read = 0;
 }
 
-
 /**
-  * @brief  Client received callback function.
+  * @brief  Client received callback function. TCP segments don't follow
+  *         packet boundaries, so the data is run through an incremental
+  *         parser. Packets split across segments are reassembled in
+  *         in_buffer, and every packet completed by a segment is handled.
+  *         Packets too big for in_buffer are skipped.
   * @param  arg: contain the ip link information
   * @param  pdata: received data
   * @param  len: the lenght of received data
@@ -120,127 +1748,84 @@ deliver_publish(MQTT_Client* client, uint8_t* message, int length)
 void ICACHE_FLASH_ATTR
 mqtt_tcpclient_recv(void *arg, char *pdata, unsigned short len)
 {
-	uint8_t msg_type;
-	uint8_t msg_qos;
-	uint16_t msg_id;
-
 	struct espconn *pCon = (struct espconn*)arg;
 	MQTT_Client *client = (MQTT_Client *)pCon->reverse;
+	mqtt_state_t *state = &client->mqtt_state;
+	uint8_t *buf = state->in_buffer;
+	uint8_t *data = (uint8_t *)pdata;
+	uint32_t n;
+	uint8_t c;
 
-READPACKET:
 	INFO("TCP: data received %d bytes\r\n", len);
-	if(len < MQTT_BUF_SIZE && len > 0){
-		os_memcpy(client->mqtt_state.in_buffer, pdata, len);
-
-		msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
-		msg_qos = mqtt_get_qos(client->mqtt_state.in_buffer);
-		msg_id = mqtt_get_id(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
-		switch(client->connState){
-		case MQTT_CONNECT_SENDING:
-			if(msg_type == MQTT_MSG_TYPE_CONNACK){
-				if(client->mqtt_state.pending_msg_type != MQTT_MSG_TYPE_CONNECT){
-					INFO("MQTT: Invalid packet\r\n");
-					if(client->security){
-						espconn_secure_disconnect(client->pCon);
-					}
-					else {
-						espconn_disconnect(client->pCon);
-					}
-				} else {
-					INFO("MQTT: Connected to %s:%d\r\n", client->host, client->port);
-					client->connState = MQTT_DATA;
-					if(client->connectedCb)
-						client->connectedCb((uint32_t*)client);
-				}
-
-			}
+	MQTT_METRIC(client->metrics.rxBytes += len);
+	while(len > 0){
+		switch(state->rx_state){
+		case MQTT_RX_HEADER:
+			buf[0] = *data++;
+			len--;
+			state->message_length_read = 1;
+			state->rx_remaining = 0;
+			state->rx_shift = 0;
+			state->rx_state = MQTT_RX_LENGTH;
 			break;
-		case MQTT_DATA:
-			client->mqtt_state.message_length_read = len;
-			client->mqtt_state.message_length = mqtt_get_total_length(client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
-
-
-			switch(msg_type)
-			{
-
-			  case MQTT_MSG_TYPE_SUBACK:
-				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id)
-				  INFO("MQTT: Subscribe successful\r\n");
-				break;
-			  case MQTT_MSG_TYPE_UNSUBACK:
-				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id)
-				  INFO("MQTT: UnSubscribe successful\r\n");
-				break;
-			  case MQTT_MSG_TYPE_PUBLISH:
-				if(msg_qos == 1)
-					client->mqtt_state.outbound_message = mqtt_msg_puback(&client->mqtt_state.mqtt_connection, msg_id);
-				else if(msg_qos == 2)
-					client->mqtt_state.outbound_message = mqtt_msg_pubrec(&client->mqtt_state.mqtt_connection, msg_id);
-				if(msg_qos == 1 || msg_qos == 2){
-					INFO("MQTT: Queue response QoS: %d\r\n", msg_qos);
-					if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-						INFO("MQTT: Queue full\r\n");
-					}
-				}
-
-				deliver_publish(client, client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
-				break;
-			  case MQTT_MSG_TYPE_PUBACK:
-				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id){
-				  INFO("MQTT: received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish\r\n");
-				}
 
-				break;
-			  case MQTT_MSG_TYPE_PUBREC:
-				  client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
-				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-				  	INFO("MQTT: Queue full\r\n");
-				  }
-				break;
-			  case MQTT_MSG_TYPE_PUBREL:
-				  client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
-				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-					INFO("MQTT: Queue full\r\n");
-				  }
-				break;
-			  case MQTT_MSG_TYPE_PUBCOMP:
-				if(client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id){
-				  INFO("MQTT: receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish\r\n");
+		case MQTT_RX_LENGTH:
+			c = *data++;
+			len--;
+			buf[state->message_length_read++] = c;
+			state->rx_remaining |= (uint32_t)(c & 0x7f) << state->rx_shift;
+			state->rx_shift += 7;
+			if(c & 0x80){
+				if(state->message_length_read > MQTT_MAX_FIXED_HEADER_LEN - 1){
+					// Can't find the next packet, so the stream is lost
+					INFO("MQTT: Malformed remaining length\r\n");
+					mqtt_rx_reset(client);
+					MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_MALFORMED);
+					mqtt_tcp_disconnect(client);
+					return;
 				}
 				break;
-			  case MQTT_MSG_TYPE_PINGREQ:
-				  client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
-				  if(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-					INFO("MQTT: Queue full\r\n");
-				  }
-				break;
-			  case MQTT_MSG_TYPE_PINGRESP:
-				// Ignore
-				break;
 			}
-			// NOTE: this is done down here and not in the switch case above
-			// because the PSOCK_READBUF_LEN() won't work inside a switch
-			// statement due to the way protothreads resume.
-			if(msg_type == MQTT_MSG_TYPE_PUBLISH)
-			{
-			  len = client->mqtt_state.message_length_read;
-
-			  if(client->mqtt_state.message_length < client->mqtt_state.message_length_read)
-			  {
-				  //client->connState = MQTT_PUBLISH_RECV;
-				  //Not Implement yet
-				  len -= client->mqtt_state.message_length;
-				  pdata += client->mqtt_state.message_length;
-
-				  INFO("Get another published message\r\n");
-				  goto READPACKET;
-			  }
+			// Counted here so skipped packets are too
+			MQTT_METRIC(client->metrics.rxPackets[mqtt_get_type(buf)]++);
+			if(state->message_length_read + state->rx_remaining > state->in_buffer_length){
+				INFO("MQTT: Skipping packet of %d bytes, too long\r\n", state->message_length_read + state->rx_remaining);
+				state->rx_state = MQTT_RX_SKIP;
+			}
+			else if(state->rx_remaining == 0){
+				mqtt_handle_packet(client, buf, state->message_length_read);
+				state->rx_state = MQTT_RX_HEADER;
+			}
+			else
+				state->rx_state = MQTT_RX_BODY;
+			break;
 
+		case MQTT_RX_BODY:
+			n = (len < state->rx_remaining) ? len : state->rx_remaining;
+			os_memcpy(buf + state->message_length_read, data, n);
+			data += n;
+			len -= n;
+			state->message_length_read += n;
+			state->rx_remaining -= n;
+			if(state->rx_remaining == 0){
+				mqtt_handle_packet(client, buf, state->message_length_read);
+				state->rx_state = MQTT_RX_HEADER;
 			}
 			break;
+
+		case MQTT_RX_SKIP:
+			n = (len < state->rx_remaining) ? len : state->rx_remaining;
+			data += n;
+			len -= n;
+			state->rx_remaining -= n;
+			if(state->rx_remaining == 0)
+				state->rx_state = MQTT_RX_HEADER;
+			break;
+
+		default:
+			mqtt_rx_reset(client);
+			break;
 		}
-	} else {
-		INFO("ERROR: Message too long\r\n");
 	}
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
@@ -255,55 +1840,131 @@ mqtt_tcpclient_sent_cb(void *arg)
 {
 	struct espconn *pCon = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
+	uint8_t publishes = client->sendPublishes;
+
+	MQTT_INFLIGHT *e;
+	uint8_t i;
+
 	INFO("TCP: Sent\r\n");
+	MQTT_METRIC(mqtt_metrics_sent(client));
 	client->sendTimeout = 0;
-	if(client->connState == MQTT_DATA && client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH){
-		if(client->publishedCb)
-			client->publishedCb((uint32_t*)client);
+	client->sendRetries = 0;
+	// espconn is done with the queue memory
+	while(client->sendCount){
+		mqtt_queue_pop(client, client->sendLane);
+		client->sendCount--;
+	}
+	client->sendPublishes = 0;
+	client->sendInflight = FALSE;
+	if(client->sendStream){
+		client->sendStream = FALSE;
+		client->stream.offset += client->stream.chunk;
+		client->stream.chunk = 0;
+		if(client->stream.offset == client->stream.length)
+			mqtt_stream_end(client);
+	}
+	// Start the ack timers
+	for(i = 0; i < client->inflightQueue.count; i++){
+		e = &client->inflight[i];
+		if(e->state == MQTT_INFLIGHT_SENDING || e->state == MQTT_INFLIGHT_RESENDING){
+			e->state = MQTT_INFLIGHT_PUBACK;
+			e->ticks = 0;
+		}
+	}
+	mqtt_inflight_purge(client);
+
+	// Keep the stack busy
+	mqtt_send_queued(client);
+
+	if(client->connState == MQTT_DATA){
+		while(publishes--){
+			if(client->publishedCb)
+				client->publishedCb((uint32_t*)client);
+		}
 	}
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
 
+/**
+  * @brief  The broker didn't answer a PINGREQ in time. Treat the
+  *         connection as dead and reconnect straight away. Something on
+  *         the path may be dropping idle connections, so the next CONNECT
+  *         asks for half the keepalive, down to MQTT_KEEPALIVE_MIN.
+  * @param  client: 	MQTT_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqtt_ping_timeout(MQTT_Client *client)
+{
+	uint16_t keepalive = client->connect_info.keepalive / 2;
+
+	if(keepalive < MQTT_KEEPALIVE_MIN)
+		keepalive = MQTT_KEEPALIVE_MIN;
+	if(keepalive < client->connect_info.keepalive)
+		client->connect_info.keepalive = keepalive;
+	client->keepAliveProven = FALSE;
+	client->pingTick = 0;
+	client->reconnectDelay = 1;
+	INFO("MQTT: No PINGRESP, reconnecting, keepalive %d\r\n", client->connect_info.keepalive);
+	MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_PING_TIMEOUT);
+	mqtt_tcp_disconnect(client);
+}
+
 void ICACHE_FLASH_ATTR mqtt_timer(void *arg)
 {
 	MQTT_Client* client = (MQTT_Client*)arg;
 
+	if(client->dnsValid && ++client->dnsAge >= MQTT_DNS_TTL)
+		client->dnsValid = FALSE;
 	if(client->connState == MQTT_DATA){
+		mqtt_inflight_timer(client);
+		if(client->pingTick && ++client->pingTick > MQTT_PING_TIMEOUT){
+			mqtt_ping_timeout(client);
+			return;
+		}
 		client->keepAliveTick ++;
-		if(client->keepAliveTick > client->mqtt_state.connect_info->keepalive){
-
-			INFO("\r\nMQTT: Send keepalive packet to %s:%d!\r\n", client->host, client->port);
-			client->mqtt_state.outbound_message = mqtt_msg_pingreq(&client->mqtt_state.mqtt_connection);
-			client->mqtt_state.pending_msg_type = MQTT_MSG_TYPE_PINGREQ;
-			client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.outbound_message->data);
-			client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-
-
-			client->sendTimeout = MQTT_SEND_TIMOUT;
-			INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-			if(client->security){
-				espconn_secure_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-			}
-			else{
-				espconn_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
+		// Any write resets the tick, so a busy link is never pinged
+		if(client->keepAlive && client->keepAliveTick >= client->keepAlive && !client->pingTick){
+
+			INFO("\r\nMQTT: Queue keepalive packet to %s:%d!\r\n", client->host, client->port);
+			// Sent through the queue so it can't collide with a send in progress
+			if(mqtt_reserve(client, MQTT_LANE_CONTROL, MQTT_BUILD_OVERHEAD)){
+				client->mqtt_state.outbound_message = mqtt_msg_pingreq(&client->mqtt_state.mqtt_connection);
+				mqtt_commit(client, MQTT_LANE_CONTROL);
+				client->pingTick = 1;
+				client->pingSentTime = system_get_time();
 			}
 
-			client->mqtt_state.outbound_message = NULL;
-
 			client->keepAliveTick = 0;
 			system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 		}
 
 	} else if(client->connState == TCP_RECONNECT_REQ){
 		client->reconnectTick ++;
-		if(client->reconnectTick > MQTT_RECONNECT_TIMEOUT) {
+		if(client->reconnectTick >= client->reconnectDelay) {
 			client->reconnectTick = 0;
 			client->connState = TCP_RECONNECT;
 			system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 		}
+	} else if(client->connState == BROKER_PROBING && !client->probeNext){
+		if(++client->probeTick > MQTT_PROBE_TIMEOUT){
+			INFO("MQTT: No answer from broker %s\r\n", client->brokers[client->probe].host);
+			espconn_abort(&client->probeCon[client->probe]);
+			mqtt_probe_done(client, &client->probeCon[client->probe], 0);
+		}
 	}
-	if(client->sendTimeout > 0)
+	if(client->sendBackoff && !--client->sendBackoff)
+		system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	if(client->sendTimeout > 0){
 		client->sendTimeout --;
+		if(!client->sendTimeout && (client->sendCount || client->sendInflight) && client->pCon){
+			// espconn may still hold the queue memory, so the message can't be
+			// dropped or resent on this connection. Start a new one.
+			INFO("MQTT: Send timeout, reconnecting\r\n");
+			MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_SEND_TIMEOUT);
+			mqtt_tcp_disconnect(client);
+		}
+	}
 }
 
 void ICACHE_FLASH_ATTR
@@ -313,7 +1974,14 @@ mqtt_tcpclient_discon_cb(void *arg)
 	struct espconn *pespconn = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pespconn->reverse;
 	INFO("TCP: Disconnected callback\r\n");
+#ifdef MQTT_METRICS
+	client->metrics.reconnects[client->metrics.cause]++;
+	client->metrics.cause = MQTT_CAUSE_CLOSED;
+#endif
 	client->connState = TCP_RECONNECT_REQ;
+	client->sendCount = 0;
+	client->sendInflight = FALSE;
+	client->sendStream = FALSE;
 	if(client->disconnectedCb)
 		client->disconnectedCb((uint32_t*)client);
 
@@ -332,28 +2000,41 @@ mqtt_tcpclient_connect_cb(void *arg)
 {
 	struct espconn *pCon = (struct espconn *)arg;
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
+	uint8_t *data;
+	uint16_t len;
 
 	espconn_regist_disconcb(client->pCon, mqtt_tcpclient_discon_cb);
 	espconn_regist_recvcb(client->pCon, mqtt_tcpclient_recv);////////
 	espconn_regist_sentcb(client->pCon, mqtt_tcpclient_sent_cb);///////
 	INFO("MQTT: Connected to broker %s:%d\r\n", client->host, client->port);
+	mqtt_rx_reset(client);
 
-	mqtt_msg_init(&client->mqtt_state.mqtt_connection, client->mqtt_state.out_buffer, client->mqtt_state.out_buffer_length);
+	// The CONNECT is built in the receive buffer, which is idle until the
+	// broker answers. The broker can't answer before it has the whole
+	// CONNECT, and lwIP reports the ack before it passes on the answer.
+	mqtt_msg_set_buffer(&client->mqtt_state.mqtt_connection, client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
 	client->mqtt_state.outbound_message = mqtt_msg_connect(&client->mqtt_state.mqtt_connection, client->mqtt_state.connect_info);
-	client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.outbound_message->data);
-	client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
+	data = client->mqtt_state.outbound_message->data;
+	len = client->mqtt_state.outbound_message->length;
+	client->mqtt_state.pending_msg_type = mqtt_get_type(data);
+	client->mqtt_state.pending_msg_id = mqtt_get_id(data, len);
+	len += mqtt_pipeline(client, data + len, client->mqtt_state.in_buffer_length - (data + len - client->mqtt_state.in_buffer));
 
 
 	client->sendTimeout = MQTT_SEND_TIMOUT;
-	INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-	if(client->security){
-		espconn_secure_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
-	}
-	else{
-		espconn_sent(client->pCon, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length);
+	client->keepAliveTick = 0;
+	INFO("MQTT: Sending, type: %d, id: %04X, %d bytes\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id, len);
+	if(!mqtt_espconn_send(client, data, len)){
+		// Nothing has been sent yet, so start again on a new connection
+		client->sendTimeout = 0;
+		MQTT_METRIC(client->metrics.cause = MQTT_CAUSE_SEND_REFUSED);
+		mqtt_tcp_disconnect(client);
+		return;
 	}
+	MQTT_METRIC(mqtt_metrics_write(client, data, len, TRUE));
+	if(client->birthSent)
+		mqtt_link_timed(client);
 
-	client->mqtt_state.outbound_message = NULL;
 	client->connState = MQTT_CONNECT_SENDING;
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 }
@@ -370,7 +2051,11 @@ mqtt_tcpclient_recon_cb(void *arg, sint8 errType)
 	MQTT_Client* client = (MQTT_Client *)pCon->reverse;
 
 	INFO("TCP: Reconnect to %s:%d\r\n", client->host, client->port);
+	MQTT_METRIC(client->metrics.reconnects[MQTT_CAUSE_ERROR]++);
 
+	// The broker may have moved
+	if(client->connState == TCP_CONNECTING)
+		client->dnsValid = FALSE;
 	client->connState = TCP_RECONNECT_REQ;
 
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
@@ -378,40 +2063,158 @@ mqtt_tcpclient_recon_cb(void *arg, sint8 errType)
 }
 
 /**
-  * @brief  MQTT publish function.
+  * @brief  MQTT publish function, with the outbound lane and an MQTT 5
+  *         message expiry.
   * @param  client: 	MQTT_Client reference
+  * @param  lane: 		MQTT_LANE_EVENT or MQTT_LANE_TELEMETRY
   * @param  topic: 		string topic will publish to
   * @param  data: 		buffer data send point to
   * @param  data_length: length of data
   * @param  qos:		qos
   * @param  retain:		retain
+  * @param  expiry:		seconds the broker keeps the message for, 0 for no limit
   * @retval TRUE if success queue
   */
 BOOL ICACHE_FLASH_ATTR
-MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain)
+MQTT_PublishLane(MQTT_Client *client, uint8_t lane, const char* topic, const char* data, int data_length, int qos, int retain, uint32_t expiry)
 {
-	uint8_t dataBuffer[MQTT_BUF_SIZE];
-	uint16_t dataLen;
+	mqtt_publish_properties_t props;
+	MQTT_LANE *l;
+	int8_t alias = -1;
+	uint32_t len;
+#ifdef MQTT_PROFILE
+	uint32_t start = mqtt_ccount();
+#endif
+	if(lane >= MQTT_LANES)
+		lane = MQTT_LANE_EVENT;
+	l = &client->lanes[lane];
+	if(l->policy == MQTT_COALESCE_LATEST && qos == 0)
+		mqtt_coalesce(client, lane, topic);
+
+	len = MQTT_BUILD_OVERHEAD + os_strlen(topic) + data_length;
+	if(len > MQTT_BUF_SIZE){
+		INFO("MQTT: Publish too big, use MQTT_PublishStream\r\n");
+		return FALSE;
+	}
+	// Make room first, as dropping messages can change the alias to use
+	INFO("MQTT: queuing publish, lane: %d, queue size(%d/%d)\r\n", lane, QUEUE_Used(&l->queue), l->queue.size);
+	if(!mqtt_reserve(client, lane, len))
+		return FALSE;
+
+	os_memset(&props, 0, sizeof(props));
+	props.message_expiry = expiry;
+	// QoS 1 and 2 publishes may be resent on a later connection, so they never use an alias
+	if(qos == 0)
+		alias = mqtt_topic_alias(client, lane, topic, &props);
+
 	client->mqtt_state.outbound_message = mqtt_msg_publish(&client->mqtt_state.mqtt_connection,
 										 topic, data, data_length,
 										 qos, retain,
-										 &client->mqtt_state.pending_msg_id);
-	if(client->mqtt_state.outbound_message->length == 0){
+										 &client->mqtt_state.pending_msg_id, &props);
+	if(client->maxPacketSize && client->mqtt_state.outbound_message->length > client->maxPacketSize){
+		INFO("MQTT: Publish too big for the broker\r\n");
+		client->mqtt_state.outbound_message = NULL;
+		return FALSE;
+	}
+	if(!mqtt_commit(client, lane)){
 		INFO("MQTT: Queuing publish failed\r\n");
 		return FALSE;
 	}
-	INFO("MQTT: queuing publish, length: %d, queue size(%d/%d)\r\n", client->mqtt_state.outbound_message->length, client->msgQueue.rb.fill_cnt, client->msgQueue.rb.size);
-	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-		INFO("MQTT: Queue full\r\n");
-		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
-			INFO("MQTT: Serious buffer error\r\n");
-			return FALSE;
-		}
+	if(alias >= 0)
+		client->aliases[alias].lanes |= 1 << lane;
+#ifdef MQTT_PROFILE
+	profQueueCycles += mqtt_ccount() - start;
+	profQueued++;
+#endif
+	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
+	return TRUE;
+}
+
+/**
+  * @brief  Publish a payload too big to queue, at QoS 0. The payload is
+  *         read through the fill callback a chunk at a time as the
+  *         connection takes it, after the queued messages. One publish can
+  *         be streamed at a time.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		string topic will publish to
+  * @param  length: 	payload length
+  * @param  retain:		retain
+  * @param  fill:		supplies the payload, see MqttFillCallback
+  * @param  arg:		passed to fill
+  * @retval TRUE if the publish was accepted, fill is then always called
+  *         with buf NULL at the end
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_PublishStream(MQTT_Client *client, const char* topic, uint32_t length, int retain, MqttFillCallback fill, void *arg)
+{
+	MQTT_STREAM *s = &client->stream;
+	uint16_t topicLen;
+
+	if(s->fill){
+		INFO("MQTT: Streamed publish already in progress\r\n");
+		return FALSE;
+	}
+	topicLen = os_strlen(topic);
+	if(!fill || !topicLen || topicLen + MQTT_BUILD_OVERHEAD > MQTT_STREAM_CHUNK ||
+		length > MQTT_MAX_REMAINING_LENGTH - MQTT_BUILD_OVERHEAD - topicLen){
+		INFO("MQTT: Streamed publish refused\r\n");
+		return FALSE;
+	}
+	s->buf = (uint8_t *)os_malloc(MQTT_STREAM_CHUNK);
+	s->topic = (char *)os_zalloc(topicLen + 1);
+	if(!s->buf || !s->topic){
+		os_free(s->buf);
+		os_free(s->topic);
+		s->buf = NULL;
+		s->topic = NULL;
+		return FALSE;
 	}
+	os_strcpy(s->topic, topic);
+	s->length = length;
+	s->offset = 0;
+	s->chunk = 0;
+	s->retain = retain;
+	s->started = FALSE;
+	s->arg = arg;
+	s->fill = fill;
+	INFO("MQTT: Streaming publish to %s, %d bytes\r\n", topic, length);
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 	return TRUE;
 }
 
+/**
+  * @brief  MQTT publish function, with an MQTT 5 message expiry.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		string topic will publish to
+  * @param  data: 		buffer data send point to
+  * @param  data_length: length of data
+  * @param  qos:		qos
+  * @param  retain:		retain
+  * @param  expiry:		seconds the broker keeps the message for, 0 for no limit
+  * @retval TRUE if success queue
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_PublishWithExpiry(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain, uint32_t expiry)
+{
+	return MQTT_PublishLane(client, MQTT_LANE_EVENT, topic, data, data_length, qos, retain, expiry);
+}
+
+/**
+  * @brief  MQTT publish function.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		string topic will publish to
+  * @param  data: 		buffer data send point to
+  * @param  data_length: length of data
+  * @param  qos:		qos
+  * @param  retain:		retain
+  * @retval TRUE if success queue
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_length, int qos, int retain)
+{
+	return MQTT_PublishWithExpiry(client, topic, data, data_length, qos, retain, 0);
+}
+
 /**
   * @brief  MQTT subscibe function.
   * @param  client: 	MQTT_Client reference
@@ -422,60 +2225,92 @@ MQTT_Publish(MQTT_Client *client, const char* topic, const char* data, int data_
 BOOL ICACHE_FLASH_ATTR
 MQTT_Subscribe(MQTT_Client *client, char* topic, uint8_t qos)
 {
-	uint8_t dataBuffer[MQTT_BUF_SIZE];
-	uint16_t dataLen;
+	MQTT_SUBSCRIPTION *s;
+	int8_t i = mqtt_sub_find(client, topic);
 
-	client->mqtt_state.outbound_message = mqtt_msg_subscribe(&client->mqtt_state.mqtt_connection,
-											topic, 0,
-											&client->mqtt_state.pending_msg_id);
-	INFO("MQTT: queue subscribe, topic\"%s\", id: %d\r\n",topic, client->mqtt_state.pending_msg_id);
-	while(QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1){
-		INFO("MQTT: Queue full\r\n");
-		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == -1) {
-			INFO("MQTT: Serious buffer error\r\n");
-			return FALSE;
-		}
+	// Tracked subscriptions are kept by the broker's session, or renewed on connect
+	if(i >= 0 && client->subs[i].state != MQTT_SUB_NONE && client->subs[i].qos == qos){
+		INFO("MQTT: Already subscribed to %s\r\n", topic);
+		return TRUE;
+	}
+	if(i < 0 && (i = mqtt_sub_add(client, topic)) < 0)
+		return FALSE;
+	s = &client->subs[i];
+	s->qos = qos;
+	s->state = MQTT_SUB_NONE;
+	// Otherwise it goes with the next CONNECT
+	if(client->connState == MQTT_DATA){
+		mqtt_sub_queue(client);
+		system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 	}
-	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)client);
 	return TRUE;
 }
 
+/**
+  * @brief  Set the birth message, published with each CONNECT in the same
+  *         write. Call before MQTT_Connect. It is sent at QoS 0.
+  * @param  client: 	MQTT_Client reference
+  * @param  topic: 		topic, NULL for no birth message
+  * @param  data: 		message
+  * @param  data_length: length of message
+  * @param  retain:		retain
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_SetBirth(MQTT_Client *client, const char* topic, const char* data, int data_length, int retain)
+{
+	if(client->birthTopic)
+		os_free(client->birthTopic);
+	if(client->birthData)
+		os_free(client->birthData);
+	client->birthTopic = NULL;
+	client->birthData = NULL;
+	if(!topic)
+		return;
+	client->birthTopic = (char *)os_zalloc(os_strlen(topic) + 1);
+	os_strcpy(client->birthTopic, topic);
+	client->birthData = (char *)os_zalloc(data_length + 1);
+	os_memcpy(client->birthData, data, data_length);
+	client->birthLength = data_length;
+	client->birthRetain = retain;
+}
+
+/**
+  * @brief  Set what happens when an outbound lane is full.
+  * @param  client: 	MQTT_Client reference
+  * @param  lane: 		lane
+  * @param  policy:	MQTT_DROP_OLDEST, MQTT_DROP_NEWEST or MQTT_COALESCE_LATEST
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_SetLanePolicy(MQTT_Client *client, uint8_t lane, uint8_t policy)
+{
+	if(lane < MQTT_LANES)
+		client->lanes[lane].policy = policy;
+}
+
 void ICACHE_FLASH_ATTR
 MQTT_Task(os_event_t *e)
 {
 	MQTT_Client* client = (MQTT_Client*)e->par;
-	uint8_t dataBuffer[MQTT_BUF_SIZE];
-	uint16_t dataLen;
+
+	mqtt_probe_close(client);
 	switch(client->connState){
 
 	case TCP_RECONNECT_REQ:
 		break;
+	case BROKER_PROBING:
+		if(client->probeNext){
+			client->probeNext = FALSE;
+			mqtt_probe_next(client);
+		}
+		break;
 	case TCP_RECONNECT:
-		MQTT_Connect(client);
 		INFO("TCP: Reconnect to: %s:%d\r\n", client->host, client->port);
-		client->connState = TCP_CONNECTING;
+		MQTT_Connect(client);
 		break;
 	case MQTT_DATA:
-		if(QUEUE_IsEmpty(&client->msgQueue) || client->sendTimeout != 0) {
-			break;
-		}
-		if(QUEUE_Gets(&client->msgQueue, dataBuffer, &dataLen, MQTT_BUF_SIZE) == 0){
-			client->mqtt_state.pending_msg_type = mqtt_get_type(dataBuffer);
-			client->mqtt_state.pending_msg_id = mqtt_get_id(dataBuffer, dataLen);
-
-
-			client->sendTimeout = MQTT_SEND_TIMOUT;
-			INFO("MQTT: Sending, type: %d, id: %04X\r\n",client->mqtt_state.pending_msg_type, client->mqtt_state.pending_msg_id);
-			if(client->security){
-				espconn_secure_sent(client->pCon, dataBuffer, dataLen);
-			}
-			else{
-				espconn_sent(client->pCon, dataBuffer, dataLen);
-			}
-
-			client->mqtt_state.outbound_message = NULL;
-			break;
-		}
+		mqtt_send_queued(client);
 		break;
 	}
 }
@@ -491,18 +2326,39 @@ MQTT_Task(os_event_t *e)
 void ICACHE_FLASH_ATTR
 MQTT_InitConnection(MQTT_Client *mqttClient, uint8_t* host, uint32 port, uint8_t security)
 {
-	uint32_t temp;
 	INFO("MQTT_InitConnection\r\n");
 	os_memset(mqttClient, 0, sizeof(MQTT_Client));
-	temp = os_strlen(host);
-	mqttClient->host = (uint8_t*)os_zalloc(temp + 1);
-	os_strcpy(mqttClient->host, host);
-	mqttClient->host[temp] = 0;
+	MQTT_AddBroker(mqttClient, host, port);
+	mqttClient->host = mqttClient->brokers[0].host;
 	mqttClient->port = port;
 	mqttClient->security = security;
 
 }
 
+/**
+  * @brief  Add a broker to fail over to. Call after MQTT_InitConnection,
+  *         which adds the first one, and before MQTT_Connect.
+  * @param  client: 	MQTT_Client reference
+  * @param  host: 	Domain or IP string
+  * @param  port: 	Port to connect
+  * @retval TRUE if added, FALSE if there are already MQTT_MAX_BROKERS
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTT_AddBroker(MQTT_Client *mqttClient, uint8_t* host, uint32 port)
+{
+	MQTT_BROKER *b;
+
+	if(mqttClient->brokerCount >= MQTT_MAX_BROKERS)
+		return FALSE;
+	b = &mqttClient->brokers[mqttClient->brokerCount];
+	b->host = (uint8_t*)os_zalloc(os_strlen(host) + 1);
+	os_strcpy(b->host, host);
+	b->port = port;
+	mqttClient->rank[mqttClient->brokerCount] = mqttClient->brokerCount;
+	mqttClient->brokerCount++;
+	return TRUE;
+}
+
 /**
   * @brief  MQTT initialization mqtt client function
   * @param  client: 	MQTT_Client reference
@@ -537,17 +2393,30 @@ MQTT_InitClient(MQTT_Client *mqttClient, uint8_t* client_id, uint8_t* client_use
 
 
 	mqttClient->connect_info.keepalive = keepAliveTime;
+	mqttClient->keepAliveMax = keepAliveTime;
 	mqttClient->connect_info.clean_session = cleanSession;
+	mqttClient->connect_info.session_expiry = MQTT_SESSION_EXPIRY;
+	mqttClient->connect_info.protocol_version = MQTT_PROTOCOL_VERSION;
+	mqttClient->connect_info.receive_maximum = MQTT_RECEIVE_MAXIMUM;
+	mqttClient->connect_info.maximum_packet_size = MQTT_BUF_SIZE;
+	mqttClient->inflightMax = MQTT_MAX_INFLIGHT;
 
 	mqttClient->mqtt_state.in_buffer = (uint8_t *)os_zalloc(MQTT_BUF_SIZE);
 	mqttClient->mqtt_state.in_buffer_length = MQTT_BUF_SIZE;
-	mqttClient->mqtt_state.out_buffer =  (uint8_t *)os_zalloc(MQTT_BUF_SIZE);
-	mqttClient->mqtt_state.out_buffer_length = MQTT_BUF_SIZE;
 	mqttClient->mqtt_state.connect_info = &mqttClient->connect_info;
 
-	mqtt_msg_init(&mqttClient->mqtt_state.mqtt_connection, mqttClient->mqtt_state.out_buffer, mqttClient->mqtt_state.out_buffer_length);
+	// Messages are built straight into the outbound queues
+	mqtt_msg_init(&mqttClient->mqtt_state.mqtt_connection, NULL, 0);
+	mqttClient->mqtt_state.mqtt_connection.protocol_version = mqttClient->connect_info.protocol_version;
 
-	QUEUE_Init(&mqttClient->msgQueue, QUEUE_BUFFER_SIZE);
+	QUEUE_Init(&mqttClient->lanes[MQTT_LANE_CONTROL].queue, MQTT_CONTROL_QUEUE_SIZE);
+	QUEUE_Init(&mqttClient->lanes[MQTT_LANE_EVENT].queue, QUEUE_BUFFER_SIZE);
+	QUEUE_Init(&mqttClient->lanes[MQTT_LANE_TELEMETRY].queue, MQTT_TELEMETRY_QUEUE_SIZE);
+	// An ack must never push out an earlier one, routine telemetry only matters while it's fresh
+	mqttClient->lanes[MQTT_LANE_CONTROL].policy = MQTT_DROP_NEWEST;
+	mqttClient->lanes[MQTT_LANE_EVENT].policy = MQTT_DROP_OLDEST;
+	mqttClient->lanes[MQTT_LANE_TELEMETRY].policy = MQTT_COALESCE_LATEST;
+	QUEUE_Init(&mqttClient->inflightQueue, MQTT_INFLIGHT_BUF_SIZE);
 
 	system_os_task(MQTT_Task, MQTT_TASK_PRIO, mqtt_procTaskQueue, MQTT_TASK_QUEUE_SIZE);
 	system_os_post(MQTT_TASK_PRIO, 0, (os_param_t)mqttClient);
@@ -578,11 +2447,23 @@ MQTT_InitLWT(MQTT_Client *mqttClient, uint8_t* will_topic, uint8_t* will_msg, ui
 void ICACHE_FLASH_ATTR
 MQTT_Connect(MQTT_Client *mqttClient)
 {
-	MQTT_Disconnect(mqttClient);
-	mqttClient->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
+	esp_tcp *tcp;
+	uint8_t i;
+
+	os_timer_disarm(&mqttClient->mqttTimer);
+	// The connection structures are kept from one attempt to the next
+	if(!mqttClient->pCon){
+		mqttClient->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
+		mqttClient->pCon->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
+	}
+	else {
+		tcp = mqttClient->pCon->proto.tcp;
+		os_memset(mqttClient->pCon, 0, sizeof(struct espconn));
+		os_memset(tcp, 0, sizeof(esp_tcp));
+		mqttClient->pCon->proto.tcp = tcp;
+	}
 	mqttClient->pCon->type = ESPCONN_TCP;
 	mqttClient->pCon->state = ESPCONN_NONE;
-	mqttClient->pCon->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
 	mqttClient->pCon->proto.tcp->local_port = espconn_port();
 	mqttClient->pCon->proto.tcp->remote_port = mqttClient->port;
 	mqttClient->pCon->reverse = mqttClient;
@@ -591,12 +2472,55 @@ MQTT_Connect(MQTT_Client *mqttClient)
 
 	mqttClient->keepAliveTick = 0;
 	mqttClient->reconnectTick = 0;
+	mqttClient->pingTick = 0;
+	mqttClient->pingSentTime = 0;
+	MQTT_METRIC(mqttClient->metrics.pingStart = 0);
+	MQTT_METRIC(mqttClient->metrics.cause = MQTT_CAUSE_CLOSED);
+	// A broker which keeps failing or answers slowly gives way to the next
+	if(mqttClient->brokerCount > 1 && (mqttClient->failover || mqttClient->reconnectAttempts >= MQTT_FAILOVER_ATTEMPTS))
+		mqtt_broker_next(mqttClient);
+	mqtt_backoff(mqttClient);
+	// A shortened keepalive which kept the link up is lengthened again
+	if(mqttClient->keepAliveProven && mqttClient->connect_info.keepalive < mqttClient->keepAliveMax){
+		mqttClient->connect_info.keepalive *= 2;
+		if(mqttClient->connect_info.keepalive > mqttClient->keepAliveMax)
+			mqttClient->connect_info.keepalive = mqttClient->keepAliveMax;
+	}
+	mqttClient->keepAliveProven = FALSE;
+	// A SUBSCRIBE without a SUBACK is sent again with the CONNECT
+	for(i = 0; i < MQTT_MAX_SUBSCRIPTIONS; i++){
+		if(mqttClient->subs[i].state == MQTT_SUB_PENDING)
+			mqttClient->subs[i].state = MQTT_SUB_NONE;
+	}
+	// Limits from the last CONNACK don't apply until the next one
+	mqttClient->aliasMax = 0;
+	if(!mqttClient->linkTiming){
+		mqttClient->linkTiming = TRUE;
+		mqttClient->linkUpTime = system_get_time();
+	}
+	// Messages being sent on the old connection are sent again on the new one
+	mqtt_inflight_reconnect(mqttClient);
+	mqttClient->sendCount = 0;
+	mqttClient->sendPublishes = 0;
+	mqttClient->sendTimeout = 0;
+	mqttClient->sendRetries = 0;
+	mqttClient->sendBackoff = 0;
+	// A streamed publish cut off by the old connection starts again
+	mqttClient->sendStream = FALSE;
+	mqttClient->stream.started = FALSE;
+	mqttClient->stream.offset = 0;
+	mqttClient->stream.chunk = 0;
 
 
-	os_timer_disarm(&mqttClient->mqttTimer);
 	os_timer_setfn(&mqttClient->mqttTimer, (os_timer_func_t *)mqtt_timer, mqttClient);
 	os_timer_arm(&mqttClient->mqttTimer, 1000, 1);
 
+	// With more than one broker, find the fastest first
+	if(mqttClient->brokerCount > 1 && !mqttClient->ranked){
+		mqtt_probe_start(mqttClient);
+		return;
+	}
+
 	if(UTILS_StrToIP(mqttClient->host, &mqttClient->pCon->proto.tcp->remote_ip)) {
 		INFO("TCP: Connect to ip  %s:%d\r\n", mqttClient->host, mqttClient->port);
 		if(mqttClient->security){
@@ -605,12 +2529,28 @@ MQTT_Connect(MQTT_Client *mqttClient)
 		else {
 			espconn_connect(mqttClient->pCon);
 		}
+		mqttClient->connState = TCP_CONNECTING;
+	}
+	else if(mqttClient->dnsValid){
+		INFO("TCP: Connect to domain %s:%d, cached address\r\n", mqttClient->host, mqttClient->port);
+		mqtt_tcp_connect(mqttClient);
 	}
 	else {
 		INFO("TCP: Connect to domain %s:%d\r\n", mqttClient->host, mqttClient->port);
-		espconn_gethostbyname(mqttClient->pCon, mqttClient->host, &mqttClient->ip, mqtt_dns_found);
+		mqttClient->connState = DNS_RESOLVE;
+		switch(espconn_gethostbyname(mqttClient->pCon, mqttClient->host, &mqttClient->ip, mqtt_dns_found)){
+		case ESPCONN_OK:
+			// Answered from the lwIP cache, no callback follows
+			mqtt_dns_found(mqttClient->host, &mqttClient->ip, mqttClient->pCon);
+			break;
+		case ESPCONN_INPROGRESS:
+			break;
+		default:
+			INFO("DNS: Lookup failed\r\n");
+			mqttClient->connState = TCP_RECONNECT_REQ;
+			break;
+		}
 	}
-	mqttClient->connState = TCP_CONNECTING;
 }
 
 void ICACHE_FLASH_ATTR
@@ -624,6 +2564,10 @@ MQTT_Disconnect(MQTT_Client *mqttClient)
 		mqttClient->pCon = NULL;
 	}
 
+	// A probe still running is left to finish without connecting
+	if(mqttClient->connState == BROKER_PROBING)
+		mqttClient->connState = TCP_DISCONNECTED;
+
 	os_timer_disarm(&mqttClient->mqttTimer);
 }
 void ICACHE_FLASH_ATTR
@@ -632,6 +2576,20 @@ MQTT_OnConnected(MQTT_Client *mqttClient, MqttCallback connectedCb)
 	mqttClient->connectedCb = connectedCb;
 }
 
+/**
+  * @brief  Set the callback for a change of broker. It is called before
+  *         connecting to the newly chosen broker, so the birth message can
+  *         be updated for it.
+  * @param  client: 	MQTT_Client reference
+  * @param  brokerCb: 	callback
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTT_OnBroker(MQTT_Client *mqttClient, MqttCallback brokerCb)
+{
+	mqttClient->brokerCb = brokerCb;
+}
+
 void ICACHE_FLASH_ATTR
 MQTT_OnDisconnected(MQTT_Client *mqttClient, MqttCallback disconnectedCb)
 {
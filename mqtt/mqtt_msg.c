@@ -32,7 +32,7 @@
 #include <string.h>
 #include "mqtt_msg.h"
 #include "user_config.h"
-#define MQTT_MAX_FIXED_HEADER_SIZE 3
+#define MQTT_MAX_FIXED_HEADER_SIZE 5
 
 enum mqtt_connect_flag
 {
@@ -43,22 +43,7 @@ enum mqtt_connect_flag
   MQTT_CONNECT_FLAG_CLEAN_SESSION = 1 << 1
 };
 
-struct __attribute((__packed__)) mqtt_connect_variable_header
-{
-  uint8_t lengthMsb;
-  uint8_t lengthLsb;
-#if defined(PROTOCOL_NAMEv31)
-  uint8_t magic[6];
-#elif defined(PROTOCOL_NAMEv311)
-  uint8_t magic[4];
-#else
-#error "Please define protocol name"
-#endif
-  uint8_t version;
-  uint8_t flags;
-  uint8_t keepaliveMsb;
-  uint8_t keepaliveLsb;
-};
+#define MQTT_MAX_PROPERTIES_SIZE 16
 
 static int ICACHE_FLASH_ATTR append_string(mqtt_connection_t* connection, const char* string, int len)
 {
@@ -73,6 +58,97 @@ static int ICACHE_FLASH_ATTR append_string(mqtt_connection_t* connection, const
   return len + 2;
 }
 
+// Add an MQTT 5 numeric property of size bytes to a property list
+static int ICACHE_FLASH_ATTR append_property(uint8_t* props, int len, uint8_t id, uint32_t value, int size)
+{
+  props[len++] = id;
+  while(size--)
+    props[len++] = value >> (8 * size);
+  return len;
+}
+
+// Add an MQTT 5 property list, preceded by its length
+static int ICACHE_FLASH_ATTR append_properties(mqtt_connection_t* connection, const uint8_t* props, int len)
+{
+  if(connection->message.length + len + 1 > connection->buffer_length)
+    return -1;
+
+  // Property lists built here are always shorter than 128 bytes
+  connection->buffer[connection->message.length++] = len;
+  if(len)
+    memcpy(connection->buffer + connection->message.length, props, len);
+  connection->message.length += len;
+
+  return len + 1;
+}
+
+static int ICACHE_FLASH_ATTR decode_varint(const uint8_t* buffer, int length, int* pos, uint32_t* value)
+{
+  int shift;
+  uint8_t c;
+
+  *value = 0;
+  for(shift = 0; shift < 28 && *pos < length; shift += 7)
+  {
+    c = buffer[(*pos)++];
+    *value |= (uint32_t)(c & 0x7f) << shift;
+    if((c & 0x80) == 0)
+      return 0;
+  }
+  return -1;
+}
+
+// Read the next MQTT 5 property. Numeric values are returned in value,
+// strings and binary data are skipped.
+static int ICACHE_FLASH_ATTR next_property(const uint8_t* buffer, int end, int* pos, uint8_t* id, uint32_t* value)
+{
+  int size;
+  int strings = 1;
+
+  if(*pos >= end)
+    return -1;
+  *id = buffer[(*pos)++];
+  *value = 0;
+
+  switch(*id)
+  {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2a:
+      size = 1;
+      break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+      size = 2;
+      break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+      size = 4;
+      break;
+    case 0x0b:
+      return decode_varint(buffer, end, pos, value);
+    case 0x26:
+      // User property, a string pair
+      strings = 2;
+      // Fall through
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1a: case 0x1c: case 0x1f:
+      while(strings--)
+      {
+        if(*pos + 2 > end)
+          return -1;
+        size = (buffer[*pos] << 8) | buffer[*pos + 1];
+        if(*pos + 2 + size > end)
+          return -1;
+        *pos += 2 + size;
+      }
+      return 0;
+    default:
+      return -1;
+  }
+
+  if(*pos + size > end)
+    return -1;
+  while(size--)
+    *value = (*value << 8) | buffer[(*pos)++];
+  return 0;
+}
+
 static uint16_t ICACHE_FLASH_ATTR append_message_id(mqtt_connection_t* connection, uint16_t message_id)
 {
   // If message_id is zero then we should assign one, otherwise
@@ -102,32 +178,60 @@ static mqtt_message_t* ICACHE_FLASH_ATTR fail_message(mqtt_connection_t* connect
   return &connection->message;
 }
 
-static mqtt_message_t* ICACHE_FLASH_ATTR fini_message(mqtt_connection_t* connection, int type, int dup, int qos, int retain)
+// Put the fixed header just before the variable header. The remaining
+// length may count payload which isn't in the buffer.
+static mqtt_message_t* ICACHE_FLASH_ATTR fini_header(mqtt_connection_t* connection, int type, int dup, int qos, int retain, uint32_t remaining_length)
 {
-  int remaining_length = connection->message.length - MQTT_MAX_FIXED_HEADER_SIZE;
+  uint8_t length[4];
+  int n = mqtt_msg_encode_length(length, remaining_length);
+  int start = MQTT_MAX_FIXED_HEADER_SIZE - 1 - n;
 
-  if(remaining_length > 127)
-  {
-    connection->buffer[0] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
-    connection->buffer[1] = 0x80 | (remaining_length % 128);
-    connection->buffer[2] = remaining_length / 128;
-    connection->message.length = remaining_length + 3;
-    connection->message.data = connection->buffer;
-  }
-  else
-  {
-    connection->buffer[1] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
-    connection->buffer[2] = remaining_length;
-    connection->message.length = remaining_length + 2;
-    connection->message.data = connection->buffer + 1;
-  }
+  if(n == 0)
+    return fail_message(connection);
+
+  connection->buffer[start] = ((type & 0x0f) << 4) | ((dup & 1) << 3) | ((qos & 3) << 1) | (retain & 1);
+  memcpy(connection->buffer + start + 1, length, n);
+  connection->message.length = connection->message.length - start;
+  connection->message.data = connection->buffer + start;
 
   return &connection->message;
 }
 
+static mqtt_message_t* ICACHE_FLASH_ATTR fini_message(mqtt_connection_t* connection, int type, int dup, int qos, int retain)
+{
+  return fini_header(connection, type, dup, qos, retain, connection->message.length - MQTT_MAX_FIXED_HEADER_SIZE);
+}
+
+// Encode a remaining length, returning its size in bytes, or 0 if it's
+// too long for MQTT
+int ICACHE_FLASH_ATTR mqtt_msg_encode_length(uint8_t* buffer, uint32_t length)
+{
+  int n = 0;
+
+  if(length > MQTT_MAX_REMAINING_LENGTH)
+    return 0;
+  do
+  {
+    buffer[n] = length % 128;
+    length /= 128;
+    if(length)
+      buffer[n] |= 0x80;
+    n++;
+  } while(length);
+
+  return n;
+}
+
 void ICACHE_FLASH_ATTR mqtt_msg_init(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length)
 {
-  memset(connection, 0, sizeof(connection));
+  memset(connection, 0, sizeof(*connection));
+  connection->buffer = buffer;
+  connection->buffer_length = buffer_length;
+}
+
+// Change the buffer the next message is built in
+void ICACHE_FLASH_ATTR mqtt_msg_set_buffer(mqtt_connection_t* connection, uint8_t* buffer, uint16_t buffer_length)
+{
   connection->buffer = buffer;
   connection->buffer_length = buffer_length;
 }
@@ -180,8 +284,10 @@ const char* ICACHE_FLASH_ATTR mqtt_get_publish_topic(uint8_t* buffer, uint16_t*
   return (const char*)(buffer + i);
 }
 
-const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* length)
+const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* length, int version)
 {
+  uint32_t props;
+
   int i;
   int totlen = 0;
   int topiclen;
@@ -202,7 +308,7 @@ const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* l
   topiclen = buffer[i++] << 8;
   topiclen |= buffer[i++];
 
-  if(i + topiclen >= *length){
+  if(i + topiclen > *length){
 	*length = 0;
     return NULL;
   }
@@ -210,11 +316,18 @@ const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* l
 
   if(mqtt_get_qos(buffer) > 0)
   {
-    if(i + 2 >= *length)
+    if(i + 2 > *length)
       return NULL;
     i += 2;
   }
 
+  if(version == MQTT_PROTOCOL_V5)
+  {
+    if(decode_varint(buffer, *length, &i, &props) < 0)
+      return NULL;
+    i += props;
+  }
+
   if(totlen < i)
     return NULL;
 
@@ -225,6 +338,180 @@ const char* ICACHE_FLASH_ATTR mqtt_get_publish_data(uint8_t* buffer, uint16_t* l
   return (const char*)(buffer + i);
 }
 
+// Return the topic alias of an MQTT 5 publish, or 0 if it has none
+uint16_t ICACHE_FLASH_ATTR mqtt_get_publish_alias(uint8_t* buffer, uint16_t length)
+{
+  int i = 1;
+  int end;
+  uint32_t value;
+  uint8_t id;
+
+  if(decode_varint(buffer, length, &i, &value) < 0 || i + 2 > length)
+    return 0;
+  i += ((buffer[i] << 8) | buffer[i + 1]) + 2;
+  if(mqtt_get_qos(buffer) > 0)
+    i += 2;
+
+  if(decode_varint(buffer, length, &i, &value) < 0)
+    return 0;
+  end = i + value;
+  if(end > length)
+    return 0;
+  while(i < end)
+  {
+    if(next_property(buffer, end, &i, &id, &value) < 0)
+      return 0;
+    if(id == MQTT_PROP_TOPIC_ALIAS)
+      return value;
+  }
+  return 0;
+}
+
+// Remove properties from an MQTT 5 message in place. With alias_only set,
+// only the topic alias goes from a publish which also carries its topic;
+// otherwise every property list goes, with its length, leaving the MQTT 3.1.1
+// layout. Returns the new length, or 0 if the message can't be kept: a
+// publish with only an alias in place of its topic, or a malformed message.
+uint16_t ICACHE_FLASH_ATTR mqtt_msg_strip_properties(uint8_t* buffer, uint16_t length, int alias_only)
+{
+  uint8_t header[4];
+  uint32_t value;
+  uint8_t id;
+  int i = 1;
+  int start, props, end, cut, n, m, out;
+  int type = mqtt_get_type(buffer);
+
+  if(type != MQTT_MSG_TYPE_PUBLISH && (alias_only || (type != MQTT_MSG_TYPE_SUBSCRIBE && type != MQTT_MSG_TYPE_UNSUBSCRIBE)))
+    return length;
+  if(decode_varint(buffer, length, &i, &value) < 0 || i + value != length)
+    return 0;
+  start = i;
+  if(type == MQTT_MSG_TYPE_PUBLISH)
+  {
+    if(i + 2 > length || (buffer[i] == 0 && buffer[i + 1] == 0))
+      return 0;
+    i += ((buffer[i] << 8) | buffer[i + 1]) + 2;
+    if(mqtt_get_qos(buffer) > 0)
+      i += 2;
+  }
+  else
+    i += 2;
+
+  // The property list runs from props to end, after its length
+  props = i;
+  if(decode_varint(buffer, length, &i, &value) < 0 || i + value > length)
+    return 0;
+  end = i + value;
+  cut = i;
+  if(alias_only)
+  {
+    while(cut < end)
+    {
+      n = cut;
+      if(next_property(buffer, end, &n, &id, &value) < 0)
+        return 0;
+      if(id == MQTT_PROP_TOPIC_ALIAS)
+        break;
+      cut = n;
+    }
+    if(cut == end)
+      return length;
+  }
+
+  // Everything only moves towards the start, so each part can be moved in turn
+  if(alias_only)
+    n = length - start - (i - props) - 3 + mqtt_msg_encode_length(header, end - i - 3);
+  else
+    n = length - start - (end - props);
+  m = mqtt_msg_encode_length(header, n);
+  memcpy(buffer + 1, header, m);
+  out = 1 + m;
+  memmove(buffer + out, buffer + start, props - start);
+  out += props - start;
+  if(alias_only)
+  {
+    n = end - i - 3;
+    out += mqtt_msg_encode_length(buffer + out, n);
+    memmove(buffer + out, buffer + i, cut - i);
+    out += cut - i;
+    memmove(buffer + out, buffer + cut + 3, end - cut - 3);
+    out += end - cut - 3;
+  }
+  memmove(buffer + out, buffer + end, length - end);
+  return out + length - end;
+}
+
+// Decode a CONNACK. Server limits not in the packet are set to the MQTT 5 defaults.
+int ICACHE_FLASH_ATTR mqtt_get_connack(uint8_t* buffer, uint16_t length, int version, mqtt_connack_t* connack)
+{
+  int i = 1;
+  int end;
+  uint32_t value;
+  uint8_t id;
+
+  memset(connack, 0, sizeof(*connack));
+  connack->receive_maximum = 65535;
+
+  if(decode_varint(buffer, length, &i, &value) < 0 || i + 2 > length)
+    return -1;
+  connack->session_present = buffer[i++] & 1;
+  connack->return_code = buffer[i++];
+
+  // A server which doesn't support MQTT 5 sends a short CONNACK
+  if(version != MQTT_PROTOCOL_V5 || i >= length)
+    return 0;
+
+  if(decode_varint(buffer, length, &i, &value) < 0)
+    return -1;
+  end = i + value;
+  if(end > length)
+    return -1;
+  while(i < end)
+  {
+    if(next_property(buffer, end, &i, &id, &value) < 0)
+      return -1;
+    switch(id)
+    {
+      case MQTT_PROP_RECEIVE_MAXIMUM:
+        connack->receive_maximum = value;
+        break;
+      case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+        connack->topic_alias_maximum = value;
+        break;
+      case MQTT_PROP_SERVER_KEEP_ALIVE:
+        connack->server_keepalive = value;
+        break;
+      case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+        connack->maximum_packet_size = value;
+        break;
+    }
+  }
+  return 0;
+}
+
+// Find the return codes of a SUBACK (reason codes for MQTT 5), one for each
+// topic filter subscribed to. Returns how many there are, or -1 if it is malformed.
+int ICACHE_FLASH_ATTR mqtt_get_suback_codes(uint8_t* buffer, uint16_t length, int version, const uint8_t** codes)
+{
+  int i = 1;
+  uint32_t value;
+
+  if(decode_varint(buffer, length, &i, &value) < 0)
+    return -1;
+  // Skip the message id
+  i += 2;
+  if(version == MQTT_PROTOCOL_V5)
+  {
+    if(decode_varint(buffer, length, &i, &value) < 0)
+      return -1;
+    i += value;
+  }
+  if(i > length)
+    return -1;
+  *codes = buffer + i;
+  return length - i;
+}
+
 uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length)
 {
   if(length < 1)
@@ -251,13 +538,13 @@ uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length)
       topiclen = buffer[i++] << 8;
       topiclen |= buffer[i++];
 
-      if(i + topiclen >= length)
+      if(i + topiclen > length)
         return 0;
       i += topiclen;
 
       if(mqtt_get_qos(buffer) > 0)
       {
-        if(i + 2 >= length)
+        if(i + 2 > length)
           return 0;
         //i += 2;
       } else {
@@ -274,12 +561,13 @@ uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length)
     case MQTT_MSG_TYPE_UNSUBACK:
     case MQTT_MSG_TYPE_SUBSCRIBE:
     {
-      // This requires the remaining length to be encoded in 1 byte,
-      // which it should be.
-      if(length >= 4 && (buffer[1] & 0x80) == 0)
-        return (buffer[2] << 8) | buffer[3];
-      else
+      // A SUBSCRIBE for several topics can need more than 1 length byte
+      int i = 1;
+      uint32_t remaining;
+
+      if(decode_varint(buffer, length, &i, &remaining) < 0 || i + 2 > length)
         return 0;
+      return (buffer[i] << 8) | buffer[i + 1];
     }
 
     default:
@@ -289,34 +577,42 @@ uint16_t ICACHE_FLASH_ATTR mqtt_get_id(uint8_t* buffer, uint16_t length)
 
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info)
 {
-  struct mqtt_connect_variable_header* variable_header;
+  const char* name;
+  uint8_t props[MQTT_MAX_PROPERTIES_SIZE];
+  int props_len = 0;
+  int flags_offset;
+  uint8_t flags = 0;
 
   init_message(connection);
+  connection->protocol_version = info->protocol_version;
 
-  if(connection->message.length + sizeof(*variable_header) > connection->buffer_length)
+  // MQTT 3.1 has its own protocol name
+  name = (info->protocol_version == MQTT_PROTOCOL_V31) ? "MQIsdp" : "MQTT";
+  if(append_string(connection, name, strlen(name)) < 0)
     return fail_message(connection);
-  variable_header = (void*)(connection->buffer + connection->message.length);
-  connection->message.length += sizeof(*variable_header);
-
-  variable_header->lengthMsb = 0;
-#if defined(PROTOCOL_NAMEv31)
-  variable_header->lengthLsb = 6;
-  memcpy(variable_header->magic, "MQIsdp", 6);
-  variable_header->version = 3;
-#elif defined(PROTOCOL_NAMEv311)
-  variable_header->lengthLsb = 4;
-  memcpy(variable_header->magic, "MQTT", 4);
-  variable_header->version = 4;
-#else
-#error "Please define protocol name"
-#endif
-
-  variable_header->flags = 0;
-  variable_header->keepaliveMsb = info->keepalive >> 8;
-  variable_header->keepaliveLsb = info->keepalive & 0xff;
+
+  if(connection->message.length + 4 > connection->buffer_length)
+    return fail_message(connection);
+  connection->buffer[connection->message.length++] = info->protocol_version;
+  flags_offset = connection->message.length++;
+  connection->buffer[connection->message.length++] = info->keepalive >> 8;
+  connection->buffer[connection->message.length++] = info->keepalive & 0xff;
+
+  if(info->protocol_version == MQTT_PROTOCOL_V5)
+  {
+    if(info->receive_maximum)
+      props_len = append_property(props, props_len, MQTT_PROP_RECEIVE_MAXIMUM, info->receive_maximum, 2);
+    if(info->maximum_packet_size)
+      props_len = append_property(props, props_len, MQTT_PROP_MAXIMUM_PACKET_SIZE, info->maximum_packet_size, 4);
+    // Without an expiry the session ends with the connection
+    if(!info->clean_session && info->session_expiry)
+      props_len = append_property(props, props_len, MQTT_PROP_SESSION_EXPIRY_INTERVAL, info->session_expiry, 4);
+    if(append_properties(connection, props, props_len) < 0)
+      return fail_message(connection);
+  }
 
   if(info->clean_session)
-    variable_header->flags |= MQTT_CONNECT_FLAG_CLEAN_SESSION;
+    flags |= MQTT_CONNECT_FLAG_CLEAN_SESSION;
 
   if(info->client_id != NULL && info->client_id[0] != '\0')
   {
@@ -328,16 +624,20 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection
 
   if(info->will_topic != NULL && info->will_topic[0] != '\0')
   {
+    // No will properties
+    if(info->protocol_version == MQTT_PROTOCOL_V5 && append_properties(connection, NULL, 0) < 0)
+      return fail_message(connection);
+
     if(append_string(connection, info->will_topic, strlen(info->will_topic)) < 0)
       return fail_message(connection);
 
     if(append_string(connection, info->will_message, strlen(info->will_message)) < 0)
       return fail_message(connection);
 
-    variable_header->flags |= MQTT_CONNECT_FLAG_WILL;
+    flags |= MQTT_CONNECT_FLAG_WILL;
     if(info->will_retain)
-      variable_header->flags |= MQTT_CONNECT_FLAG_WILL_RETAIN;
-    variable_header->flags |= (info->will_qos & 3) << 3;
+      flags |= MQTT_CONNECT_FLAG_WILL_RETAIN;
+    flags |= (info->will_qos & 3) << 3;
   }
 
   if(info->username != NULL && info->username[0] != '\0')
@@ -345,7 +645,7 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection
     if(append_string(connection, info->username, strlen(info->username)) < 0)
       return fail_message(connection);
 
-    variable_header->flags |= MQTT_CONNECT_FLAG_USERNAME;
+    flags |= MQTT_CONNECT_FLAG_USERNAME;
   }
 
   if(info->password != NULL && info->password[0] != '\0')
@@ -353,20 +653,31 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_connect(mqtt_connection_t* connection
     if(append_string(connection, info->password, strlen(info->password)) < 0)
       return fail_message(connection);
 
-    variable_header->flags |= MQTT_CONNECT_FLAG_PASSWORD;
+    flags |= MQTT_CONNECT_FLAG_PASSWORD;
   }
 
+  connection->buffer[flags_offset] = flags;
   return fini_message(connection, MQTT_MSG_TYPE_CONNECT, 0, 0, 0);
 }
 
-mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id)
+mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id, const mqtt_publish_properties_t* properties)
 {
+  uint8_t props[MQTT_MAX_PROPERTIES_SIZE];
+  int props_len = 0;
+  int v5 = (connection->protocol_version == MQTT_PROTOCOL_V5) && properties != NULL;
+
   init_message(connection);
 
   if(topic == NULL || topic[0] == '\0')
     return fail_message(connection);
 
-  if(append_string(connection, topic, strlen(topic)) < 0)
+  // An established topic alias replaces the topic
+  if(v5 && properties->topic_alias && properties->alias_only)
+  {
+    if(append_string(connection, "", 0) < 0)
+      return fail_message(connection);
+  }
+  else if(append_string(connection, topic, strlen(topic)) < 0)
     return fail_message(connection);
 
   if(qos > 0)
@@ -377,6 +688,16 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection
   else
     *message_id = 0;
 
+  if(connection->protocol_version == MQTT_PROTOCOL_V5)
+  {
+    if(v5 && properties->message_expiry)
+      props_len = append_property(props, props_len, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, properties->message_expiry, 4);
+    if(v5 && properties->topic_alias)
+      props_len = append_property(props, props_len, MQTT_PROP_TOPIC_ALIAS, properties->topic_alias, 2);
+    if(append_properties(connection, props, props_len) < 0)
+      return fail_message(connection);
+  }
+
   if(connection->message.length + data_length > connection->buffer_length)
     return fail_message(connection);
   memcpy(connection->buffer + connection->message.length, data, data_length);
@@ -385,6 +706,35 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish(mqtt_connection_t* connection
   return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+// Build a publish with no payload in the buffer, for a payload of
+// data_length bytes to be sent straight after it
+mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_publish_header(mqtt_connection_t* connection, const char* topic, uint32_t data_length, int qos, int retain, uint16_t* message_id)
+{
+  init_message(connection);
+
+  if(topic == NULL || topic[0] == '\0')
+    return fail_message(connection);
+
+  if(append_string(connection, topic, strlen(topic)) < 0)
+    return fail_message(connection);
+
+  if(qos > 0)
+  {
+    if((*message_id = append_message_id(connection, 0)) == 0)
+      return fail_message(connection);
+  }
+  else
+    *message_id = 0;
+
+  if(connection->protocol_version == MQTT_PROTOCOL_V5)
+  {
+    if(append_properties(connection, NULL, 0) < 0)
+      return fail_message(connection);
+  }
+
+  return fini_header(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain, connection->message.length - MQTT_MAX_FIXED_HEADER_SIZE + data_length);
+}
+
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id)
 {
   init_message(connection);
@@ -419,20 +769,39 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pubcomp(mqtt_connection_t* connection
 
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_subscribe(mqtt_connection_t* connection, const char* topic, int qos, uint16_t* message_id)
 {
+  uint8_t q = qos;
+
+  return mqtt_msg_subscribe_multi(connection, &topic, &q, 1, message_id);
+}
+
+// One SUBSCRIBE for several topic filters, answered by one SUBACK with a return code for each
+mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_subscribe_multi(mqtt_connection_t* connection, const char** topics, const uint8_t* qos, int count, uint16_t* message_id)
+{
+  int i;
+
   init_message(connection);
 
-  if(topic == NULL || topic[0] == '\0')
+  if(count < 1)
     return fail_message(connection);
 
   if((*message_id = append_message_id(connection, 0)) == 0)
     return fail_message(connection);
 
-  if(append_string(connection, topic, strlen(topic)) < 0)
+  if(connection->protocol_version == MQTT_PROTOCOL_V5 && append_properties(connection, NULL, 0) < 0)
     return fail_message(connection);
 
-  if(connection->message.length + 1 > connection->buffer_length)
-    return fail_message(connection);
-  connection->buffer[connection->message.length++] = qos;
+  for(i = 0; i < count; i++)
+  {
+    if(topics[i] == NULL || topics[i][0] == '\0')
+      return fail_message(connection);
+
+    if(append_string(connection, topics[i], strlen(topics[i])) < 0)
+      return fail_message(connection);
+
+    if(connection->message.length + 1 > connection->buffer_length)
+      return fail_message(connection);
+    connection->buffer[connection->message.length++] = qos[i];
+  }
 
   return fini_message(connection, MQTT_MSG_TYPE_SUBSCRIBE, 0, 1, 0);
 }
@@ -447,10 +816,13 @@ mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_unsubscribe(mqtt_connection_t* connec
   if((*message_id = append_message_id(connection, 0)) == 0)
     return fail_message(connection);
 
+  if(connection->protocol_version == MQTT_PROTOCOL_V5 && append_properties(connection, NULL, 0) < 0)
+    return fail_message(connection);
+
   if(append_string(connection, topic, strlen(topic)) < 0)
     return fail_message(connection);
 
-  return fini_message(connection, MQTT_MSG_TYPE_SUBSCRIBE, 0, 1, 0);
+  return fini_message(connection, MQTT_MSG_TYPE_UNSUBSCRIBE, 0, 1, 0);
 }
 
 mqtt_message_t* ICACHE_FLASH_ATTR mqtt_msg_pingreq(mqtt_connection_t* connection)
@@ -0,0 +1,720 @@
+/* mqttsn.c
+*
+* MQTT-SN 1.2 client over UDP
+*
+* A small client for sending telemetry through an MQTT-SN gateway. It
+* keeps no TCP state, and each publish carries a 2 byte topic ID in
+* place of the topic name. Requests to the gateway go one at a time and
+* are sent again until answered. Publishes are QoS -1 or 0, so they are
+* sent once and forgotten.
+*/
+
+#include "user_interface.h"
+#include "osapi.h"
+#include "espconn.h"
+#include "os_type.h"
+#include "mem.h"
+#include "debug.h"
+#include "user_config.h"
+#include "utils.h"
+#include "mqttsn.h"
+
+#define MQTTSN_RETRY			5		/* Seconds to wait for an answer from the gateway */
+#define MQTTSN_RETRIES			3		/* Times a request is sent before the gateway is given up on */
+#define MQTTSN_WAIT_MIN			5		/* Seconds before the first reconnection attempt */
+#define MQTTSN_WAIT_MAX			120		/* Longest wait between attempts, seconds */
+
+/* Message types */
+#define MQTTSN_CONNECT			0x04
+#define MQTTSN_CONNACK			0x05
+#define MQTTSN_REGISTER			0x0A
+#define MQTTSN_REGACK			0x0B
+#define MQTTSN_PUBLISH			0x0C
+#define MQTTSN_PUBACK			0x0D
+#define MQTTSN_SUBSCRIBE		0x12
+#define MQTTSN_SUBACK			0x13
+#define MQTTSN_PINGREQ			0x16
+#define MQTTSN_PINGRESP			0x17
+#define MQTTSN_DISCONNECT		0x18
+
+/* Flags */
+#define MQTTSN_FLAG_QOS_M1		0x60
+#define MQTTSN_FLAG_QOS1		0x20
+#define MQTTSN_FLAG_QOS_MASK	0x60
+#define MQTTSN_FLAG_RETAIN		0x10
+#define MQTTSN_FLAG_CLEAN		0x04
+#define MQTTSN_TOPIC_NORMAL		0x00
+#define MQTTSN_TOPIC_ID_PREDEF	0x01
+#define MQTTSN_TOPIC_TYPE_MASK	0x03
+
+#define MQTTSN_PROTOCOL_ID		0x01
+#define MQTTSN_ACCEPTED			0x00
+#define MQTTSN_INVALID_TOPIC	0x02
+
+/**
+  * @brief  Start a packet in the client's buffer.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  type: 		message type
+  * @param  bodyLen: 	bytes after the message type
+  * @retval Offset of the body, 0 if the packet won't fit
+  */
+LOCAL uint16_t ICACHE_FLASH_ATTR
+mqttsn_start(MQTTSN_Client *client, uint8_t type, uint16_t bodyLen)
+{
+	uint8_t *buf = client->buf;
+
+	if(bodyLen + 2 <= 255){
+		buf[0] = bodyLen + 2;
+		buf[1] = type;
+		return 2;
+	}
+	if(bodyLen + 4 > MQTTSN_BUF_SIZE)
+		return 0;
+	// Long form, a 0x01 marker then a 2 byte length
+	buf[0] = 0x01;
+	buf[1] = (bodyLen + 4) >> 8;
+	buf[2] = (bodyLen + 4) & 0xff;
+	buf[3] = type;
+	return 4;
+}
+
+/**
+  * @brief  Put a 2 byte big endian value in a packet.
+  * @param  p: 	where
+  * @param  v: 	value
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+/**
+  * @brief  Next message ID, never 0.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval Message ID
+  */
+LOCAL uint16_t ICACHE_FLASH_ATTR
+mqttsn_msg_id(MQTTSN_Client *client)
+{
+	if(!++client->msgId)
+		client->msgId = 1;
+	return client->msgId;
+}
+
+/**
+  * @brief  Send the packet in the client's buffer to the gateway.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  len: 		packet length
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_send(MQTTSN_Client *client, uint16_t len)
+{
+	// Receiving overwrites the remote address with the sender's
+	os_memcpy(client->udp.remote_ip, &client->ip.addr, 4);
+	client->udp.remote_port = client->port;
+	espconn_sent(&client->conn, client->buf, len);
+	client->keepAliveTick = 0;
+}
+
+/**
+  * @brief  Send the request waiting for an answer, again if need be.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_send_pending(MQTTSN_Client *client)
+{
+	MQTTSN_TOPIC *t = &client->topics[client->pendingTopic];
+	uint16_t n, len = 0;
+	uint8_t *p;
+
+	switch(client->pendingType){
+	case MQTTSN_CONNECT:
+		n = os_strlen(client->clientId);
+		p = client->buf + mqttsn_start(client, MQTTSN_CONNECT, 4 + n);
+		p[0] = MQTTSN_FLAG_CLEAN;
+		p[1] = MQTTSN_PROTOCOL_ID;
+		mqttsn_put16(p + 2, client->keepAlive);
+		os_memcpy(p + 4, client->clientId, n);
+		len = p + 4 + n - client->buf;
+		break;
+
+	case MQTTSN_REGISTER:
+		n = os_strlen(t->name);
+		p = client->buf + mqttsn_start(client, MQTTSN_REGISTER, 4 + n);
+		mqttsn_put16(p, 0);
+		mqttsn_put16(p + 2, client->pendingId);
+		os_memcpy(p + 4, t->name, n);
+		len = p + 4 + n - client->buf;
+		break;
+
+	case MQTTSN_SUBSCRIBE:
+		n = os_strlen(t->name);
+		p = client->buf + mqttsn_start(client, MQTTSN_SUBSCRIBE, 3 + n);
+		p[0] = MQTTSN_TOPIC_NORMAL;
+		mqttsn_put16(p + 1, client->pendingId);
+		os_memcpy(p + 3, t->name, n);
+		len = p + 3 + n - client->buf;
+		break;
+
+	case MQTTSN_PINGREQ:
+		len = mqttsn_start(client, MQTTSN_PINGREQ, 0);
+		break;
+
+	default:
+		return;
+	}
+	mqttsn_send(client, len);
+}
+
+/**
+  * @brief  Send a request and wait for its answer.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  type: 		message type
+  * @param  topic: 	topic the request is for
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_request(MQTTSN_Client *client, uint8_t type, uint8_t topic)
+{
+	client->pendingType = type;
+	client->pendingId = (type == MQTTSN_REGISTER || type == MQTTSN_SUBSCRIBE) ? mqttsn_msg_id(client) : 0;
+	client->pendingTopic = topic;
+	client->ticks = 0;
+	client->retries = 1;
+	mqttsn_send_pending(client);
+}
+
+/**
+  * @brief  The gateway stopped answering or ended the connection. Wait,
+  *         longer after each failed attempt, and connect again.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_lost(MQTTSN_Client *client)
+{
+	uint8_t i;
+
+	for(i = 0; i < MQTTSN_MAX_TOPICS; i++){
+		if(!(client->topics[i].flags & MQTTSN_TOPIC_PREDEFINED))
+			client->topics[i].flags &= ~MQTTSN_TOPIC_READY;
+	}
+	client->pendingType = 0;
+	client->state = MQTTSN_WAITING;
+	client->ticks = 0;
+	INFO("MQTTSN: Gateway lost, retrying in %d s\r\n", client->waitDelay);
+}
+
+/**
+  * @brief  Send the CONNECT.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_connect(MQTTSN_Client *client)
+{
+	INFO("MQTTSN: Connecting to %s:%d\r\n", client->host, client->port);
+	client->state = MQTTSN_CONNECTING;
+	mqttsn_request(client, MQTTSN_CONNECT, 0);
+}
+
+/**
+  * @brief  DNS callback for the gateway.
+  * @param  name: 		host name
+  * @param  ipaddr: 	address, NULL if not found
+  * @param  arg: 		espconn
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	struct espconn *pConn = (struct espconn *)arg;
+	MQTTSN_Client *client = (MQTTSN_Client *)pConn->reverse;
+
+	if(client->state != MQTTSN_RESOLVING)
+		return;
+	if(!ipaddr || !ipaddr->addr){
+		INFO("MQTTSN: Can't resolve %s\r\n", name);
+		mqttsn_lost(client);
+		return;
+	}
+	client->ip.addr = ipaddr->addr;
+	mqttsn_connect(client);
+}
+
+/**
+  * @brief  Look up the gateway, then connect.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_resolve(MQTTSN_Client *client)
+{
+	if(UTILS_StrToIP(client->host, &client->ip.addr)){
+		mqttsn_connect(client);
+		return;
+	}
+	client->state = MQTTSN_RESOLVING;
+	client->ticks = 0;
+	if(espconn_gethostbyname(&client->conn, client->host, &client->ip, mqttsn_dns_found) == ESPCONN_OK)
+		mqttsn_connect(client);	// Answer was cached
+}
+
+/**
+  * @brief  Register or subscribe the next topic which needs it, or
+  *         become active when there are none left.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  from: 		first topic to look at
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_next(MQTTSN_Client *client, uint8_t from)
+{
+	MQTTSN_TOPIC *t;
+	uint8_t i;
+
+	client->pendingType = 0;
+	for(i = from; i < MQTTSN_MAX_TOPICS; i++){
+		t = &client->topics[i];
+		if(!t->name || (t->flags & MQTTSN_TOPIC_READY))
+			continue;
+		mqttsn_request(client, (t->flags & MQTTSN_TOPIC_SUBSCRIBE) ? MQTTSN_SUBSCRIBE : MQTTSN_REGISTER, i);
+		return;
+	}
+	client->state = MQTTSN_ACTIVE;
+	client->waitDelay = MQTTSN_WAIT_MIN;
+	INFO("MQTTSN: Active\r\n");
+}
+
+/**
+  * @brief  A REGACK or SUBACK for the request waiting for an answer.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  id: 		topic ID given by the gateway
+  * @param  rc: 		return code
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_topic_ack(MQTTSN_Client *client, uint16_t id, uint8_t rc)
+{
+	MQTTSN_TOPIC *t = &client->topics[client->pendingTopic];
+
+	if(rc == MQTTSN_ACCEPTED){
+		t->id = id;
+		t->flags |= MQTTSN_TOPIC_READY;
+		INFO("MQTTSN: Topic %s is ID %d\r\n", t->name, id);
+	}
+	else
+		INFO("MQTTSN: Topic %s refused, code: %d\r\n", t->name, rc);
+	mqttsn_next(client, client->pendingTopic + 1);
+}
+
+/**
+  * @brief  Deliver an inbound publish, and acknowledge it if asked.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  p: 		body of the packet
+  * @param  len: 		body length
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_deliver(MQTTSN_Client *client, uint8_t *p, uint16_t len)
+{
+	MQTTSN_TOPIC *t = NULL;
+	uint8_t flags = p[0];
+	uint16_t id = (p[1] << 8) | p[2];
+	uint16_t msgId = (p[3] << 8) | p[4];
+	uint8_t rc = MQTTSN_INVALID_TOPIC;
+	uint8_t i, *q;
+
+	for(i = 0; i < MQTTSN_MAX_TOPICS; i++){
+		if(client->topics[i].name && (client->topics[i].flags & MQTTSN_TOPIC_READY) && client->topics[i].id == id){
+			t = &client->topics[i];
+			break;
+		}
+	}
+	if(t){
+		rc = MQTTSN_ACCEPTED;
+		if(client->dataCb)
+			client->dataCb((uint32_t *)client, t->name, os_strlen(t->name), (const char *)p + 5, len - 5);
+	}
+	if((flags & MQTTSN_FLAG_QOS_MASK) == MQTTSN_FLAG_QOS1 || rc != MQTTSN_ACCEPTED){
+		q = client->buf + mqttsn_start(client, MQTTSN_PUBACK, 5);
+		mqttsn_put16(q, id);
+		mqttsn_put16(q + 2, msgId);
+		q[4] = rc;
+		mqttsn_send(client, q + 5 - client->buf);
+	}
+}
+
+/**
+  * @brief  Gateway REGISTER, naming a topic ID it will publish to us with.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  p: 		body of the packet
+  * @param  len: 		body length
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_gateway_register(MQTTSN_Client *client, uint8_t *p, uint16_t len)
+{
+	uint16_t id = (p[0] << 8) | p[1];
+	uint16_t msgId = (p[2] << 8) | p[3];
+	uint8_t rc = MQTTSN_INVALID_TOPIC;
+	MQTTSN_TOPIC *t;
+	uint8_t i, *q;
+
+	for(i = 0; i < MQTTSN_MAX_TOPICS; i++){
+		t = &client->topics[i];
+		if(t->name && (os_strlen(t->name) == len - 4) && !os_memcmp(t->name, p + 4, len - 4)){
+			t->id = id;
+			t->flags |= MQTTSN_TOPIC_READY;
+			rc = MQTTSN_ACCEPTED;
+			break;
+		}
+	}
+	q = client->buf + mqttsn_start(client, MQTTSN_REGACK, 5);
+	mqttsn_put16(q, id);
+	mqttsn_put16(q + 2, msgId);
+	q[4] = rc;
+	mqttsn_send(client, q + 5 - client->buf);
+}
+
+/**
+  * @brief  UDP receive callback. Each datagram holds one packet.
+  * @param  arg: 		espconn
+  * @param  pdata: 	datagram
+  * @param  len: 		datagram length
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_recv(void *arg, char *pdata, unsigned short len)
+{
+	struct espconn *pConn = (struct espconn *)arg;
+	MQTTSN_Client *client = (MQTTSN_Client *)pConn->reverse;
+	uint8_t *p = (uint8_t *)pdata;
+	uint16_t n, hdr;
+	uint8_t type;
+
+	if(len < 2)
+		return;
+	if(p[0] == 0x01){
+		if(len < 4)
+			return;
+		n = (p[1] << 8) | p[2];
+		hdr = 4;
+	}
+	else {
+		n = p[0];
+		hdr = 2;
+	}
+	if(n < hdr || n > len){
+		INFO("MQTTSN: Malformed packet\r\n");
+		return;
+	}
+	type = p[hdr - 1];
+	p += hdr;
+	n -= hdr;
+
+	switch(type){
+	case MQTTSN_CONNACK:
+		if(client->pendingType != MQTTSN_CONNECT || n < 1)
+			break;
+		if(p[0] != MQTTSN_ACCEPTED){
+			INFO("MQTTSN: Connection refused, code: %d\r\n", p[0]);
+			mqttsn_lost(client);
+			break;
+		}
+		INFO("MQTTSN: Connected to %s:%d\r\n", client->host, client->port);
+		client->state = MQTTSN_REGISTERING;
+		mqttsn_next(client, 0);
+		break;
+
+	case MQTTSN_REGACK:
+		if(client->pendingType == MQTTSN_REGISTER && n >= 5 && ((p[2] << 8) | p[3]) == client->pendingId)
+			mqttsn_topic_ack(client, (p[0] << 8) | p[1], p[4]);
+		break;
+
+	case MQTTSN_SUBACK:
+		if(client->pendingType == MQTTSN_SUBSCRIBE && n >= 6 && ((p[3] << 8) | p[4]) == client->pendingId)
+			mqttsn_topic_ack(client, (p[1] << 8) | p[2], p[5]);
+		break;
+
+	case MQTTSN_REGISTER:
+		if(n > 4)
+			mqttsn_gateway_register(client, p, n);
+		break;
+
+	case MQTTSN_PUBLISH:
+		if(n >= 5 && client->state == MQTTSN_ACTIVE)
+			mqttsn_deliver(client, p, n);
+		break;
+
+	case MQTTSN_PINGRESP:
+		if(client->pendingType == MQTTSN_PINGREQ)
+			client->pendingType = 0;
+		break;
+
+	case MQTTSN_DISCONNECT:
+		if(client->state != MQTTSN_IDLE && client->state != MQTTSN_WAITING)
+			mqttsn_lost(client);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+  * @brief  Once a second: send unanswered requests again, keep the
+  *         connection alive, and reconnect after a wait.
+  * @param  arg: 		MQTTSN_Client reference
+  * @retval None
+  */
+LOCAL void ICACHE_FLASH_ATTR
+mqttsn_timer(void *arg)
+{
+	MQTTSN_Client *client = (MQTTSN_Client *)arg;
+
+	switch(client->state){
+	case MQTTSN_RESOLVING:
+		if(++client->ticks > MQTTSN_RETRY * MQTTSN_RETRIES)
+			mqttsn_lost(client);
+		break;
+
+	case MQTTSN_WAITING:
+		if(++client->ticks >= client->waitDelay){
+			client->waitDelay = (client->waitDelay * 2 > MQTTSN_WAIT_MAX) ? MQTTSN_WAIT_MAX : client->waitDelay * 2;
+			mqttsn_resolve(client);
+		}
+		break;
+
+	case MQTTSN_CONNECTING:
+	case MQTTSN_REGISTERING:
+	case MQTTSN_ACTIVE:
+		if(client->pendingType){
+			if(++client->ticks < MQTTSN_RETRY)
+				break;
+			if(client->retries++ >= MQTTSN_RETRIES){
+				mqttsn_lost(client);
+				break;
+			}
+			client->ticks = 0;
+			mqttsn_send_pending(client);
+		}
+		else if(client->state == MQTTSN_ACTIVE && client->keepAlive && ++client->keepAliveTick >= client->keepAlive)
+			mqttsn_request(client, MQTTSN_PINGREQ, 0);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+  * @brief  Add an entry to the topic table.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  topic: 	topic name
+  * @retval The entry, NULL if the table is full
+  */
+LOCAL MQTTSN_TOPIC * ICACHE_FLASH_ATTR
+mqttsn_topic_add(MQTTSN_Client *client, const char *topic)
+{
+	MQTTSN_TOPIC *t;
+	uint8_t i;
+
+	for(i = 0; i < MQTTSN_MAX_TOPICS; i++){
+		if(!client->topics[i].name)
+			break;
+	}
+	if(i == MQTTSN_MAX_TOPICS){
+		INFO("MQTTSN: Topic table full\r\n");
+		return NULL;
+	}
+	t = &client->topics[i];
+	t->name = (char *)os_zalloc(os_strlen(topic) + 1);
+	os_strcpy(t->name, topic);
+	t->id = 0;
+	t->flags = 0;
+	return t;
+}
+
+/**
+  * @brief  Set up the client. Nothing is sent until MQTTSN_Connect.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  host: 		gateway name or IP address
+  * @param  port: 		gateway UDP port
+  * @param  clientId: 	client ID, at most 23 characters
+  * @param  keepAlive: 	seconds between PINGREQs on an idle connection
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTTSN_Init(MQTTSN_Client *client, const char *host, uint16_t port, const char *clientId, uint16_t keepAlive)
+{
+	os_memset(client, 0, sizeof(MQTTSN_Client));
+	client->host = (char *)os_zalloc(os_strlen(host) + 1);
+	os_strcpy(client->host, host);
+	client->port = port;
+	client->clientId = (char *)os_zalloc(os_strlen(clientId) + 1);
+	os_strcpy(client->clientId, clientId);
+	client->keepAlive = keepAlive;
+	client->waitDelay = MQTTSN_WAIT_MIN;
+	client->buf = (uint8_t *)os_zalloc(MQTTSN_BUF_SIZE);
+
+}
+
+/**
+  * @brief  Add a topic to publish to. A topic without a predefined ID is
+  *         registered with the gateway on each connection.
+  * @param  client: 		MQTTSN_Client reference
+  * @param  topic: 			topic name
+  * @param  predefinedId: 	ID set up for the topic on the gateway, 0 for none.
+  *                      	Needed for QoS -1.
+  * @retval TRUE if added
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTTSN_AddTopic(MQTTSN_Client *client, const char *topic, uint16_t predefinedId)
+{
+	MQTTSN_TOPIC *t = mqttsn_topic_add(client, topic);
+
+	if(!t)
+		return FALSE;
+	t->id = predefinedId;
+	if(predefinedId)
+		t->flags |= MQTTSN_TOPIC_PREDEFINED | MQTTSN_TOPIC_READY;
+	return TRUE;
+}
+
+/**
+  * @brief  Subscribe to a topic on each connection. Publishes to it are
+  *         passed to the data callback.
+  * @param  client: 	MQTTSN_Client reference
+  * @param  topic: 	topic name, no wildcards
+  * @retval TRUE if added
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTTSN_Subscribe(MQTTSN_Client *client, const char *topic)
+{
+	MQTTSN_TOPIC *t = mqttsn_topic_add(client, topic);
+
+	if(!t)
+		return FALSE;
+	t->flags |= MQTTSN_TOPIC_SUBSCRIBE;
+	return TRUE;
+}
+
+void ICACHE_FLASH_ATTR
+MQTTSN_OnData(MQTTSN_Client *client, MqttSnDataCallback dataCb)
+{
+	client->dataCb = dataCb;
+}
+
+/**
+  * @brief  Connect to the gateway, or start again if already connected.
+  *         Call when the station has an IP address.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTTSN_Connect(MQTTSN_Client *client)
+{
+	uint8_t i;
+
+	// The socket is made once the station is up
+	if(!client->created){
+		client->conn.type = ESPCONN_UDP;
+		client->conn.state = ESPCONN_NONE;
+		client->conn.proto.udp = &client->udp;
+		client->conn.reverse = client;
+		client->udp.local_port = espconn_port();
+		espconn_regist_recvcb(&client->conn, mqttsn_recv);
+		espconn_create(&client->conn);
+		client->created = TRUE;
+	}
+	for(i = 0; i < MQTTSN_MAX_TOPICS; i++){
+		if(!(client->topics[i].flags & MQTTSN_TOPIC_PREDEFINED))
+			client->topics[i].flags &= ~MQTTSN_TOPIC_READY;
+	}
+	client->pendingType = 0;
+	client->waitDelay = MQTTSN_WAIT_MIN;
+	os_timer_disarm(&client->timer);
+	os_timer_setfn(&client->timer, (os_timer_func_t *)mqttsn_timer, client);
+	os_timer_arm(&client->timer, 1000, 1);
+	mqttsn_resolve(client);
+}
+
+/**
+  * @brief  Tell the gateway we are going, and stop.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval None
+  */
+void ICACHE_FLASH_ATTR
+MQTTSN_Disconnect(MQTTSN_Client *client)
+{
+	if(client->state == MQTTSN_REGISTERING || client->state == MQTTSN_ACTIVE)
+		mqttsn_send(client, mqttsn_start(client, MQTTSN_DISCONNECT, 0));
+	os_timer_disarm(&client->timer);
+	client->pendingType = 0;
+	client->state = MQTTSN_IDLE;
+}
+
+/**
+  * @brief  Check whether QoS 0 publishes can be sent.
+  * @param  client: 	MQTTSN_Client reference
+  * @retval TRUE if connected with the topics registered
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTTSN_Ready(MQTTSN_Client *client)
+{
+	return client->state == MQTTSN_ACTIVE;
+}
+
+/**
+  * @brief  Publish to a topic added with MQTTSN_AddTopic. QoS -1 needs a
+  *         predefined topic ID, and is sent whether or not the client is
+  *         connected, once the gateway's address is known.
+  * @param  client: 		MQTTSN_Client reference
+  * @param  topic: 			topic name
+  * @param  data: 			payload
+  * @param  data_length: 	payload length
+  * @param  qos: 			-1 or 0
+  * @param  retain: 		retain
+  * @retval TRUE if sent
+  */
+BOOL ICACHE_FLASH_ATTR
+MQTTSN_Publish(MQTTSN_Client *client, const char *topic, const char *data, uint16_t data_length, int qos, int retain)
+{
+	MQTTSN_TOPIC *t = NULL;
+	uint8_t i, *p;
+	uint16_t hdr;
+
+	for(i = 0; i < MQTTSN_MAX_TOPICS; i++){
+		if(client->topics[i].name && !os_strcmp(client->topics[i].name, topic)){
+			t = &client->topics[i];
+			break;
+		}
+	}
+	if(!t || !(t->flags & MQTTSN_TOPIC_READY) || qos > 0)
+		return FALSE;
+	if(qos < 0){
+		if(!(t->flags & MQTTSN_TOPIC_PREDEFINED) || !client->ip.addr)
+			return FALSE;
+	}
+	else if(client->state != MQTTSN_ACTIVE)
+		return FALSE;
+
+	if(!(hdr = mqttsn_start(client, MQTTSN_PUBLISH, 5 + data_length))){
+		INFO("MQTTSN: Publish too big\r\n");
+		return FALSE;
+	}
+	p = client->buf + hdr;
+	p[0] = (qos < 0 ? MQTTSN_FLAG_QOS_M1 : 0) | (retain ? MQTTSN_FLAG_RETAIN : 0) |
+		((t->flags & MQTTSN_TOPIC_PREDEFINED) ? MQTTSN_TOPIC_ID_PREDEF : MQTTSN_TOPIC_NORMAL);
+	mqttsn_put16(p + 1, t->id);
+	mqttsn_put16(p + 3, 0);
+	os_memcpy(p + 5, data, data_length);
+	mqttsn_send(client, hdr + 5 + data_length);
+	return TRUE;
+}
@@ -33,25 +33,208 @@
 #include "osapi.h"
 #include "os_type.h"
 #include "mem.h"
-#include "proto.h"
+
+#define QUEUE_SLOT(q, i) (((q)->first + (i)) % QUEUE_MAX_MSGS)
+#define QUEUE_ENTRY_AT(q, i) (&(q)->entries[QUEUE_SLOT(q, i)])
+#define QUEUE_DISCARDED(q, i) ((q)->discarded & (1UL << QUEUE_SLOT(q, i)))
+
 void ICACHE_FLASH_ATTR QUEUE_Init(QUEUE *queue, int bufferSize)
 {
+	queue->size = bufferSize;
 	queue->buf = (uint8_t*)os_zalloc(bufferSize);
-	RINGBUF_Init(&queue->rb, queue->buf, bufferSize);
+	queue->tail = 0;
+	queue->first = queue->count = 0;
+	queue->discarded = 0;
+}
+
+/*
+ * Return where a new message of up to len bytes would be written, without
+ * adding it, or NULL if there is no room. The space stays free until a
+ * message is committed or the queue is changed.
+ */
+
+uint8_t * ICACHE_FLASH_ATTR QUEUE_Reserve(QUEUE *queue, uint16_t len)
+{
+	uint16_t head;
+
+	if(queue->count >= QUEUE_MAX_MSGS)
+		return NULL;
+
+	if(!queue->count){
+		// Empty, start at the beginning for the most contiguous space
+		queue->first = 0;
+		queue->tail = 0;
+	}
+	head = queue->entries[queue->first].offset;
+
+	if(!queue->count || (queue->tail > head)){
+		// Free space is after tail, then before head
+		if(len > queue->size - queue->tail){
+			if(queue->count && (len > head))
+				return NULL;
+			if(len > queue->size)
+				return NULL;
+			return queue->buf;
+		}
+	}
+	else if(len > head - queue->tail){
+		// Wrapped, free space is between tail and head
+		return NULL;
+	}
+	return queue->buf + queue->tail;
+}
+
+/*
+ * Add a message written in place at a pointer from QUEUE_Reserve
+ */
+
+void ICACHE_FLASH_ATTR QUEUE_Commit(QUEUE *queue, uint8_t *data, uint16_t len)
+{
+	QUEUE_ENTRY *e;
+
+	queue->discarded &= ~(1UL << QUEUE_SLOT(queue, queue->count));
+	e = QUEUE_ENTRY_AT(queue, queue->count);
+	e->offset = data - queue->buf;
+	e->len = len;
+	queue->tail = e->offset + len;
+	queue->count++;
+}
+
+/*
+ * Add a message to the queue. Returns 0 on success, or -1 if there is no room.
+ */
+
+int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, const uint8_t* buffer, uint16_t len)
+{
+	uint8_t *p = QUEUE_Reserve(queue, len);
+
+	if(!p)
+		return -1;
+	os_memcpy(p, buffer, len);
+	QUEUE_Commit(queue, p, len);
+	return 0;
+}
+
+/*
+ * Return a queued message without removing it. Index 0 is the oldest.
+ * The data stays valid until the message is popped. Returns FALSE for
+ * a discarded message.
+ */
+
+BOOL ICACHE_FLASH_ATTR QUEUE_PeekAt(QUEUE *queue, uint8_t index, uint8_t **buffer, uint16_t *len)
+{
+	QUEUE_ENTRY *e;
+
+	if(index >= queue->count || QUEUE_DISCARDED(queue, index))
+		return FALSE;
+	e = QUEUE_ENTRY_AT(queue, index);
+	*buffer = queue->buf + e->offset;
+	*len = e->len;
+	return TRUE;
+}
+
+/*
+ * Return the oldest message without removing it
+ */
+
+BOOL ICACHE_FLASH_ATTR QUEUE_Peek(QUEUE *queue, uint8_t **buffer, uint16_t *len)
+{
+	return QUEUE_PeekAt(queue, 0, buffer, len);
+}
+
+/*
+ * Return the run of oldest messages which are contiguous in the buffer and
+ * total no more than maxLen bytes. The oldest message is always included.
+ * Returns the number of messages in the run.
+ */
+
+uint8_t ICACHE_FLASH_ATTR QUEUE_PeekRun(QUEUE *queue, uint16_t maxLen, uint8_t **buffer, uint16_t *len)
+{
+	QUEUE_ENTRY *e;
+	uint16_t total;
+	uint8_t n;
+
+	if(!queue->count)
+		return 0;
+	e = QUEUE_ENTRY_AT(queue, 0);
+	*buffer = queue->buf + e->offset;
+	total = e->len;
+	for(n = 1; n < queue->count; n++){
+		e = QUEUE_ENTRY_AT(queue, n);
+		if(QUEUE_DISCARDED(queue, n) || (queue->buf + e->offset != *buffer + total) || (total + e->len > maxLen))
+			break;
+		total += e->len;
+	}
+	*len = total;
+	return n;
 }
-int32_t ICACHE_FLASH_ATTR QUEUE_Puts(QUEUE *queue, uint8_t* buffer, uint16_t len)
+
+/*
+ * Remove the oldest message, and any discarded messages behind it
+ */
+
+void ICACHE_FLASH_ATTR QUEUE_Pop(QUEUE *queue)
 {
-	return PROTO_AddRb(&queue->rb, buffer, len);
+	do {
+		if(!queue->count)
+			return;
+		queue->discarded &= ~(1UL << queue->first);
+		queue->first = (queue->first + 1) % QUEUE_MAX_MSGS;
+		queue->count--;
+	} while(queue->count && QUEUE_DISCARDED(queue, 0));
 }
-int32_t ICACHE_FLASH_ATTR QUEUE_Gets(QUEUE *queue, uint8_t* buffer, uint16_t* len, uint16_t maxLen)
+
+/*
+ * Discard a message. The oldest message is popped straight away.
+ */
+
+void ICACHE_FLASH_ATTR QUEUE_Discard(QUEUE *queue, uint8_t index)
+{
+	if(index >= queue->count)
+		return;
+	if(!index)
+		QUEUE_Pop(queue);
+	else
+		queue->discarded |= 1UL << QUEUE_SLOT(queue, index);
+}
+
+/*
+ * Shorten a queued message to its first len bytes. The space after it is
+ * reclaimed when it is popped, or straight away if it is the newest.
+ */
+
+void ICACHE_FLASH_ATTR QUEUE_Trim(QUEUE *queue, uint8_t index, uint16_t len)
+{
+	QUEUE_ENTRY *e;
+
+	if(index >= queue->count)
+		return;
+	e = QUEUE_ENTRY_AT(queue, index);
+	if(len >= e->len)
+		return;
+	e->len = len;
+	if(index == queue->count - 1)
+		queue->tail = e->offset + len;
+}
+
+/*
+ * Return the number of bytes unavailable for new messages
+ */
+
+uint16_t ICACHE_FLASH_ATTR QUEUE_Used(QUEUE *queue)
 {
+	uint16_t head = queue->entries[queue->first].offset;
 
-	return PROTO_ParseRb(&queue->rb, buffer, len, maxLen);
+	if(!queue->count)
+		return 0;
+	if(queue->tail > head)
+		return queue->tail - head;
+	return queue->size - head + queue->tail;
 }
 
 BOOL ICACHE_FLASH_ATTR QUEUE_IsEmpty(QUEUE *queue)
 {
-	if(queue->rb.fill_cnt<=0)
+	if(queue->count == 0)
 		return TRUE;
 	return FALSE;
 }
@@ -0,0 +1,126 @@
+#
+# MQTT-SN gateway stand-in for trying out the node's MQTT-SN client
+# without a real gateway and broker
+#
+# Answers CONNECT, REGISTER, SUBSCRIBE and PINGREQ, and prints each
+# publish with its topic name. Works with Python 2.7 or 3.
+#
+# The command line takes these optional parameters:
+#
+# --port        UDP port to listen on             default 1884
+# --predefined  ID=TOPIC, a predefined topic ID   may be repeated
+# --publish     TOPIC=PAYLOAD, sent to the node once it subscribes to TOPIC
+#
+
+import argparse
+import socket
+import struct
+
+CONNECT = 0x04
+CONNACK = 0x05
+REGISTER = 0x0A
+REGACK = 0x0B
+PUBLISH = 0x0C
+PUBACK = 0x0D
+SUBSCRIBE = 0x12
+SUBACK = 0x13
+PINGREQ = 0x16
+PINGRESP = 0x17
+DISCONNECT = 0x18
+
+NAMES = {CONNECT: 'CONNECT', REGISTER: 'REGISTER', PUBLISH: 'PUBLISH', PUBACK: 'PUBACK',
+         SUBSCRIBE: 'SUBSCRIBE', PINGREQ: 'PINGREQ', DISCONNECT: 'DISCONNECT', REGACK: 'REGACK'}
+
+
+def packet(msg_type, body=b''):
+    if len(body) + 2 <= 255:
+        return struct.pack('!BB', len(body) + 2, msg_type) + body
+    return struct.pack('!BHB', 1, len(body) + 4, msg_type) + body
+
+
+def parse(data):
+    if len(data) < 2:
+        return None, None
+    if bytearray(data)[0] == 1:
+        length, msg_type = struct.unpack('!xHB', data[:4])
+        return msg_type, data[4:length]
+    length, msg_type = struct.unpack('!BB', data[:2])
+    return msg_type, data[2:length]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='MQTT-SN gateway stand-in')
+    parser.add_argument('--port', type=int, default=1884)
+    parser.add_argument('--predefined', action='append', default=[])
+    parser.add_argument('--publish', action='append', default=[])
+    args = parser.parse_args()
+
+    predefined = {}
+    for p in args.predefined:
+        topic_id, topic = p.split('=', 1)
+        predefined[int(topic_id)] = topic
+    pending = dict(p.split('=', 1) for p in args.publish)
+    topics = {}
+    next_id = 1
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(('', args.port))
+    print('Listening on UDP port %d' % args.port)
+
+    while True:
+        data, addr = sock.recvfrom(2048)
+        msg_type, body = parse(data)
+        if msg_type is None:
+            continue
+        print('%s %s, %d bytes' % (addr[0], NAMES.get(msg_type, hex(msg_type)), len(data)))
+
+        if msg_type == CONNECT:
+            flags, protocol, duration = struct.unpack('!BBH', body[:4])
+            print('  client %s, keepalive %d' % (body[4:].decode(), duration))
+            sock.sendto(packet(CONNACK, b'\x00'), addr)
+
+        elif msg_type == REGISTER:
+            msg_id = struct.unpack('!H', body[2:4])[0]
+            topic = body[4:].decode()
+            topic_id = next_id
+            next_id += 1
+            topics[topic_id] = topic
+            print('  %s is ID %d' % (topic, topic_id))
+            sock.sendto(packet(REGACK, struct.pack('!HHB', topic_id, msg_id, 0)), addr)
+
+        elif msg_type == SUBSCRIBE:
+            flags, msg_id = struct.unpack('!BH', body[:3])
+            topic = body[3:].decode()
+            topic_id = next_id
+            next_id += 1
+            topics[topic_id] = topic
+            print('  subscribed to %s, ID %d' % (topic, topic_id))
+            sock.sendto(packet(SUBACK, struct.pack('!BHHB', 0, topic_id, msg_id, 0)), addr)
+            if topic in pending:
+                payload = pending.pop(topic).encode()
+                sock.sendto(packet(PUBLISH, struct.pack('!BHH', 0, topic_id, 0) + payload), addr)
+
+        elif msg_type == PUBLISH:
+            flags, topic_id, msg_id = struct.unpack('!BHH', body[:5])
+            qos = (flags >> 5) & 3
+            if flags & 3 == 1:
+                topic = predefined.get(topic_id)
+            else:
+                topic = topics.get(topic_id)
+            print('  %s (ID %d, QoS %s%s): %s' % (topic, topic_id, '-1' if qos == 3 else qos,
+                                                 ', retained' if flags & 0x10 else '', body[5:].decode()))
+            if qos == 1:
+                sock.sendto(packet(PUBACK, struct.pack('!HHB', topic_id, msg_id, 0 if topic else 2)), addr)
+
+        elif msg_type == PINGREQ:
+            sock.sendto(packet(PINGRESP), addr)
+
+        elif msg_type == DISCONNECT:
+            sock.sendto(packet(DISCONNECT), addr)
+
+        elif msg_type in (REGACK, PUBACK):
+            print('  %s' % repr(body))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for the SDK header, enough to build the platform
+ * independent sources for the tests
+ */
+
+#ifndef _C_TYPES_H_
+#define _C_TYPES_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+typedef int BOOL;
+
+#define TRUE 1
+#define FALSE 0
+#define LOCAL static
+#define ICACHE_FLASH_ATTR
+#endif
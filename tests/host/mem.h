@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for the SDK header
+ */
+
+#ifndef _MEM_H_
+#define _MEM_H_
+#include <stdlib.h>
+
+#define os_zalloc(s) calloc(1, (s))
+#define os_free free
+#endif
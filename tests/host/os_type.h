@@ -0,0 +1,8 @@
+/*
+ * Host stand-in for the SDK header
+ */
+
+#ifndef _OS_TYPES_H_
+#define _OS_TYPES_H_
+#include "c_types.h"
+#endif
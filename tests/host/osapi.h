@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for the SDK header
+ */
+
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+#include <string.h>
+
+#define os_memcpy memcpy
+#define os_memmove memmove
+#define os_memset memset
+#endif
@@ -0,0 +1,8 @@
+/*
+ * Host stand-in for the SDK header
+ */
+
+#ifndef _USER_INTERFACE_H_
+#define _USER_INTERFACE_H_
+#include "os_type.h"
+#endif
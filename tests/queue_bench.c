@@ -0,0 +1,277 @@
+/*
+ * Host benchmark of the cost per publish of the outbound queue
+ *
+ * The old path built each publish in the output buffer, copied it into a
+ * byte ring with 0x7D-0x7F escaped one byte at a time (PROTO_AddRb), and
+ * copied it out again unescaped into a send buffer (PROTO_ParseRb). The
+ * queue builds the publish in place (QUEUE_Reserve, QUEUE_Commit), and
+ * espconn is handed a pointer into it (QUEUE_PeekRun). The old ring code
+ * is kept here, as it was, to measure against.
+ *
+ * Both build the same 3.1.1 publish with a telemetry sized JSON payload,
+ * and every message taken out is checked. Cycles are read from the time
+ * stamp counter on x86, so they are host cycles: compare the two paths,
+ * not the figures with the ESP8266.
+ *
+ * Build and run with: make hosttest
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mqtt_msg.h"
+#include "queue.h"
+#include "user_config.h"
+
+#define PUBLISHES 200000
+#define RUN 4						// Publishes queued before they are taken out
+#define RING_SIZE 1536				// As MQTT_TELEMETRY_QUEUE_SIZE
+#define SEND_BUF_SIZE 2920			// As MQTT_SEND_BUF_SIZE
+#define BUILD_OVERHEAD 24			// As MQTT_BUILD_OVERHEAD
+
+#define TOPIC "/home/lab/acpowermon/status"
+#define PAYLOAD "{\"status\":{\"vrms\":\"239.8\",\"irms\":\"1.214\",\"watts\":\"284.2\",\"va\":\"291.1\",\"pf\":\"0.976\"," \
+	"\"freq\":\"50.01\",\"kwh\":\"1234.567\",\"cycles\":\"3000\",\"time\":\"1718000000\"}}"
+
+/*
+ * The old escaped byte ring, from ringbuf.c and proto.c
+ */
+
+typedef struct {
+	uint8_t *p_o;
+	uint8_t *p_r;
+	uint8_t *p_w;
+	int32_t fill_cnt;
+	int32_t size;
+} RINGBUF;
+
+static void RINGBUF_Init(RINGBUF *r, uint8_t *buf, int32_t size)
+{
+	r->p_o = r->p_r = r->p_w = buf;
+	r->fill_cnt = 0;
+	r->size = size;
+}
+
+static int16_t RINGBUF_Put(RINGBUF *r, uint8_t c)
+{
+	if(r->fill_cnt >= r->size)
+		return -1;
+	r->fill_cnt++;
+	*r->p_w++ = c;
+	if(r->p_w >= r->p_o + r->size)
+		r->p_w = r->p_o;
+	return 0;
+}
+
+static int16_t RINGBUF_Get(RINGBUF *r, uint8_t *c)
+{
+	if(r->fill_cnt <= 0)
+		return -1;
+	r->fill_cnt--;
+	*c = *r->p_r++;
+	if(r->p_r >= r->p_o + r->size)
+		r->p_r = r->p_o;
+	return 0;
+}
+
+static int16_t PROTO_AddRb(RINGBUF *rb, const uint8_t *packet, int16_t len)
+{
+	if(RINGBUF_Put(rb, 0x7E) == -1)
+		return -1;
+	while(len--){
+		switch(*packet){
+		case 0x7D:
+		case 0x7E:
+		case 0x7F:
+			if(RINGBUF_Put(rb, 0x7D) == -1)
+				return -1;
+			if(RINGBUF_Put(rb, *packet++ ^ 0x20) == -1)
+				return -1;
+			break;
+		default:
+			if(RINGBUF_Put(rb, *packet++) == -1)
+				return -1;
+			break;
+		}
+	}
+	if(RINGBUF_Put(rb, 0x7F) == -1)
+		return -1;
+	return 0;
+}
+
+static int16_t PROTO_ParseRb(RINGBUF *rb, uint8_t *bufOut, uint16_t *len, uint16_t maxBufLen)
+{
+	uint16_t n = 0;
+	uint8_t c, esc = 0, begin = 0;
+
+	while(RINGBUF_Get(rb, &c) == 0){
+		switch(c){
+		case 0x7D:
+			esc = 1;
+			break;
+		case 0x7E:
+			n = 0;
+			esc = 0;
+			begin = 1;
+			break;
+		case 0x7F:
+			*len = n;
+			return 0;
+		default:
+			if(!begin)
+				break;
+			if(esc){
+				c ^= 0x20;
+				esc = 0;
+			}
+			if(n < maxBufLen)
+				bufOut[n++] = c;
+			break;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Time stamp
+ */
+
+static uint64_t stamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint8_t outBuf[MQTT_BUF_SIZE];
+static uint8_t sendBuf[MQTT_BUF_SIZE];
+static uint8_t expect[MQTT_BUF_SIZE];
+static uint16_t expectLen;
+static uint32_t errors;
+
+static void check(const uint8_t *data, uint16_t len)
+{
+	if(len != expectLen || memcmp(data, expect, len))
+		errors++;
+}
+
+static void expected(void)
+{
+	mqtt_connection_t conn;
+	mqtt_message_t *m;
+	uint16_t id;
+
+	mqtt_msg_init(&conn, outBuf, sizeof(outBuf));
+	conn.protocol_version = MQTT_PROTOCOL_V311;
+	m = mqtt_msg_publish(&conn, TOPIC, PAYLOAD, strlen(PAYLOAD), 0, 0, &id, NULL);
+	memcpy(expect, m->data, m->length);
+	expectLen = m->length;
+}
+
+/*
+ * Old path: build, escape into the ring, unescape into the send buffer
+ */
+
+static uint64_t benchRing(void)
+{
+	static uint8_t ringBuf[RING_SIZE];
+	mqtt_connection_t conn;
+	mqtt_message_t *m;
+	RINGBUF rb;
+	uint16_t id, len;
+	uint64_t start;
+	uint32_t i, j;
+
+	mqtt_msg_init(&conn, outBuf, sizeof(outBuf));
+	conn.protocol_version = MQTT_PROTOCOL_V311;
+	RINGBUF_Init(&rb, ringBuf, sizeof(ringBuf));
+	start = stamp();
+	for(i = 0; i < PUBLISHES; i += RUN){
+		for(j = 0; j < RUN; j++){
+			m = mqtt_msg_publish(&conn, TOPIC, PAYLOAD, strlen(PAYLOAD), 0, 0, &id, NULL);
+			if(PROTO_AddRb(&rb, m->data, m->length) == -1)
+				errors++;
+		}
+		for(j = 0; j < RUN; j++){
+			if(PROTO_ParseRb(&rb, sendBuf, &len, sizeof(sendBuf)) == -1)
+				errors++;
+			else
+				check(sendBuf, len);
+		}
+	}
+	return stamp() - start;
+}
+
+/*
+ * New path: build in place, hand out the run of messages, pop them
+ */
+
+static uint64_t benchQueue(void)
+{
+	mqtt_connection_t conn;
+	mqtt_message_t *m;
+	QUEUE q;
+	uint8_t *p, *data;
+	uint16_t id, len, n;
+	uint64_t start;
+	uint32_t i, j;
+
+	mqtt_msg_init(&conn, outBuf, sizeof(outBuf));
+	conn.protocol_version = MQTT_PROTOCOL_V311;
+	QUEUE_Init(&q, RING_SIZE);
+	start = stamp();
+	for(i = 0; i < PUBLISHES; i += RUN){
+		for(j = 0; j < RUN; j++){
+			len = BUILD_OVERHEAD + strlen(TOPIC) + strlen(PAYLOAD);
+			p = QUEUE_Reserve(&q, len);
+			if(!p){
+				errors++;
+				continue;
+			}
+			mqtt_msg_set_buffer(&conn, p, len);
+			m = mqtt_msg_publish(&conn, TOPIC, PAYLOAD, strlen(PAYLOAD), 0, 0, &id, NULL);
+			// As mqtt_commit, the fixed header may start after the reserved space
+			if(m->data != p)
+				memmove(p, m->data, m->length);
+			QUEUE_Commit(&q, p, m->length);
+		}
+		while(!QUEUE_IsEmpty(&q)){
+			n = QUEUE_PeekRun(&q, SEND_BUF_SIZE, &data, &len);
+			for(j = 0; j < n; j++){
+				QUEUE_PeekAt(&q, 0, &p, &len);
+				check(p, len);
+				QUEUE_Pop(&q);
+			}
+		}
+	}
+	return stamp() - start;
+}
+
+int main(void)
+{
+	uint64_t ring, queue;
+
+	expected();
+	// Once each to warm the caches
+	benchRing();
+	benchQueue();
+	errors = 0;
+	ring = benchRing();
+	queue = benchQueue();
+#if defined(__x86_64__) || defined(__i386__)
+	printf("queue: %u byte publish, escaped ring %llu cycles, queue %llu cycles, %u errors\n",
+#else
+	printf("queue: %u byte publish, escaped ring %llu ns, queue %llu ns, %u errors\n",
+#endif
+		expectLen, (unsigned long long) (ring / PUBLISHES), (unsigned long long) (queue / PUBLISHES), errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Host microbenchmark of the copy into the outbound queue
+ *
+ * QUEUE_Puts copies a message in with one memcpy. Messages built in place
+ * (QUEUE_Reserve, then QUEUE_Commit) are not copied at all, so their cost
+ * is the bookkeeping alone. Each is timed putting messages of several
+ * sizes in and popping them out, and the bytes moved per cycle printed.
+ * Every message taken out is checked.
+ *
+ * Cycles are read from the time stamp counter on x86, so they are host
+ * cycles. Build and run with: make hosttest
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT "cycle"
+#else
+#define UNIT "ns"
+#endif
+
+#include "queue.h"
+
+#define QUEUE_SIZE 1536				// As MQTT_TELEMETRY_QUEUE_SIZE
+#define BYTES 100000000UL			// Moved through the queue for each size
+#define RUN 4						// Messages put in before they are taken out
+
+// RUN of the largest fill the queue
+static const uint16_t sizes[] = {16, 64, 256, 384};
+static uint8_t src[384];
+static uint32_t errors;
+
+static uint64_t stamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Put, check and pop messages of len bytes, copied in or built in place
+ */
+
+static uint64_t bench(QUEUE *q, uint16_t len, int inPlace)
+{
+	uint8_t *p;
+	uint16_t n;
+	uint32_t i, j;
+	uint64_t start = stamp();
+
+	for(i = 0; i < BYTES / len / RUN; i++){
+		for(j = 0; j < RUN; j++){
+			if(inPlace){
+				p = QUEUE_Reserve(q, len);
+				if(!p){
+					errors++;
+					continue;
+				}
+				// Stands in for the builder, which writes the message here
+				p[0] = (uint8_t) j;
+				QUEUE_Commit(q, p, len);
+			}
+			else if(QUEUE_Puts(q, src, len) == -1)
+				errors++;
+		}
+		for(j = 0; j < RUN; j++){
+			if(!QUEUE_Peek(q, &p, &n) || n != len || (inPlace ? p[0] != j : p[len - 1] != src[len - 1]))
+				errors++;
+			QUEUE_Pop(q);
+		}
+	}
+	return stamp() - start;
+}
+
+int main(void)
+{
+	QUEUE q;
+	uint64_t puts, built, moved;
+	uint8_t i;
+	uint32_t k;
+
+	for(k = 0; k < sizeof(src); k++)
+		src[k] = (uint8_t) (k * 7);
+	QUEUE_Init(&q, QUEUE_SIZE);
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+		puts = bench(&q, sizes[i], 0);
+		built = bench(&q, sizes[i], 1);
+		moved = BYTES / sizes[i] / RUN * RUN * sizes[i];
+		printf("queue copy: %4u bytes, QUEUE_Puts %.2f bytes/" UNIT ", reserve and commit %.2f bytes/" UNIT "\n",
+			sizes[i], (double) moved / puts, (double) moved / built);
+	}
+	printf("queue copy: %u errors\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Host stress test for util/spsc.h
+ *
+ * A producer thread puts a known byte sequence into a small ring while
+ * the consumer takes it out, alternating spsc_get with spsc_read of
+ * varying lengths, so the indices wrap many times over. Any byte out of
+ * sequence is an error.
+ *
+ * Build and run with: make hosttest
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define TRUE true
+#define FALSE false
+#define os_memcpy memcpy
+
+#include "spsc.h"
+
+#define RING_SIZE 64
+#define BYTES 30000000UL
+
+static uint8_t ringBuf[RING_SIZE];
+static SPSC ring;
+
+/*
+ * Byte expected at a position in the sequence
+ */
+
+static uint8_t expected(uint32_t i)
+{
+	return (uint8_t) (i * 7 + (i >> 8));
+}
+
+static void *producer(void *arg)
+{
+	uint32_t i = 0;
+
+	while(i < BYTES){
+		if(spsc_put(&ring, expected(i)))
+			i++;
+		else
+			sched_yield();
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	uint8_t buf[16];
+	uint32_t i = 0;
+	uint32_t errors = 0;
+	uint16_t n, k;
+	uint8_t c;
+
+	spsc_init(&ring, ringBuf, RING_SIZE);
+	pthread_create(&thread, NULL, producer, NULL);
+
+	while(i < BYTES){
+		if(i & 1){
+			if(!spsc_get(&ring, &c)){
+				sched_yield();
+				continue;
+			}
+			if(c != expected(i))
+				errors++;
+			i++;
+		}
+		else {
+			n = spsc_read(&ring, buf, (i % 13) + 1);
+			if(!n)
+				sched_yield();
+			for(k = 0; k < n; k++, i++){
+				if(buf[k] != expected(i))
+					errors++;
+			}
+		}
+	}
+	pthread_join(thread, NULL);
+	printf("spsc: %lu bytes, %u errors\n", BYTES, errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "sampler.h"
+#include "burst.h"
+
+enum {BURST_IDLE = 0, BURST_CAPTURE, BURST_HOLDOFF};
+
+LOCAL burst_config_t burstConfig;
+LOCAL burst_callback burstCb;
+LOCAL uint8_t state;
+LOCAL bool havePrev;
+LOCAL burst_point_t prev;
+LOCAL burst_point_t history[BURST_MAX_PRE];	// Ring of samples before the trigger
+LOCAL uint8_t historyHead;
+LOCAL uint8_t historyCount;
+LOCAL burst_point_t capture[BURST_MAX_SAMPLES];
+LOCAL burst_t burst;
+LOCAL uint32_t holdoffStart;
+
+LOCAL void burst_sample(const em_sample_t *s, void *arg);
+
+
+/*
+ * Rate of change per second between two readings. The change is taken
+ * over at least the base interval, so a step of noise between two close
+ * samples isn't scaled up into a steep rate.
+ */
+
+LOCAL uint32_t ICACHE_FLASH_ATTR rate_per_sec(int32_t from, int32_t to, uint32_t dt)
+{
+	int32_t d = to - from;
+
+	if(d < 0)
+		d = -d;
+	if(dt < SAMPLER_BASE_INTERVAL)
+		dt = SAMPLER_BASE_INTERVAL;
+	return ((uint32_t) d * 1000) / dt;
+}
+
+
+/*
+ * Add a point to the history ring
+ */
+
+LOCAL void ICACHE_FLASH_ATTR history_push(const burst_point_t *p)
+{
+	history[historyHead] = *p;
+	historyHead = (historyHead + 1) % BURST_MAX_PRE;
+	if(historyCount < BURST_MAX_PRE)
+		historyCount++;
+}
+
+
+/*
+ * Start a capture. Copy the newest pre points from the history,
+ * oldest first, followed by the trigger point.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR burst_start(const burst_point_t *p, uint8_t trigger)
+{
+	uint8_t n = burstConfig.pre;
+	uint8_t i, idx;
+
+	if(n > historyCount)
+		n = historyCount;
+	idx = (historyHead + BURST_MAX_PRE - n) % BURST_MAX_PRE;
+	for(i = 0; i < n; i++){
+		capture[i] = history[idx];
+		idx = (idx + 1) % BURST_MAX_PRE;
+	}
+	capture[n] = *p;
+
+	burst.trigger_ms = p->ms;
+	burst.trigger = trigger;
+	burst.pre = n;
+	burst.count = n + 1;
+	burst.points = capture;
+
+	state = BURST_CAPTURE;
+	sampler_set_interval(burst_sample, SAMPLER_FAST_INTERVAL);
+}
+
+
+/*
+ * Sampler callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR burst_sample(const em_sample_t *s, void *arg)
+{
+	burst_point_t p;
+	bool trig_p, trig_i;
+
+	p.ms = s->ms;
+	p.pmean = s->pmean;
+	p.irms = s->irms;
+
+	switch(state){
+		case BURST_IDLE:
+			if(havePrev){
+				trig_p = burstConfig.dp && (rate_per_sec(prev.pmean, p.pmean, p.ms - prev.ms) > burstConfig.dp);
+				trig_i = burstConfig.di && (rate_per_sec(prev.irms, p.irms, p.ms - prev.ms) > burstConfig.di);
+				if(trig_p || trig_i){
+					burst_start(&p, trig_p ? BURST_TRIG_POWER : BURST_TRIG_CURRENT);
+					break;
+				}
+			}
+			history_push(&p);
+			break;
+
+		case BURST_CAPTURE:
+			capture[burst.count++] = p;
+			if(burst.count >= burst.pre + burstConfig.post){
+				sampler_set_interval(burst_sample, 0);
+				if(burstCb)
+					burstCb(&burst);
+				// Start the next history afresh
+				historyCount = 0;
+				holdoffStart = p.ms;
+				state = BURST_HOLDOFF;
+			}
+			break;
+
+		case BURST_HOLDOFF:
+			history_push(&p);
+			if(p.ms - holdoffStart >= burstConfig.holdoff)
+				state = BURST_IDLE;
+			break;
+
+		default:
+			state = BURST_IDLE;
+			break;
+	}
+	prev = p;
+	havePrev = TRUE;
+}
+
+
+/*
+ * Default configuration
+ */
+
+void ICACHE_FLASH_ATTR burst_default_config(burst_config_t *config)
+{
+	os_memset(config, 0, sizeof(burst_config_t));
+	config->enable = 1;
+	config->pre = BURST_MAX_PRE;
+	config->post = BURST_MAX_SAMPLES - BURST_MAX_PRE;
+	config->holdoff = 5000;
+	config->dp = 2000;
+	config->di = 10000;
+}
+
+
+/*
+ * Change the configuration. Any capture in progress is abandoned.
+ */
+
+void ICACHE_FLASH_ATTR burst_set_config(const burst_config_t *config)
+{
+	os_memcpy(&burstConfig, config, sizeof(burst_config_t));
+	if(burstConfig.pre > BURST_MAX_PRE)
+		burstConfig.pre = BURST_MAX_PRE;
+	if(burstConfig.post < 1)
+		burstConfig.post = 1;
+	if(burstConfig.pre + burstConfig.post > BURST_MAX_SAMPLES)
+		burstConfig.post = BURST_MAX_SAMPLES - burstConfig.pre;
+
+	state = BURST_IDLE;
+	havePrev = FALSE;
+	historyCount = 0;
+	sampler_set_interval(burst_sample, 0);
+	sampler_set_fields(burst_sample, burstConfig.enable ? (SAMPLE_PMEAN | SAMPLE_IRMS) : 0);
+}
+
+
+/*
+ * Return the interval the trigger is sampling at
+ */
+
+uint32_t ICACHE_FLASH_ATTR burst_get_interval(void)
+{
+	return sampler_get_consumer_interval(burst_sample);
+}
+
+
+/*
+ * Return the configuration in use
+ */
+
+const burst_config_t * ICACHE_FLASH_ATTR burst_get_config(void)
+{
+	return &burstConfig;
+}
+
+
+/*
+ * Initialize and register with the sampler
+ */
+
+void ICACHE_FLASH_ATTR burst_init(const burst_config_t *config, burst_callback cb)
+{
+	burstCb = cb;
+	sampler_register(0, burst_sample, NULL);
+	burst_set_config(config);
+}
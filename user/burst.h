@@ -0,0 +1,52 @@
+#ifndef _BURST_H_
+#define _BURST_H_
+
+/*
+ * Transient triggered burst capture.
+ *
+ * Active power and current are watched at the sampler base rate. When
+ * either changes faster than its threshold, the sampler is switched to the
+ * fast rate and post samples are captured. These, plus up to pre samples
+ * from the history kept before the trigger, are delivered as one batch.
+ * The sampler then returns to the base rate, and no new capture starts
+ * until the holdoff time has passed.
+ */
+
+#define BURST_MAX_PRE 8
+#define BURST_MAX_SAMPLES 32		// Sized so one batch fits in an MQTT message
+
+enum {BURST_TRIG_POWER = 0, BURST_TRIG_CURRENT};
+
+typedef struct {
+	uint8_t enable;				// Non-zero to run the trigger
+	uint8_t pre;				// Samples kept from before the trigger
+	uint8_t post;				// Fast rate samples captured from the trigger on
+	uint8_t pad;
+	uint16_t holdoff;			// ms after a capture before the next trigger
+	uint16_t dp;				// Active power trigger, W/s
+	uint16_t di;				// Current trigger, mA/s
+} __attribute__((__packed__)) burst_config_t;
+
+typedef struct {
+	uint32_t ms;				// Uptime when the sample was taken
+	int16_t pmean;				// Active power, W
+	uint16_t irms;				// Line current, mA
+} burst_point_t;
+
+typedef struct {
+	uint32_t trigger_ms;		// Uptime of the trigger sample
+	uint8_t trigger;			// BURST_TRIG_POWER or BURST_TRIG_CURRENT
+	uint8_t pre;				// Points before the trigger sample
+	uint8_t count;				// Total points
+	const burst_point_t *points;
+} burst_t;
+
+typedef void (*burst_callback)(const burst_t *burst);
+
+void burst_init(const burst_config_t *config, burst_callback cb);
+void burst_set_config(const burst_config_t *config);
+void burst_default_config(burst_config_t *config);
+const burst_config_t *burst_get_config(void);
+uint32_t burst_get_interval(void);
+
+#endif
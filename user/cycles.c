@@ -0,0 +1,186 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "sampler.h"
+#include "cycles.h"
+
+#define CYCLES_RUN_SHIFT 3				// Long term average time constant, 8 intervals
+#define MWS_PER_CENTI_WH 36000			// mW*s in 0.01Wh
+
+LOCAL cycles_config_t cyclesConfig;
+LOCAL cycles_report_callback cyclesReportCb;
+
+LOCAL bool loadOn;
+LOCAL bool haveOnEdge;					// An on edge has been seen, so the next one completes a cycle
+LOCAL uint32_t lastSample;				// Time of the previous sample
+LOCAL uint32_t onEdge;					// Time the current cycle started
+LOCAL uint32_t offEdge;					// Time the load last turned off
+LOCAL uint64_t cycleEnergy;				// Energy used this cycle, W*ms
+LOCAL uint32_t lastReport;
+
+// Interval statistics
+LOCAL uint16_t count;
+LOCAL uint32_t sumPeriod, sumOn;
+LOCAL uint32_t minPeriod, maxPeriod;
+LOCAL uint64_t sumEnergy;				// W*ms
+
+// Long term averages
+LOCAL bool runValid;
+LOCAL uint32_t runPeriod;
+LOCAL uint16_t runDuty;
+
+
+LOCAL void ICACHE_FLASH_ATTR cycles_clear_interval(void)
+{
+	count = 0;
+	sumPeriod = sumOn = 0;
+	minPeriod = 0xFFFFFFFF;
+	maxPeriod = 0;
+	sumEnergy = 0;
+}
+
+
+/*
+ * Record a completed cycle
+ */
+
+LOCAL void ICACHE_FLASH_ATTR cycles_record(uint32_t period, uint32_t onTime, uint64_t energy)
+{
+	if(!period || (count == 0xFFFF))
+		return;
+	count++;
+	sumPeriod += period;
+	sumOn += onTime;
+	sumEnergy += energy;
+	if(period < minPeriod)
+		minPeriod = period;
+	if(period > maxPeriod)
+		maxPeriod = period;
+}
+
+
+/*
+ * Build and report the summary for the interval just ended
+ */
+
+LOCAL void ICACHE_FLASH_ATTR cycles_report(uint32_t now)
+{
+	cycles_summary_t s;
+
+	os_memset(&s, 0, sizeof(s));
+	s.ms = now;
+	s.count = count;
+	if(count){
+		s.period_avg = sumPeriod / count;
+		s.period_min = minPeriod;
+		s.period_max = maxPeriod;
+		s.duty_avg = (uint16_t) (((uint64_t) sumOn * 1000) / sumPeriod);
+		s.energy_avg = (uint32_t) ((sumEnergy / count) / MWS_PER_CENTI_WH);
+		if(runValid){
+			runPeriod += ((int32_t) s.period_avg - (int32_t) runPeriod) >> CYCLES_RUN_SHIFT;
+			runDuty += ((int32_t) s.duty_avg - (int32_t) runDuty) >> CYCLES_RUN_SHIFT;
+		}
+		else{
+			runPeriod = s.period_avg;
+			runDuty = s.duty_avg;
+			runValid = TRUE;
+		}
+	}
+	s.period_run = runPeriod;
+	s.duty_run = runDuty;
+
+	cycles_clear_interval();
+	lastReport = now;
+	if(cyclesReportCb)
+		cyclesReportCb(&s);
+}
+
+
+/*
+ * Sampler callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR cycles_sample(const em_sample_t *s, void *arg)
+{
+	uint32_t dt = s->ms - lastSample;
+
+	lastSample = s->ms;
+
+	if(loadOn){
+		if(s->pmean > 0)
+			cycleEnergy += (uint64_t) s->pmean * dt;
+		if(s->pmean < cyclesConfig.off_threshold){
+			loadOn = FALSE;
+			offEdge = s->ms;
+		}
+	}
+	else if(s->pmean > cyclesConfig.on_threshold){
+		loadOn = TRUE;
+		if(haveOnEdge)
+			cycles_record(s->ms - onEdge, offEdge - onEdge, cycleEnergy);
+		haveOnEdge = TRUE;
+		onEdge = s->ms;
+		cycleEnergy = 0;
+	}
+
+	if(s->ms - lastReport >= 1000UL * cyclesConfig.report)
+		cycles_report(s->ms);
+}
+
+
+/*
+ * Report the current interval immediately and start a new one
+ */
+
+void ICACHE_FLASH_ATTR cycles_report_now(void)
+{
+	cycles_report(sampler_uptime_ms());
+}
+
+
+/*
+ * Fill in a default configuration
+ */
+
+void ICACHE_FLASH_ATTR cycles_default_config(cycles_config_t *config)
+{
+	os_memset(config, 0, sizeof(cycles_config_t));
+	config->enable = TRUE;
+	config->on_threshold = 50;
+	config->off_threshold = 20;
+	config->report = 3600;
+}
+
+
+/*
+ * Change the configuration. Statistics are restarted.
+ */
+
+void ICACHE_FLASH_ATTR cycles_set_config(const cycles_config_t *config)
+{
+	os_memcpy(&cyclesConfig, config, sizeof(cycles_config_t));
+	if(!cyclesConfig.report)
+		cyclesConfig.report = 1;
+	loadOn = FALSE;
+	haveOnEdge = FALSE;
+	runValid = FALSE;
+	runPeriod = 0;
+	runDuty = 0;
+	cycles_clear_interval();
+	lastSample = lastReport = sampler_uptime_ms();
+	sampler_set_fields(cycles_sample, cyclesConfig.enable ? SAMPLE_PMEAN : 0);
+}
+
+
+/*
+ * Initialize the analyzer and register it with the sampler
+ */
+
+void ICACHE_FLASH_ATTR cycles_init(const cycles_config_t *config, cycles_report_callback cb)
+{
+	cyclesReportCb = cb;
+	sampler_register(0, cycles_sample, NULL);
+	cycles_set_config(config);
+}
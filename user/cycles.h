@@ -0,0 +1,40 @@
+#ifndef _CYCLES_H_
+#define _CYCLES_H_
+
+/*
+ * Cyclic load analyzer.
+ *
+ * Detects on/off cycles of periodic loads (refrigerators, pumps,
+ * compressors) from the active power and keeps cycle period, duty cycle
+ * and energy per cycle statistics. A summary is reported once per
+ * report interval.
+ */
+
+typedef struct {
+	uint8_t enable;				// Non-zero to run the analyzer
+	uint8_t pad;
+	uint16_t on_threshold;		// Load is on above this, W
+	uint16_t off_threshold;		// Load is off below this, W
+	uint16_t report;			// Report interval, s
+} __attribute__((__packed__)) cycles_config_t;
+
+typedef struct {
+	uint32_t ms;				// Uptime at the end of the interval
+	uint16_t count;				// Cycles completed in the interval
+	uint32_t period_avg;		// Mean cycle period, ms
+	uint32_t period_min;
+	uint32_t period_max;
+	uint16_t duty_avg;			// Mean duty cycle, 0.1%
+	uint32_t energy_avg;		// Mean energy per cycle, 0.01Wh
+	uint32_t period_run;		// Long term average period, ms
+	uint16_t duty_run;			// Long term average duty cycle, 0.1%
+} cycles_summary_t;
+
+typedef void (*cycles_report_callback)(const cycles_summary_t *summary);
+
+void cycles_init(const cycles_config_t *config, cycles_report_callback cb);
+void cycles_set_config(const cycles_config_t *config);
+void cycles_default_config(cycles_config_t *config);
+void cycles_report_now(void);
+
+#endif
@@ -0,0 +1,241 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "sampler.h"
+#include "loads.h"
+
+#define LOADS_FRAC 4					// Fractional bits of the filtered values
+#define LOADS_BASE_SHIFT 4				// Baseline filter time constant, 16 samples
+#define LOADS_NOISE_SHIFT 5				// Noise filter time constant, 32 samples
+#define LOADS_GIVE_UP 10				// Abandon a step which hasn't settled after this many settle periods
+#define LOADS_MAX_SUM 2048				// Accumulator limit, keeps the sums inside 32 bits
+
+LOCAL loads_config_t loadsConfig;
+LOCAL loads_event_callback loadsEventCb;
+LOCAL loads_signature_t signatures[LOADS_MAX_SIGNATURES];
+
+LOCAL bool primed;						// Baseline initialized
+LOCAL bool inStep;						// Power is moving to a new level
+LOCAL int32_t baseP, baseQ;				// Steady state power, LOADS_FRAC fractional bits
+LOCAL int32_t noise;					// Mean absolute deviation, LOADS_FRAC fractional bits
+LOCAL uint32_t stepStart;				// When the step began
+LOCAL uint32_t settleStart;				// When the current candidate level began
+LOCAL int32_t sumP, sumQ;				// Candidate level accumulators
+LOCAL uint16_t sumCount;
+
+
+LOCAL int32_t ICACHE_FLASH_ATTR iabs(int32_t v)
+{
+	return (v < 0) ? -v : v;
+}
+
+
+/*
+ * Return the current step threshold in W
+ */
+
+uint16_t ICACHE_FLASH_ATTR loads_get_threshold(void)
+{
+	int32_t thr = (loadsConfig.noise_k * noise) >> LOADS_FRAC;
+
+	if(thr < loadsConfig.min_step)
+		thr = loadsConfig.min_step;
+	if(thr > 0xFFFF)
+		thr = 0xFFFF;
+	return (uint16_t) thr;
+}
+
+
+/*
+ * Find the signature matching a step, or allocate a new one.
+ * A step matches if both components are within 10% (or min_step / 2).
+ */
+
+LOCAL int8_t ICACHE_FLASH_ATTR loads_match(int16_t dp, int16_t dq)
+{
+	int32_t mp = iabs(dp);
+	int32_t mq = (dp < 0) ? -dq : dq;		// Signature is stored as the "on" step
+	int32_t tolp, tolq;
+	uint8_t i;
+	int8_t victim = -1;
+	uint32_t victimCount = 0xFFFFFFFF;
+
+	for(i = 0; i < LOADS_MAX_SIGNATURES; i++){
+		loads_signature_t *s = &signatures[i];
+		uint32_t count = s->on_count + s->off_count;
+
+		if(!count){
+			if(victimCount){
+				victim = i;
+				victimCount = 0;
+			}
+			continue;
+		}
+		tolp = iabs(s->dp) / 10;
+		if(tolp < loadsConfig.min_step / 2)
+			tolp = loadsConfig.min_step / 2;
+		tolq = iabs(s->dq) / 10;
+		if(tolq < loadsConfig.min_step / 2)
+			tolq = loadsConfig.min_step / 2;
+		if((iabs(mp - s->dp) <= tolp) && (iabs(mq - s->dq) <= tolq)){
+			// Move the signature towards the new step
+			s->dp += (int16_t) ((mp - s->dp) / 8);
+			s->dq += (int16_t) ((mq - s->dq) / 8);
+			if(dp > 0){
+				if(s->on_count < 0xFFFF)
+					s->on_count++;
+			}
+			else if(s->off_count < 0xFFFF)
+				s->off_count++;
+			return i;
+		}
+		if(count < victimCount){
+			victim = i;
+			victimCount = count;
+		}
+	}
+
+	// No match, replace the least used entry
+	signatures[victim].dp = (int16_t) mp;
+	signatures[victim].dq = (int16_t) mq;
+	signatures[victim].on_count = (dp > 0) ? 1 : 0;
+	signatures[victim].off_count = (dp > 0) ? 0 : 1;
+	return victim;
+}
+
+
+/*
+ * Sampler callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR loads_sample(const em_sample_t *s, void *arg)
+{
+	int32_t p = ((int32_t) s->pmean) << LOADS_FRAC;
+	int32_t q = ((int32_t) s->qmean) << LOADS_FRAC;
+	int32_t thr = ((int32_t) loads_get_threshold()) << LOADS_FRAC;
+	int32_t dev;
+
+	if(!primed){
+		baseP = p;
+		baseQ = q;
+		primed = TRUE;
+		return;
+	}
+
+	if(!inStep){
+		dev = iabs(p - baseP);
+		if((dev > thr) || (iabs(q - baseQ) > thr)){
+			inStep = TRUE;
+			stepStart = settleStart = s->ms;
+			sumP = sumQ = 0;
+			sumCount = 0;
+		}
+		else{
+			baseP += (p - baseP) >> LOADS_BASE_SHIFT;
+			baseQ += (q - baseQ) >> LOADS_BASE_SHIFT;
+			noise += (dev - noise) >> LOADS_NOISE_SHIFT;
+			return;
+		}
+	}
+
+	// Restart the settle period if the power is still moving
+	if(sumCount && ((iabs(p - sumP / sumCount) > thr) || (iabs(q - sumQ / sumCount) > thr))){
+		sumP = sumQ = 0;
+		sumCount = 0;
+		settleStart = s->ms;
+	}
+	if(sumCount < LOADS_MAX_SUM){
+		sumP += p;
+		sumQ += q;
+		sumCount++;
+	}
+
+	if(s->ms - settleStart >= loadsConfig.settle){
+		int32_t levelP = sumP / sumCount;
+		int32_t levelQ = sumQ / sumCount;
+		int32_t dp = levelP - baseP;
+		int32_t dq = levelQ - baseQ;
+
+		if((iabs(dp) > thr) || (iabs(dq) > thr)){
+			loads_event_t e;
+			e.dp = (int16_t) (dp >> LOADS_FRAC);
+			e.dq = (int16_t) (dq >> LOADS_FRAC);
+			e.ms = stepStart;
+			e.signature = loads_match(e.dp, e.dq);
+			if(loadsEventCb)
+				loadsEventCb(&e);
+		}
+		baseP = levelP;
+		baseQ = levelQ;
+		inStep = FALSE;
+	}
+	else if(s->ms - stepStart >= LOADS_GIVE_UP * (uint32_t) loadsConfig.settle){
+		// Never settled, follow the line without reporting
+		baseP = p;
+		baseQ = q;
+		inStep = FALSE;
+	}
+}
+
+
+/*
+ * Fill in a default configuration
+ */
+
+void ICACHE_FLASH_ATTR loads_default_config(loads_config_t *config)
+{
+	os_memset(config, 0, sizeof(loads_config_t));
+	config->enable = TRUE;
+	config->noise_k = 6;
+	config->min_step = 30;
+	config->settle = 500;
+}
+
+
+/*
+ * Return the signature table (LOADS_MAX_SIGNATURES entries)
+ */
+
+const loads_signature_t * ICACHE_FLASH_ATTR loads_get_signatures(void)
+{
+	return signatures;
+}
+
+
+/*
+ * Forget all signatures
+ */
+
+void ICACHE_FLASH_ATTR loads_clear_signatures(void)
+{
+	os_memset(signatures, 0, sizeof(signatures));
+}
+
+
+/*
+ * Change the configuration
+ */
+
+void ICACHE_FLASH_ATTR loads_set_config(const loads_config_t *config)
+{
+	os_memcpy(&loadsConfig, config, sizeof(loads_config_t));
+	if(!loadsConfig.settle)
+		loadsConfig.settle = 1;
+	primed = FALSE;
+	inStep = FALSE;
+	sampler_set_fields(loads_sample, loadsConfig.enable ? (SAMPLE_PMEAN | SAMPLE_QMEAN) : 0);
+}
+
+
+/*
+ * Initialize the detector and register it with the sampler
+ */
+
+void ICACHE_FLASH_ATTR loads_init(const loads_config_t *config, loads_event_callback cb)
+{
+	loadsEventCb = cb;
+	sampler_register(0, loads_sample, NULL);
+	loads_set_config(config);
+}
@@ -0,0 +1,45 @@
+#ifndef _LOADS_H_
+#define _LOADS_H_
+
+/*
+ * Load transition detector.
+ *
+ * Tracks the steady state active and reactive power and reports a
+ * transition when the power steps to a new steady level. The step
+ * threshold adapts to the measured noise on the line. Recurring steps
+ * are grouped into a small table of signatures with on/off counts.
+ */
+
+#define LOADS_MAX_SIGNATURES 16
+
+typedef struct {
+	uint8_t enable;				// Non-zero to run the detector
+	uint8_t noise_k;			// Threshold as a multiple of the noise level
+	uint16_t min_step;			// Smallest step reported, W
+	uint16_t settle;			// Time a new level must hold, ms
+} __attribute__((__packed__)) loads_config_t;
+
+typedef struct {
+	int16_t dp;					// Active power of the load when on, W
+	int16_t dq;					// Reactive power of the load when on, var
+	uint16_t on_count;
+	uint16_t off_count;
+} loads_signature_t;
+
+typedef struct {
+	int16_t dp;					// Change in active power, W
+	int16_t dq;					// Change in reactive power, var
+	uint32_t ms;				// Uptime when the step began
+	int8_t signature;			// Index into the signature table, -1 if none
+} loads_event_t;
+
+typedef void (*loads_event_callback)(const loads_event_t *event);
+
+void loads_init(const loads_config_t *config, loads_event_callback cb);
+void loads_set_config(const loads_config_t *config);
+void loads_default_config(loads_config_t *config);
+const loads_signature_t *loads_get_signatures(void);
+void loads_clear_signatures(void);
+uint16_t loads_get_threshold(void);
+
+#endif
@@ -0,0 +1,149 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "sampler.h"
+#include "pq.h"
+
+typedef struct {
+	uint8_t state;				// PQ_NORMAL, PQ_HIGH or PQ_LOW
+	uint8_t active;				// TRUE once the start event has been sent
+	uint32_t start_ms;
+	uint16_t extreme;
+} pq_channel_t;
+
+LOCAL pq_config_t pqConfig;
+LOCAL pq_channel_t pqChannels[PQ_NUM_CHANNELS];
+LOCAL pq_event_callback pqEventCb;
+
+
+/*
+ * Report an event to the registered callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR pq_report(uint8_t channel, pq_channel_t *c, uint8_t edge, uint32_t now)
+{
+	pq_event_t e;
+
+	e.channel = channel;
+	e.kind = c->state;
+	e.edge = edge;
+	e.start_ms = c->start_ms;
+	e.duration_ms = now - c->start_ms;
+	e.extreme = c->extreme;
+	if(pqEventCb)
+		pqEventCb(&e);
+}
+
+
+/*
+ * Run one channel's state machine against a new value
+ */
+
+LOCAL void ICACHE_FLASH_ATTR pq_process(uint8_t channel, uint16_t val, uint16_t low,
+uint16_t high, uint16_t hyst, uint32_t now)
+{
+	pq_channel_t *c = &pqChannels[channel];
+	bool inside;
+
+	switch(c->state){
+		case PQ_NORMAL:
+			if(val > high)
+				c->state = PQ_HIGH;
+			else if(val < low)
+				c->state = PQ_LOW;
+			else
+				return;
+			c->active = FALSE;
+			c->start_ms = now;
+			c->extreme = val;
+			return;
+
+		case PQ_HIGH:
+			inside = (val + hyst <= high);
+			if(!inside && (val > c->extreme))
+				c->extreme = val;
+			break;
+
+		case PQ_LOW:
+			inside = (val >= low + hyst);
+			if(!inside && (val < c->extreme))
+				c->extreme = val;
+			break;
+
+		default:
+			c->state = PQ_NORMAL;
+			return;
+	}
+
+	if(inside){
+		// Excursion over. Only report the end if the start was reported.
+		if(c->active)
+			pq_report(channel, c, PQ_EDGE_END, now);
+		c->state = PQ_NORMAL;
+		c->active = FALSE;
+	}
+	else if(!c->active && (now - c->start_ms >= pqConfig.min_duration)){
+		c->active = TRUE;
+		pq_report(channel, c, PQ_EDGE_START, now);
+	}
+}
+
+
+/*
+ * Sampler callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR pq_sample(const em_sample_t *s, void *arg)
+{
+	if(s->valid & SAMPLE_URMS)
+		pq_process(PQ_VOLTAGE, s->urms, pqConfig.v_low, pqConfig.v_high, pqConfig.v_hyst, s->ms);
+	if(s->valid & SAMPLE_FREQ)
+		pq_process(PQ_FREQUENCY, s->freq, pqConfig.f_low, pqConfig.f_high, pqConfig.f_hyst, s->ms);
+}
+
+
+/*
+ * Fill in a default configuration:
+ * sag below 90%, swell above 110%, 1% hysteresis, +/-0.5Hz, 20ms minimum.
+ */
+
+void ICACHE_FLASH_ATTR pq_default_config(pq_config_t *config, uint16_t v_nominal, uint16_t f_nominal)
+{
+	os_memset(config, 0, sizeof(pq_config_t));
+	config->enable = TRUE;
+	config->min_duration = 20;
+	config->v_low = (uint16_t) ((v_nominal * 90UL) / 100);
+	config->v_high = (uint16_t) ((v_nominal * 110UL) / 100);
+	config->v_hyst = v_nominal / 100;
+	config->f_low = f_nominal - 50;
+	config->f_high = f_nominal + 50;
+	config->f_hyst = 5;
+}
+
+
+/*
+ * Change the configuration. Any excursion in progress is abandoned.
+ */
+
+void ICACHE_FLASH_ATTR pq_set_config(const pq_config_t *config)
+{
+	os_memcpy(&pqConfig, config, sizeof(pq_config_t));
+	os_memset(pqChannels, 0, sizeof(pqChannels));
+	sampler_set_fields(pq_sample, pqConfig.enable ? (SAMPLE_URMS | SAMPLE_FREQ) : 0);
+}
+
+
+/*
+ * Initialize the detector and register it with the sampler
+ */
+
+void ICACHE_FLASH_ATTR pq_init(const pq_config_t *config, pq_event_callback cb)
+{
+	pqEventCb = cb;
+	sampler_register(0, pq_sample, NULL);
+	// Short excursions are only seen at the fast rate
+	sampler_set_interval(pq_sample, SAMPLER_FAST_INTERVAL);
+	pq_set_config(config);
+}
@@ -0,0 +1,44 @@
+#ifndef _PQ_H_
+#define _PQ_H_
+
+/*
+ * Power quality event detector.
+ *
+ * Watches line voltage and frequency for swells, sags and frequency
+ * excursions. An excursion must last at least min_duration milliseconds
+ * before a start event is reported, and ends once the value has come back
+ * inside the threshold by the hysteresis amount.
+ */
+
+enum {PQ_VOLTAGE = 0, PQ_FREQUENCY, PQ_NUM_CHANNELS};
+enum {PQ_NORMAL = 0, PQ_HIGH, PQ_LOW};
+enum {PQ_EDGE_START = 0, PQ_EDGE_END};
+
+typedef struct {
+	uint8_t enable;				// Non-zero to run the detector
+	uint8_t pad;
+	uint16_t min_duration;		// Minimum excursion length in ms
+	uint16_t v_low;				// Sag threshold, 0.01V
+	uint16_t v_high;			// Swell threshold, 0.01V
+	uint16_t v_hyst;			// Voltage hysteresis, 0.01V
+	uint16_t f_low;				// Low frequency threshold, 0.01Hz
+	uint16_t f_high;			// High frequency threshold, 0.01Hz
+	uint16_t f_hyst;			// Frequency hysteresis, 0.01Hz
+} __attribute__((__packed__)) pq_config_t;
+
+typedef struct {
+	uint8_t channel;			// PQ_VOLTAGE or PQ_FREQUENCY
+	uint8_t kind;				// PQ_HIGH or PQ_LOW
+	uint8_t edge;				// PQ_EDGE_START or PQ_EDGE_END
+	uint32_t start_ms;			// Uptime when the excursion began
+	uint32_t duration_ms;		// Excursion length so far
+	uint16_t extreme;			// Largest deviation seen
+} pq_event_t;
+
+typedef void (*pq_event_callback)(const pq_event_t *event);
+
+void pq_init(const pq_config_t *config, pq_event_callback cb);
+void pq_set_config(const pq_config_t *config);
+void pq_default_config(pq_config_t *config, uint16_t v_nominal, uint16_t f_nominal);
+
+#endif
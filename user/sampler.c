@@ -0,0 +1,229 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "driver/em.h"
+#include "wallclock.h"
+#include "sampler.h"
+
+typedef struct {
+	uint16_t fields;
+	uint32_t interval;			// Requested interval in ms, 0 for the base interval
+	uint32_t elapsed;			// ms since the consumer was last called
+	sampler_callback cb;
+	void *arg;
+} sampler_consumer_t;
+
+LOCAL sampler_consumer_t consumers[SAMPLER_MAX_CONSUMERS];
+LOCAL uint8_t numConsumers;
+LOCAL ETSTimer samplerTimer;
+LOCAL uint32_t baseInterval;
+LOCAL uint32_t currentInterval;
+
+
+/*
+ * Convert a ones complement (sign + magnitude) register value to an int
+ */
+
+LOCAL int16_t ICACHE_FLASH_ATTR sign_mag_to_int16(uint16_t val)
+{
+	int16_t mag = (int16_t) (val & 0x7FFF);
+	return (val & 0x8000) ? -mag : mag;
+}
+
+
+/*
+ * Return the uptime in milliseconds
+ */
+
+uint32_t ICACHE_FLASH_ATTR sampler_uptime_ms(void)
+{
+	return wallclock_uptime_ms();
+}
+
+
+/*
+ * Interval a consumer is called at
+ */
+
+LOCAL uint32_t ICACHE_FLASH_ATTR consumer_interval(const sampler_consumer_t *c)
+{
+	uint32_t interval = c->interval ? c->interval : baseInterval;
+
+	return (interval < SAMPLER_FAST_INTERVAL) ? SAMPLER_FAST_INTERVAL : interval;
+}
+
+
+/*
+ * Timer callback. Read the registers requested by the consumers whose
+ * interval is up, and pass the sample to each of them. The timer runs at
+ * the shortest interval asked for, so a consumer at a longer interval
+ * is only called, and its registers only read, every so many ticks.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR sampler_tick(void *arg)
+{
+	em_sample_t s;
+	uint16_t fields = 0;
+	uint8_t due = 0;
+	uint8_t i;
+
+	for(i = 0; i < numConsumers; i++){
+		if(!consumers[i].fields)
+			continue;
+		consumers[i].elapsed += currentInterval;
+		if(consumers[i].elapsed >= consumer_interval(&consumers[i])){
+			consumers[i].elapsed = 0;
+			fields |= consumers[i].fields;
+			due |= 1 << i;
+		}
+	}
+
+	if(!due)
+		return;
+
+	os_memset(&s, 0, sizeof(s));
+	s.ms = sampler_uptime_ms();
+	s.valid = fields;
+
+	if(fields & SAMPLE_URMS)
+		s.urms = em_read_transaction(EM_URMS);
+	if(fields & SAMPLE_FREQ)
+		s.freq = em_read_transaction(EM_FREQ);
+	if(fields & SAMPLE_IRMS)
+		s.irms = em_read_transaction(EM_IRMS);
+	if(fields & SAMPLE_PMEAN)
+		s.pmean = sign_mag_to_int16(em_read_transaction(EM_PMEAN));
+	if(fields & SAMPLE_QMEAN)
+		s.qmean = (int16_t) em_read_transaction(EM_QMEAN);
+
+	for(i = 0; i < numConsumers; i++){
+		if(due & (1 << i))
+			consumers[i].cb(&s, consumers[i].arg);
+	}
+}
+
+
+/*
+ * Run the timer at the shortest interval requested by an active consumer
+ */
+
+LOCAL void ICACHE_FLASH_ATTR sampler_update_rate(void)
+{
+	uint32_t interval = baseInterval;
+	uint8_t i;
+
+	if(!baseInterval)
+		return; // Not started yet
+
+	for(i = 0; i < numConsumers; i++){
+		if(consumers[i].fields && consumers[i].interval && (consumers[i].interval < interval))
+			interval = consumers[i].interval;
+	}
+	if(interval < SAMPLER_FAST_INTERVAL)
+		interval = SAMPLER_FAST_INTERVAL;
+
+	if(interval != currentInterval){
+		currentInterval = interval;
+		os_timer_disarm(&samplerTimer);
+		os_timer_arm(&samplerTimer, currentInterval, 1);
+	}
+}
+
+
+/*
+ * Register a consumer. Returns FALSE if the consumer table is full.
+ */
+
+bool ICACHE_FLASH_ATTR sampler_register(uint16_t fields, sampler_callback cb, void *arg)
+{
+	if(numConsumers >= SAMPLER_MAX_CONSUMERS){
+		INFO("Sampler: too many consumers\r\n");
+		return FALSE;
+	}
+	consumers[numConsumers].fields = fields;
+	consumers[numConsumers].interval = 0;
+	consumers[numConsumers].elapsed = 0;
+	consumers[numConsumers].cb = cb;
+	consumers[numConsumers].arg = arg;
+	numConsumers++;
+	sampler_update_rate();
+	return TRUE;
+}
+
+
+/*
+ * Change the fields a consumer wants. Zero pauses the consumer.
+ */
+
+void ICACHE_FLASH_ATTR sampler_set_fields(sampler_callback cb, uint16_t fields)
+{
+	uint8_t i;
+
+	for(i = 0; i < numConsumers; i++){
+		if(consumers[i].cb == cb)
+			consumers[i].fields = fields;
+	}
+	sampler_update_rate();
+}
+
+
+/*
+ * Change the interval a consumer wants. Zero accepts the base interval.
+ * The consumer's next sample starts a full interval from its last one.
+ * Safe to call from a sampler callback.
+ */
+
+void ICACHE_FLASH_ATTR sampler_set_interval(sampler_callback cb, uint32_t interval_ms)
+{
+	uint8_t i;
+
+	for(i = 0; i < numConsumers; i++){
+		if(consumers[i].cb == cb){
+			consumers[i].interval = interval_ms;
+			consumers[i].elapsed = 0;
+		}
+	}
+	sampler_update_rate();
+}
+
+
+/*
+ * Return the interval the sampler is running at
+ */
+
+uint32_t ICACHE_FLASH_ATTR sampler_get_interval(void)
+{
+	return currentInterval;
+}
+
+
+/*
+ * Return the interval a consumer is called at, 0 if it isn't registered
+ */
+
+uint32_t ICACHE_FLASH_ATTR sampler_get_consumer_interval(sampler_callback cb)
+{
+	uint8_t i;
+
+	for(i = 0; i < numConsumers; i++){
+		if(consumers[i].cb == cb)
+			return consumer_interval(&consumers[i]);
+	}
+	return 0;
+}
+
+
+/*
+ * Start the sampler at the base interval
+ */
+
+void ICACHE_FLASH_ATTR sampler_init(uint32_t base_interval_ms)
+{
+	os_timer_disarm(&samplerTimer);
+	os_timer_setfn(&samplerTimer, (os_timer_func_t *) sampler_tick, NULL);
+	baseInterval = base_interval_ms;
+	currentInterval = 0;
+	sampler_update_rate();
+}
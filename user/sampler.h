@@ -0,0 +1,52 @@
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+/*
+ * Periodic sampler for the em chip measurement registers.
+ *
+ * Consumers register the set of registers they need and a callback.
+ * On each tick the sampler reads the union of the requested registers once
+ * and hands the same sample to every consumer.
+ *
+ * Consumers may also ask for a sampling interval, and get the base interval
+ * otherwise. The timer runs at the shortest interval asked for by an active
+ * consumer, and each consumer is only called, with only the registers due
+ * that tick read, at its own interval.
+ */
+
+// Sample field flags
+#define SAMPLE_URMS		0x0001
+#define SAMPLE_FREQ		0x0002
+#define SAMPLE_IRMS		0x0004
+#define SAMPLE_PMEAN	0x0008
+#define SAMPLE_QMEAN	0x0010
+
+#define SAMPLER_MAX_CONSUMERS 6
+
+// Each register read is a bit-banged 24 bit SPI transaction with a 500us
+// start delay (~0.75ms). 10ms leaves the WIFI stack enough CPU time with
+// every register enabled.
+#define SAMPLER_FAST_INTERVAL 10		// ms
+#define SAMPLER_BASE_INTERVAL 100		// ms
+
+typedef struct {
+	uint32_t ms;				// Uptime in milliseconds when the sample was taken
+	uint16_t valid;				// SAMPLE_* flags of the fields read this tick
+	uint16_t urms;				// Line voltage, 0.01V
+	uint16_t freq;				// Line frequency, 0.01Hz
+	uint16_t irms;				// Line current, mA
+	int16_t pmean;				// Active power, W
+	int16_t qmean;				// Reactive power, var
+} em_sample_t;
+
+typedef void (*sampler_callback)(const em_sample_t *sample, void *arg);
+
+void sampler_init(uint32_t base_interval_ms);
+bool sampler_register(uint16_t fields, sampler_callback cb, void *arg);
+void sampler_set_fields(sampler_callback cb, uint16_t fields);
+void sampler_set_interval(sampler_callback cb, uint32_t interval_ms);
+uint32_t sampler_get_interval(void);
+uint32_t sampler_get_consumer_interval(sampler_callback cb);
+uint32_t sampler_uptime_ms(void);
+
+#endif
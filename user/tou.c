@@ -0,0 +1,138 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "wallclock.h"
+#include "tou.h"
+
+#define MINUTES_PER_DAY 1440
+
+LOCAL tou_config_t touConfig;
+LOCAL tou_energy_t touEnergy;
+
+
+/*
+ * Return the tariff in force now, or -1 if the clock isn't synchronized
+ */
+
+int8_t ICACHE_FLASH_ATTR tou_current_tariff(void)
+{
+	uint64_t ms;
+	int32_t minute;
+	int8_t tariff;
+	uint8_t i;
+
+	if(!wallclock_synced() || !touConfig.num_periods)
+		return -1;
+
+	ms = wallclock_epoch_ms();
+	minute = (int32_t) ((ms / 60000) % MINUTES_PER_DAY) + touConfig.tz;
+	minute %= MINUTES_PER_DAY;
+	if(minute < 0)
+		minute += MINUTES_PER_DAY;
+
+	// The last period of the day carries over past midnight
+	tariff = touConfig.periods[touConfig.num_periods - 1].tariff;
+	for(i = 0; i < touConfig.num_periods; i++){
+		if(touConfig.periods[i].start > minute)
+			break;
+		tariff = touConfig.periods[i].tariff;
+	}
+	return tariff;
+}
+
+
+/*
+ * Add measured energy to the current tariff register
+ */
+
+void ICACHE_FLASH_ATTR tou_accumulate(uint32_t energy)
+{
+	int8_t t = tou_current_tariff();
+
+	if(t < 0)
+		touEnergy.unsynced += energy;
+	else
+		touEnergy.tariff[t] += energy;
+}
+
+
+/*
+ * Return the energy registers
+ */
+
+const tou_energy_t * ICACHE_FLASH_ATTR tou_get_energy(void)
+{
+	return &touEnergy;
+}
+
+
+/*
+ * Zero the energy registers
+ */
+
+void ICACHE_FLASH_ATTR tou_clear(void)
+{
+	os_memset(&touEnergy, 0, sizeof(touEnergy));
+}
+
+
+/*
+ * Default configuration: UTC, a single tariff all day
+ */
+
+void ICACHE_FLASH_ATTR tou_default_config(tou_config_t *config)
+{
+	os_memset(config, 0, sizeof(tou_config_t));
+	config->num_periods = 1;
+}
+
+
+/*
+ * Change the configuration. Periods are sorted by start time,
+ * and invalid periods are dropped.
+ */
+
+void ICACHE_FLASH_ATTR tou_set_config(const tou_config_t *config)
+{
+	uint8_t i, j, n = 0;
+	tou_period_t p;
+
+	touConfig.tz = config->tz;
+	for(i = 0; (i < config->num_periods) && (i < TOU_MAX_PERIODS); i++){
+		p = config->periods[i];
+		if((p.start >= MINUTES_PER_DAY) || (p.tariff >= TOU_MAX_TARIFFS))
+			continue;
+		// Insertion sort
+		for(j = n; (j > 0) && (touConfig.periods[j - 1].start > p.start); j--)
+			touConfig.periods[j] = touConfig.periods[j - 1];
+		touConfig.periods[j] = p;
+		n++;
+	}
+	touConfig.num_periods = n;
+}
+
+
+/*
+ * Return the configuration in use
+ */
+
+const tou_config_t * ICACHE_FLASH_ATTR tou_get_config(void)
+{
+	return &touConfig;
+}
+
+
+/*
+ * Initialize with a configuration and the saved energy registers
+ */
+
+void ICACHE_FLASH_ATTR tou_init(const tou_config_t *config, const tou_energy_t *energy)
+{
+	tou_set_config(config);
+	if(energy)
+		os_memcpy(&touEnergy, energy, sizeof(touEnergy));
+	else
+		tou_clear();
+}
@@ -0,0 +1,42 @@
+#ifndef _TOU_H_
+#define _TOU_H_
+
+/*
+ * Time of use energy registers.
+ *
+ * The day is divided into periods, each of which is billed at one of
+ * TOU_MAX_TARIFFS tariffs. Energy is accumulated into the register of the
+ * tariff in force when it is measured. Energy measured before the clock
+ * is synchronized goes into a separate unsynced register.
+ */
+
+#define TOU_MAX_PERIODS 8
+#define TOU_MAX_TARIFFS 4
+
+typedef struct {
+	uint16_t start;				// Start of the period, minutes after local midnight
+	uint8_t tariff;				// Tariff index
+} __attribute__((__packed__)) tou_period_t;
+
+typedef struct {
+	int16_t tz;					// Local time offset from UTC, minutes
+	uint8_t num_periods;
+	uint8_t pad;
+	tou_period_t periods[TOU_MAX_PERIODS];		// Sorted by start time
+} __attribute__((__packed__)) tou_config_t;
+
+typedef struct {
+	uint32_t tariff[TOU_MAX_TARIFFS];	// Energy per tariff, same units as EM_APENERGY
+	uint32_t unsynced;					// Energy measured while the clock wasn't synchronized
+} __attribute__((__packed__)) tou_energy_t;
+
+void tou_init(const tou_config_t *config, const tou_energy_t *energy);
+void tou_set_config(const tou_config_t *config);
+void tou_default_config(tou_config_t *config);
+const tou_config_t *tou_get_config(void);
+int8_t tou_current_tariff(void);
+void tou_accumulate(uint32_t energy);
+const tou_energy_t *tou_get_energy(void);
+void tou_clear(void);
+
+#endif
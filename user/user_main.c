@@ -46,11 +46,19 @@
 // Project includes
 #include "driver/uart.h"
 #include "mqtt.h"
+#include "mqttsn.h"
 #include "wifi.h"
 #include "easygpio.h"
 #include "util.h"
 #include "kvstore.h"
 #include "driver/em.h"
+#include "sampler.h"
+#include "pq.h"
+#include "loads.h"
+#include "cycles.h"
+#include "wallclock.h"
+#include "tou.h"
+#include "burst.h"
 
 
 /* General definitions */
@@ -68,7 +76,23 @@
 #define MVISAMPLE 1								// Millivolts across shunt resistor at basic current
 #define MVVSAMPLE 248							// Millivolts at bottom tap of voltage divider at vref
 #define MC 3200									// Metering pulse constant (impulses/kWh)
- 
+#define FNOMINAL 6000							// Nominal line frequency (0.01Hz)
+
+// Energy register polling
+#define ENERGY_POLL_INTERVAL 60000				// ms, sets the resolution of tariff period boundaries
+#define ENERGY_SAVE_POLLS 60					// Polls between saves of the time of use registers
+#define EVENT_EXPIRY 300						// s, MQTT 5 brokers drop undelivered telemetry events after this
+#define ENERGY_QOS 1							// Energy readings are billing data, publish them at least once
+#define STATS_INTERVAL 300						// s, default interval between MQTT client stats, 0 for on demand only
+#define TIMER_INTERVAL_MAX 6870					// s, longest period os_timer_arm takes (0x68D7A3 ms)
+#define STATE_EXPIRY_INTERVALS 3				// MQTT 5 brokers drop the retained state after this many missed intervals
+#define MUSTER_WINDOW 2000						// ms, default window muster responses are spread over
+#define MUSTER_WINDOW_MAX 600000				// ms, longest window a muster may ask for
+#define SNAPSHOT_AHEAD_MAX 3600000				// ms, furthest ahead a snapshot may be scheduled
+#define SNAPSHOT_LEAD 5							// ms, the snapshot timer fires this early and waits out the rest
+#define SERIAL_LINE_MAX 256						// Longest command accepted on the serial console
+#define STATS_BUF_SIZE 768						// Stats publish with every counter at its widest is 708 characters
+
 // EM Chip power line constant calculated using constants above.
 #define PLC ((838860800ULL*IGAIN*MVISAMPLE*MVVSAMPLE)/(1ULL*MC*VREF*IBASIC))	// Power Line Constant
 
@@ -137,11 +161,24 @@ typedef struct {
 
 typedef struct config_info_block_tag config_info_block;
 
+// MQTT client stats settings
+
+typedef struct {
+	uint32_t interval;							// s between publishes, 0 for on demand only
+} stats_config_t;
+
+// Retained state settings
+
+typedef struct {
+	uint32_t interval;							// s between retained snapshots, 0 for off
+} state_config_t;
+
 // Definition of command codes and types
 
 enum {WIFISSID=0, WIFIPASS, MQTTHOST, MQTTPORT, MQTTSECUR, MQTTDEVID, 
-	MQTTUSER, MQTTPASS, MQTTKPALIV, MQTTDEVPATH, MQTTBTLOCAL};
-enum {CP_NONE= 0, CP_INT, CP_BOOL, CP_QSTRING, CP_REGISTER};
+	MQTTUSER, MQTTPASS, MQTTKPALIV, MQTTDEVPATH, MQTTBTLOCAL, NTPHOST,
+	MQTTSNHOST, MQTTSNPORT, MQTTSNSTID};
+enum {CP_NONE= 0, CP_INT, CP_BOOL, CP_QSTRING, CP_REGISTER, CP_JSON};
  
  
 /* Local storage */
@@ -156,21 +193,25 @@ LOCAL config_info_block configInfoBlock = {
 	.recordLength = sizeof(config_info_element),
 	.e[WIFISSID] = {.flags = CONFIG_FLD_REQD, .key = "WIFISSID", .value="your_ssid_here"},
 	.e[WIFIPASS] = {.flags = CONFIG_FLD_REQD, .key = "WIFIPASS", .value="its_a_secret"},
-	.e[MQTTHOST] = {.flags = CONFIG_FLD_REQD, .key = "MQTTHOST", .value="your_mqtt_broker_hostname_here"}, // May also be an IP address
-	.e[MQTTPORT] = {.key = "MQTTPORT", .value="1883"}, // destination Port for mqtt broker
+	.e[MQTTHOST] = {.flags = CONFIG_FLD_REQD, .key = "MQTTHOST", .value="your_mqtt_broker_hostname_here"}, // May also be an IP address, or a comma separated list of host[:port] to fail over between
+	.e[MQTTPORT] = {.key = "MQTTPORT", .value="1883"}, // destination Port for mqtt broker, for hosts without one
 	.e[MQTTSECUR] = {.key = "MQTTSECUR",.value="0"}, // Security 0 - no encryption
 	.e[MQTTDEVID] = {.key = "MQTTDEVID", .value="your_mqtt_device_id_here"}, // Unique device ID
 	.e[MQTTUSER] = {.key = "MQTTUSER", .value="your_mqtt_client_name_here"}, // MQTT User name
 	.e[MQTTPASS] = {.key = "MQTTPASS", .value="its_a_secret"},// MQTT Password
 	.e[MQTTKPALIV] = {.key = "MQTTKPALIV", .value="120"}, // Keepalive interval
-	.e[MQTTDEVPATH] = {.flags = CONFIG_FLD_REQD, .key = "MQTTDEVPATH", .value = "/home/lab/acpowermon"} // Device path
+	.e[MQTTDEVPATH] = {.flags = CONFIG_FLD_REQD, .key = "MQTTDEVPATH", .value = "/home/lab/acpowermon"}, // Device path
+	.e[NTPHOST] = {.key = "NTPHOST", .value = "pool.ntp.org"}, // SNTP server for the wall clock, may also be an IP address
+	.e[MQTTSNHOST] = {.key = "MQTTSNHOST", .value = ""}, // MQTT-SN gateway for telemetry, empty to publish it over MQTT
+	.e[MQTTSNPORT] = {.key = "MQTTSNPORT", .value = "1884"}, // UDP port of the MQTT-SN gateway
+	.e[MQTTSNSTID] = {.key = "MQTTSNSTID", .value = "0"} // Status topic ID predefined on the gateway for QoS -1, 0 for none
 
 };
 
 // Command elements 
 // Additional commands are added here
  
-enum {CMD_QUERY = 0, CMD_RESET_KWH, CMD_REGISTER, CMD_SURVEY, CMD_SSID, CMD_RESTART, CMD_WIFIPASS};
+enum {CMD_QUERY = 0, CMD_RESET_KWH, CMD_REGISTER, CMD_SURVEY, CMD_SSID, CMD_RESTART, CMD_WIFIPASS, CMD_PQ, CMD_LOADS, CMD_CYCLES, CMD_TOU, CMD_BURST, CMD_STATS, CMD_STATE};
 
 LOCAL command_element commandElements[] = {
 	{.command = "query", .type = CP_NONE},
@@ -180,13 +221,41 @@ LOCAL command_element commandElements[] = {
 	{.command = "ssid", .type = CP_QSTRING},
 	{.command = "restart",.type = CP_NONE},
 	{.command = "wifipass",.type = CP_QSTRING},
+	{.command = "pq",.type = CP_JSON},
+	{.command = "loads",.type = CP_JSON},
+	{.command = "cycles",.type = CP_JSON},
+	{.command = "tou",.type = CP_JSON},
+	{.command = "burst",.type = CP_JSON},
+	{.command = "stats",.type = CP_JSON},
+	{.command = "state",.type = CP_JSON},
 	{.command = ""} /* End marker */
 };
+
+// Inbound topics, matched by length and hash
+#define MAX_TOPIC_HANDLERS 2
+
+typedef void (*topic_handler)(const char *data, uint32_t data_len);
+
+typedef struct {
+	const char *topic;
+	uint16_t len;
+	uint32_t hash;
+	topic_handler handler;
+} topic_entry;
 	
 // Misc Local variables 
 LOCAL char *schema = "hwstar_acpowermon";
-LOCAL char *commandTopic, *statusTopic;
+LOCAL char *commandTopic, *statusTopic, *eventTopic, *statsTopic, *packetsTopic;
+LOCAL char *stateTopic, *nodeInfoTopic;
 const char *emCalDataKey = "EMCALDATA";
+const char *pqConfigKey = "PQCONFIG";
+const char *loadsConfigKey = "LOADCONFIG";
+const char *cyclesConfigKey = "CYCCONFIG";
+const char *touConfigKey = "TOUCONFIG";
+const char *touEnergyKey = "TOUENERGY";
+const char *burstConfigKey = "BURSTCONFIG";
+const char *statsConfigKey = "STATSCONFIG";
+const char *stateConfigKey = "STATECONFIG";
 LOCAL char *controlTopic = "/node/control";
 LOCAL char *infoTopic = "/node/info";
 LOCAL flash_handle_s *configHandle;
@@ -194,6 +263,32 @@ LOCAL eeprom_cal_data_t *eepromCalData;	// Place to store calibration data
 // Total forward active energy
 LOCAL uint32_t fae_total;
 LOCAL MQTT_Client mqttClient;				// Control block used by MQTT functions
+LOCAL char serialLine[SERIAL_LINE_MAX];		// Serial console line being received
+LOCAL uint16_t serialLen;
+LOCAL bool serialOverlong;
+LOCAL MQTTSN_Client mqttSnClient;			// Telemetry over MQTT-SN, when a gateway is configured
+LOCAL bool mqttSnEnabled;
+LOCAL int mqttSnStatusQos;					// -1 if the status topic is predefined on the gateway
+LOCAL pq_config_t pqConfig;					// Power quality detector settings
+LOCAL loads_config_t loadsConfig;			// Load transition detector settings
+LOCAL cycles_config_t cyclesConfig;			// Cyclic load analyzer settings
+LOCAL tou_config_t touConfig;				// Time of use tariff periods
+LOCAL burst_config_t burstConfig;			// Burst capture settings
+LOCAL stats_config_t statsConfig;			// MQTT client stats settings
+LOCAL ETSTimer statsTimer;					// Periodic MQTT client stats
+LOCAL state_config_t stateConfig;			// Retained state settings
+LOCAL ETSTimer stateTimer;					// Periodic retained snapshot
+LOCAL ETSTimer musterTimer;					// Delayed muster response
+LOCAL bool musterPending;					// Muster response waiting for its slot
+LOCAL ETSTimer snapshotTimer;				// Fires at the snapshot target time, then when it is published
+LOCAL uint64_t snapshotTarget;				// Unix time in ms of the scheduled snapshot, 0 for none
+LOCAL uint32_t snapshotWindow;				// ms the publish is spread over
+LOCAL char *snapshotMsg;					// Captured snapshot waiting to be published
+LOCAL ETSTimer energyTimer;					// Periodic energy register poll
+LOCAL uint8_t energyPolls;					// Polls since the energy registers were last saved
+LOCAL bool energyDirty;						// Energy registers changed since last save
+LOCAL topic_entry topicHandlers[MAX_TOPIC_HANDLERS];	// Inbound topic dispatch
+LOCAL uint8_t numTopicHandlers;
 
 /**
  * Convert twos complement signed 16 bit integer to fixed point number
@@ -356,37 +451,689 @@ LOCAL uint16_t ICACHE_FLASH_ATTR calcCRC16(void *buf, int len)
 	return crc;
 }
 
+/**
+ * Load a configuration structure saved with configBlobSave.
+ * Returns FALSE if the key is missing or the CRC doesn't match.
+ */
+
+LOCAL bool ICACHE_FLASH_ATTR configBlobLoad(const char *key, void *dest, int size)
+{
+	uint8_t *blob;
+	uint16_t crc;
+	bool res = FALSE;
+
+	if(!kvstore_exists(configHandle, key))
+		return FALSE;
+	blob = kvstore_get_blob(configHandle, key);
+	os_memcpy(&crc, blob, sizeof(crc));
+	if(crc == calcCRC16(blob + sizeof(crc), size)){
+		os_memcpy(dest, blob + sizeof(crc), size);
+		res = TRUE;
+	}
+	util_free(blob);
+	return res;
+}
 
 /**
- * Publish connection info
+ * Save a configuration structure as a kvstore blob with a leading CRC.
+ * size must be less than KVS_BLOB_SIZE - 2.
  */
-LOCAL void ICACHE_FLASH_ATTR publishConnInfo(MQTT_Client *client)
+
+LOCAL void ICACHE_FLASH_ATTR configBlobSave(const char *key, const void *src, int size)
+{
+	uint8_t *blob = util_zalloc(KVS_BLOB_SIZE);
+	uint16_t crc = calcCRC16((void *) src, size);
+
+	os_memcpy(blob, &crc, sizeof(crc));
+	os_memcpy(blob + sizeof(crc), src, size);
+	kvstore_put_blob(configHandle, key, blob);
+	util_free(blob);
+}
+
+/**
+ * Look up a named fixed point field in a JSON message
+ */
+
+LOCAL bool ICACHE_FLASH_ATTR getFixedParam(const char *data, int len, const char *name, uint8_t places, int *val)
+{
+	struct jsonparse_state state;
+	char str[16];
+
+	jsonparse_setup(&state, data, len);
+	if(util_parse_json_param(&state, name, str, sizeof(str)) != 2)
+		return FALSE;
+	return util_parse_fixed(str, places, val);
+}
+
+/**
+ * Look up a named string field in a JSON message
+ */
+
+LOCAL bool ICACHE_FLASH_ATTR getStringParam(const char *data, int len, const char *name, char *dest, int size)
+{
+	struct jsonparse_state state;
+
+	jsonparse_setup(&state, data, len);
+	return util_parse_json_param(&state, name, dest, size) == 2;
+}
+
+/**
+ * Publish telemetry. It goes to the MQTT-SN gateway when one is configured
+ * and the client is ready, otherwise into the MQTT telemetry lane. MQTT-SN
+ * has no message expiry, so expiry only applies to the MQTT path.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR publishTelemetry(const char *topic, const char *buf, int retain, uint32_t expiry)
+{
+	uint16_t len = os_strlen(buf);
+	int qos = (topic == statusTopic) ? mqttSnStatusQos : 0;
+
+	if(mqttSnEnabled && MQTTSN_Publish(&mqttSnClient, topic, buf, len, qos, retain))
+		return;
+	MQTT_PublishLane(&mqttClient, MQTT_LANE_TELEMETRY, topic, buf, len, 0, retain, expiry);
+}
+
+/**
+ * Format an event time stamp. Unix time in milliseconds once the clock
+ * is synchronized, otherwise uptime in milliseconds. dest must hold 21 characters.
+ */
+
+LOCAL char * ICACHE_FLASH_ATTR formatTime(char *dest, uint32_t uptime_ms)
+{
+	if(wallclock_synced())
+		return util_u64_to_str(dest, wallclock_uptime_to_epoch_ms(uptime_ms));
+	os_sprintf(dest, "%u", uptime_ms);
+	return dest;
+}
+
+/**
+ * Format an energy count as kWh with 4 decimal places
+ */
+
+LOCAL char * ICACHE_FLASH_ATTR formatKwh(char *dest, uint32_t energy)
+{
+	// KWH is equivalent to energy divided by MC integer pulses
+	// Since the fractional pulses are included in the energy count,
+	// we need to account for them.  We do this by multiplying
+	// by 1000 so that we get a kwh number which can be represented
+	// with 4 decimal digits.
+	uint64_t kwh = (((uint64_t) energy) * 1000ULL) / MC;
+
+	os_sprintf(dest, "%u.%04u", (uint32_t) (kwh / 10000), (uint32_t) (kwh % 10000));
+	return dest;
+}
+
+/**
+ * Save the time of use energy registers
+ */
+
+LOCAL void ICACHE_FLASH_ATTR energySave(void)
+{
+	configBlobSave(touEnergyKey, tou_get_energy(), sizeof(tou_energy_t));
+	kvstore_flush(configHandle);
+	energyDirty = FALSE;
+	energyPolls = 0;
+}
+
+/**
+ * Read the energy register on the em chip and add it to the totals.
+ * The register clears when it is read.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR energyPoll(void)
+{
+	uint16_t fae = em_read_transaction(EM_APENERGY);
+
+	if(fae){
+		fae_total += fae;
+		tou_accumulate(fae);
+		energyDirty = TRUE;
+	}
+}
+
+/**
+ * Energy timer callback. Polls often enough that energy lands in
+ * the right tariff, and saves the registers hourly to limit flash wear.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR energyTimerCb(void *arg)
+{
+	energyPoll();
+	if((++energyPolls >= ENERGY_SAVE_POLLS) && energyDirty)
+		energySave();
+}
+
+
+/**
+ * Format connection info. buf must hold 384 characters.
+ */
+LOCAL char * ICACHE_FLASH_ATTR formatConnInfo(char *buf)
 {
 	struct ip_info ipConfig;
-	char *buf = util_zalloc(256);	
-		
-	// Publish who we are and where we live
+
+	// Who we are and where we live
 	wifi_get_ip_info(STATION_IF, &ipConfig);
-	os_sprintf(buf, "{\"muster\":{\"connstate\":\"online\",\"device\":\"%s\",\"ip4\":\"%d.%d.%d.%d\",\"schema\":\"%s\",\"ssid\":\"%s\"}}",
+	os_sprintf(buf, "{\"muster\":{\"connstate\":\"online\",\"device\":\"%s\",\"ip4\":\"%d.%d.%d.%d\",\"schema\":\"%s\",\"ssid\":\"%s\",\"broker\":\"%s:%d\"}}",
 			configInfoBlock.e[MQTTDEVPATH].value,
 			*((uint8_t *) &ipConfig.ip.addr),
 			*((uint8_t *) &ipConfig.ip.addr + 1),
 			*((uint8_t *) &ipConfig.ip.addr + 2),
 			*((uint8_t *) &ipConfig.ip.addr + 3),
 			schema,
-			commandElements[CMD_SSID].p.sp);
+			commandElements[CMD_SSID].p.sp,
+			mqttClient.host, mqttClient.port);
 	
 	INFO("MQTT Node info: %s\r\n", buf);
+	return buf;
+}
+
+
+/**
+ * Publish connection info
+ */
+LOCAL void ICACHE_FLASH_ATTR publishConnInfo(MQTT_Client *client)
+{
+	char buf[384];
+
+	formatConnInfo(buf);
 
 	// Publish
 	MQTT_Publish(client, infoTopic, buf, os_strlen(buf), 0, 0);
-	
-	// Free the buffer
+}
+
+/**
+ * Publish the connection info retained on the device's own info subtopic,
+ * so a new subscriber gets it from the broker
+ */
+LOCAL void ICACHE_FLASH_ATTR publishRetainedInfo(MQTT_Client *client)
+{
+	char buf[384];
+
+	formatConnInfo(buf);
+	MQTT_Publish(client, nodeInfoTopic, buf, os_strlen(buf), 0, 1);
+}
+
+
+
+/**
+ * Publish a power quality event
+ */
+
+LOCAL void ICACHE_FLASH_ATTR pqEventCb(const pq_event_t *e)
+{
+	char buf[176];
+	char extreme[8];
+	char t[21];
+	const char *type;
+
+	if(PQ_VOLTAGE == e->channel)
+		type = (PQ_HIGH == e->kind) ? "swell" : "sag";
+	else
+		type = (PQ_HIGH == e->kind) ? "freqhigh" : "freqlow";
+
+	to_fixed_decimal_uint16(extreme, 2, e->extreme);
+	os_sprintf(buf, "{\"pqevent\":{\"type\":\"%s\",\"edge\":\"%s\",\"t\":\"%s\",\"duration\":\"%u\",\"extreme\":\"%s\"}}",
+		type, (PQ_EDGE_START == e->edge) ? "start" : "end", formatTime(t, e->start_ms), e->duration_ms, extreme);
+	INFO("PQ event: %s\r\n", buf);
+	MQTT_PublishWithExpiry(&mqttClient, eventTopic, buf, os_strlen(buf), 0, 0, EVENT_EXPIRY);
+}
+
+/**
+ * Query or change the power quality detector settings
+ */
+
+LOCAL void ICACHE_FLASH_ATTR pqCommand(const char *data, int len)
+{
+	char buf[200];
+	char vlow[8], vhigh[8], vhyst[8], flow[8], fhigh[8], fhyst[8];
+	pq_config_t c = pqConfig;
+	bool changed = FALSE;
+	int v;
+
+	if(getFixedParam(data, len, "enable", 0, &v)){
+		c.enable = v ? TRUE : FALSE;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "mindur", 0, &v) && (v >= 0) && (v <= 0xFFFF)){
+		c.min_duration = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "vlow", 2, &v) && (v > 0) && (v <= 0xFFFF)){
+		c.v_low = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "vhigh", 2, &v) && (v > 0) && (v <= 0xFFFF)){
+		c.v_high = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "vhyst", 2, &v) && (v >= 0) && (v <= 0xFFFF)){
+		c.v_hyst = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "flow", 2, &v) && (v > 0) && (v <= 0xFFFF)){
+		c.f_low = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "fhigh", 2, &v) && (v > 0) && (v <= 0xFFFF)){
+		c.f_high = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "fhyst", 2, &v) && (v >= 0) && (v <= 0xFFFF)){
+		c.f_hyst = v;
+		changed = TRUE;
+	}
+
+	if(changed){
+		pqConfig = c;
+		pq_set_config(&pqConfig);
+		configBlobSave(pqConfigKey, &pqConfig, sizeof(pqConfig));
+	}
+
+	os_sprintf(buf, "{\"pq\":{\"enable\":\"%d\",\"mindur\":\"%d\",\"vlow\":\"%s\",\"vhigh\":\"%s\",\"vhyst\":\"%s\",\"flow\":\"%s\",\"fhigh\":\"%s\",\"fhyst\":\"%s\"}}",
+		pqConfig.enable, pqConfig.min_duration,
+		to_fixed_decimal_uint16(vlow, 2, pqConfig.v_low),
+		to_fixed_decimal_uint16(vhigh, 2, pqConfig.v_high),
+		to_fixed_decimal_uint16(vhyst, 2, pqConfig.v_hyst),
+		to_fixed_decimal_uint16(flow, 2, pqConfig.f_low),
+		to_fixed_decimal_uint16(fhigh, 2, pqConfig.f_high),
+		to_fixed_decimal_uint16(fhyst, 2, pqConfig.f_hyst));
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
+}
+
+/**
+ * Publish a load transition event
+ */
+
+LOCAL void ICACHE_FLASH_ATTR loadsEventCb(const loads_event_t *e)
+{
+	char buf[112];
+	char t[21];
+
+	os_sprintf(buf, "{\"load\":{\"dp\":\"%d\",\"dq\":\"%d\",\"t\":\"%s\",\"sig\":\"%d\"}}",
+		e->dp, e->dq, formatTime(t, e->ms), e->signature);
+	INFO("Load event: %s\r\n", buf);
+	MQTT_PublishWithExpiry(&mqttClient, eventTopic, buf, os_strlen(buf), 0, 0, EVENT_EXPIRY);
+}
+
+/**
+ * Query or change the load transition detector settings,
+ * and return the signature table.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR loadsCommand(const char *data, int len)
+{
+	const loads_signature_t *sig;
+	loads_config_t c = loadsConfig;
+	bool changed = FALSE;
+	bool first = TRUE;
+	uint8_t i;
+	int v;
+	char *buf;
+
+	if(getFixedParam(data, len, "enable", 0, &v)){
+		c.enable = v ? TRUE : FALSE;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "minstep", 0, &v) && (v > 0) && (v <= 0x7FFF)){
+		c.min_step = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "settle", 0, &v) && (v > 0) && (v <= 0xFFFF)){
+		c.settle = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "noisek", 0, &v) && (v > 0) && (v <= 0xFF)){
+		c.noise_k = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "clear", 0, &v) && v)
+		loads_clear_signatures();
+
+	if(changed){
+		loadsConfig = c;
+		loads_set_config(&loadsConfig);
+		configBlobSave(loadsConfigKey, &loadsConfig, sizeof(loadsConfig));
+	}
+
+	// Header and closing at most 119 characters, each signature at most 67
+	buf = util_zalloc(128 + (LOADS_MAX_SIGNATURES * 72));
+	os_sprintf(buf, "{\"loads\":{\"enable\":\"%d\",\"minstep\":\"%d\",\"settle\":\"%d\",\"noisek\":\"%d\",\"threshold\":\"%d\",\"signatures\":[",
+		loadsConfig.enable, loadsConfig.min_step, loadsConfig.settle, loadsConfig.noise_k, loads_get_threshold());
+	sig = loads_get_signatures();
+	for(i = 0; i < LOADS_MAX_SIGNATURES; i++){
+		if(!sig[i].on_count && !sig[i].off_count)
+			continue;
+		os_sprintf(buf + os_strlen(buf), "%s{\"id\":\"%d\",\"dp\":\"%d\",\"dq\":\"%d\",\"on\":\"%u\",\"off\":\"%u\"}",
+			first ? "" : ",", i, sig[i].dp, sig[i].dq, sig[i].on_count, sig[i].off_count);
+		first = FALSE;
+	}
+	os_strcat(buf, "]}}");
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
 	util_free(buf);
-	
 }
 
+/**
+ * Publish a cyclic load summary
+ */
+
+LOCAL void ICACHE_FLASH_ATTR cyclesReportCb(const cycles_summary_t *c)
+{
+	char buf[272];
+	char t[21];
+
+	// Periods in seconds with one decimal place, duty cycle in percent, energy in Wh
+	os_sprintf(buf, "{\"cycles\":{\"t\":\"%s\",\"n\":\"%u\",\"period\":\"%u.%u\",\"pmin\":\"%u.%u\",\"pmax\":\"%u.%u\",\"duty\":\"%u.%u\",\"wh\":\"%u.%02u\",\"prun\":\"%u.%u\",\"dutyrun\":\"%u.%u\"}}",
+		formatTime(t, c->ms), c->count,
+		c->period_avg / 1000, (c->period_avg % 1000) / 100,
+		c->period_min / 1000, (c->period_min % 1000) / 100,
+		c->period_max / 1000, (c->period_max % 1000) / 100,
+		c->duty_avg / 10, c->duty_avg % 10,
+		c->energy_avg / 100, c->energy_avg % 100,
+		c->period_run / 1000, (c->period_run % 1000) / 100,
+		c->duty_run / 10, c->duty_run % 10);
+	INFO("Cycle summary: %s\r\n", buf);
+	publishTelemetry(statusTopic, buf, 0, EVENT_EXPIRY);
+}
+
+/**
+ * Query or change the cyclic load analyzer settings
+ */
+
+LOCAL void ICACHE_FLASH_ATTR cyclesCommand(const char *data, int len)
+{
+	char buf[128];
+	cycles_config_t c = cyclesConfig;
+	bool changed = FALSE;
+	int v;
+
+	if(getFixedParam(data, len, "enable", 0, &v)){
+		c.enable = v ? TRUE : FALSE;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "on", 0, &v) && (v > 0) && (v <= 0x7FFF)){
+		c.on_threshold = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "off", 0, &v) && (v >= 0) && (v <= 0x7FFF)){
+		c.off_threshold = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "report", 0, &v) && (v > 0) && (v <= 0xFFFF)){
+		c.report = v;
+		changed = TRUE;
+	}
+
+	if(changed){
+		cyclesConfig = c;
+		cycles_set_config(&cyclesConfig);
+		configBlobSave(cyclesConfigKey, &cyclesConfig, sizeof(cyclesConfig));
+	}
+	else if(getFixedParam(data, len, "now", 0, &v) && v){
+		cycles_report_now();
+		return;
+	}
+
+	os_sprintf(buf, "{\"cycles\":{\"enable\":\"%d\",\"on\":\"%d\",\"off\":\"%d\",\"report\":\"%d\"}}",
+		cyclesConfig.enable, cyclesConfig.on_threshold, cyclesConfig.off_threshold, cyclesConfig.report);
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
+}
+
+/**
+ * Publish a captured burst as one batch. Offsets are ms relative to the trigger.
+ */
 
+LOCAL void ICACHE_FLASH_ATTR burstCb(const burst_t *b)
+{
+	char t[21];
+	char *buf;
+	uint8_t i;
+
+	buf = util_zalloc(128 + (b->count * 40));
+	os_sprintf(buf, "{\"burst\":{\"t\":\"%s\",\"trigger\":\"%s\",\"n\":\"%u\",\"pre\":\"%u\",\"o\":[",
+		formatTime(t, b->trigger_ms), (BURST_TRIG_POWER == b->trigger) ? "power" : "current", b->count, b->pre);
+	for(i = 0; i < b->count; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%d\"", i ? "," : "", (int32_t) (b->points[i].ms - b->trigger_ms));
+	os_strcat(buf, "],\"p\":[");
+	for(i = 0; i < b->count; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%d\"", i ? "," : "", b->points[i].pmean);
+	os_strcat(buf, "],\"i\":[");
+	for(i = 0; i < b->count; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%u\"", i ? "," : "", b->points[i].irms);
+	os_strcat(buf, "]}}");
+	INFO("Burst captured: %d points\r\n", b->count);
+	MQTT_PublishWithExpiry(&mqttClient, eventTopic, buf, os_strlen(buf), 0, 0, EVENT_EXPIRY);
+	util_free(buf);
+}
+
+/**
+ * Query or change the burst capture settings
+ */
+
+LOCAL void ICACHE_FLASH_ATTR burstCommand(const char *data, int len)
+{
+	char buf[160];
+	burst_config_t c = burstConfig;
+	bool changed = FALSE;
+	int v;
+
+	if(getFixedParam(data, len, "enable", 0, &v)){
+		c.enable = v ? TRUE : FALSE;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "pre", 0, &v) && (v >= 0) && (v <= BURST_MAX_PRE)){
+		c.pre = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "post", 0, &v) && (v > 0) && (v <= BURST_MAX_SAMPLES)){
+		c.post = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "holdoff", 0, &v) && (v >= 0) && (v <= 0xFFFF)){
+		c.holdoff = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "dp", 0, &v) && (v >= 0) && (v <= 0xFFFF)){
+		c.dp = v;
+		changed = TRUE;
+	}
+	if(getFixedParam(data, len, "di", 0, &v) && (v >= 0) && (v <= 0xFFFF)){
+		c.di = v;
+		changed = TRUE;
+	}
+
+	if(changed){
+		burst_set_config(&c);
+		// Store the limited copy
+		burstConfig = *burst_get_config();
+		configBlobSave(burstConfigKey, &burstConfig, sizeof(burstConfig));
+	}
+
+	os_sprintf(buf, "{\"burst\":{\"enable\":\"%d\",\"pre\":\"%d\",\"post\":\"%d\",\"holdoff\":\"%d\",\"dp\":\"%d\",\"di\":\"%d\",\"interval\":\"%u\"}}",
+		burstConfig.enable, burstConfig.pre, burstConfig.post, burstConfig.holdoff, burstConfig.dp, burstConfig.di, burst_get_interval());
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
+}
+
+#ifdef MQTT_METRICS
+/**
+ * Publish the MQTT client metrics. The packet counts go to their own
+ * subtopic, as with every counter at its widest both together would be
+ * more than a publish can hold.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR publishStats(void)
+{
+	static const char *causes[MQTT_CAUSES] = {"closed", "error", "refused", "malformed", "sendtimeout", "pingtimeout", "failover", "sendrefused"};
+	const MQTT_STATS *m = &mqttClient.metrics;
+	const MQTT_LANE *l;
+	char uptime[21];
+	char *buf;
+	uint8_t i;
+
+	buf = util_zalloc(STATS_BUF_SIZE);
+	util_u64_to_str(uptime, wallclock_uptime_us() / 1000);
+	// Packet counts are indexed by MQTT packet type, at most 475 characters
+	os_sprintf(buf, "{\"packets\":{\"uptime\":\"%s\",\"tx\":[", uptime);
+	for(i = 0; i < 16; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%u\"", i ? "," : "", m->txPackets[i]);
+	os_strcat(buf, "],\"rx\":[");
+	for(i = 0; i < 16; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%u\"", i ? "," : "", m->rxPackets[i]);
+	os_strcat(buf, "]}}");
+	MQTT_PublishLane(&mqttClient, MQTT_LANE_TELEMETRY, packetsTopic, buf, os_strlen(buf), 0, 0, EVENT_EXPIRY);
+
+	os_sprintf(buf, "{\"stats\":{\"uptime\":\"%s\",\"txbytes\":\"%u\",\"rxbytes\":\"%u\",\"lanes\":[",
+		uptime, m->txBytes, m->rxBytes);
+	for(i = 0; i < MQTT_LANES; i++){
+		l = &mqttClient.lanes[i];
+		os_sprintf(buf + os_strlen(buf), "%s{\"high\":\"%u\",\"dropped\":\"%u\",\"coalesced\":\"%u\"}",
+			i ? "," : "", m->laneHigh[i], l->dropped, l->coalesced);
+	}
+	os_strcat(buf, "],\"reconnects\":{");
+	for(i = 0; i < MQTT_CAUSES; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%s\":\"%u\"", i ? "," : "", causes[i], m->reconnects[i]);
+	os_sprintf(buf + os_strlen(buf), "},\"pingus\":\"%u\",\"pingmaxus\":\"%u\",\"sendus\":\"%u\",\"sendmaxus\":\"%u\",\"connectms\":\"%u\",\"stack\":\"%u\",\"heap\":\"%u\",\"uartoverruns\":\"%u\"}}",
+		m->pingUs, m->pingMaxUs, m->sendUs, m->sendMaxUs, mqttClient.connectMs, util_stack_high_water(), system_get_free_heap_size(),
+		uart0_rx_overruns());
+	MQTT_PublishLane(&mqttClient, MQTT_LANE_TELEMETRY, statsTopic, buf, os_strlen(buf), 0, 0, EVENT_EXPIRY);
+	util_free(buf);
+}
+
+/**
+ * Stats timer callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR statsTimerCb(void *arg)
+{
+	publishStats();
+}
+
+/**
+ * Start the stats timer at the configured interval
+ */
+
+LOCAL void ICACHE_FLASH_ATTR statsStart(void)
+{
+	if(statsConfig.interval > TIMER_INTERVAL_MAX)
+		statsConfig.interval = TIMER_INTERVAL_MAX;
+	os_timer_disarm(&statsTimer);
+	if(statsConfig.interval){
+		os_timer_setfn(&statsTimer, (os_timer_func_t *) statsTimerCb, NULL);
+		os_timer_arm(&statsTimer, statsConfig.interval * 1000, 1);
+	}
+}
+
+/**
+ * Change the stats interval if given, and publish the stats now
+ */
+
+LOCAL void ICACHE_FLASH_ATTR statsCommand(const char *data, int len)
+{
+	int v;
+
+	// Longer intervals are cut to TIMER_INTERVAL_MAX before saving
+	if(getFixedParam(data, len, "interval", 0, &v) && (v >= 0)){
+		statsConfig.interval = v;
+		statsStart();
+		configBlobSave(statsConfigKey, &statsConfig, sizeof(statsConfig));
+	}
+	publishStats();
+}
+#endif
+
+/**
+ * Parse a tariff period in the form HH:MM=T
+ */
+
+LOCAL bool ICACHE_FLASH_ATTR parseTouPeriod(const char *s, tou_period_t *p)
+{
+	int hh = 0, mm = 0, t = 0;
+	uint8_t n;
+
+	for(n = 0; (*s >= '0') && (*s <= '9'); s++, n++)
+		hh = (hh * 10) + (*s - '0');
+	if(!n || (n > 2) || (*s++ != ':'))
+		return FALSE;
+	for(n = 0; (*s >= '0') && (*s <= '9'); s++, n++)
+		mm = (mm * 10) + (*s - '0');
+	if((n != 2) || (*s++ != '='))
+		return FALSE;
+	for(n = 0; (*s >= '0') && (*s <= '9'); s++, n++)
+		t = (t * 10) + (*s - '0');
+	if(!n || *s || (hh > 23) || (mm > 59) || (t >= TOU_MAX_TARIFFS))
+		return FALSE;
+	p->start = (hh * 60) + mm;
+	p->tariff = t;
+	return TRUE;
+}
+
+/**
+ * Query or change the time of use settings,
+ * and return the per tariff energy registers.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR touCommand(const char *data, int len)
+{
+	struct jsonparse_state state;
+	const tou_energy_t *e;
+	tou_config_t c = touConfig;
+	bool changed = FALSE;
+	char periods[80];
+	char *list[TOU_MAX_PERIODS + 1];
+	char *str;
+	char kwh[16], now[21];
+	char *buf;
+	uint8_t i;
+	int v;
+
+	if(getFixedParam(data, len, "tz", 0, &v) && (v >= -720) && (v <= 840)){
+		c.tz = v;
+		changed = TRUE;
+	}
+	jsonparse_setup(&state, data, len);
+	if(util_parse_json_param(&state, "periods", periods, sizeof(periods)) == 2){
+		str = util_string_split(periods, list, ',', TOU_MAX_PERIODS + 1);
+		for(i = 0; list[i]; i++){
+			if(!parseTouPeriod(list[i], &c.periods[i]))
+				break;
+		}
+		// Only accept the list if every period parsed
+		if(i && !list[i]){
+			c.num_periods = i;
+			changed = TRUE;
+		}
+		util_free(str);
+	}
+	if(getFixedParam(data, len, "reset", 0, &v) && v){
+		energyPoll();
+		tou_clear();
+		energySave();
+	}
+
+	if(changed){
+		tou_set_config(&c);
+		// Store the sorted copy
+		touConfig = *tou_get_config();
+		configBlobSave(touConfigKey, &touConfig, sizeof(touConfig));
+	}
+
+	// Bring the registers up to date before reporting them
+	energyPoll();
+	e = tou_get_energy();
+
+	buf = util_zalloc(192 + (TOU_MAX_PERIODS * 32) + (TOU_MAX_TARIFFS * 32));
+	os_sprintf(buf, "{\"tou\":{\"synced\":\"%d\",\"t\":\"%s\",\"tz\":\"%d\",\"tariff\":\"%d\",\"periods\":[",
+		wallclock_synced(), util_u64_to_str(now, wallclock_epoch_ms()), touConfig.tz, tou_current_tariff());
+	for(i = 0; i < touConfig.num_periods; i++){
+		os_sprintf(buf + os_strlen(buf), "%s{\"start\":\"%02d:%02d\",\"tariff\":\"%d\"}",
+			i ? "," : "", touConfig.periods[i].start / 60, touConfig.periods[i].start % 60, touConfig.periods[i].tariff);
+	}
+	os_strcat(buf, "],\"kwh\":[");
+	for(i = 0; i < TOU_MAX_TARIFFS; i++)
+		os_sprintf(buf + os_strlen(buf), "%s\"%s\"", i ? "," : "", formatKwh(kwh, e->tariff[i]));
+	os_sprintf(buf + os_strlen(buf), "],\"unsynced\":\"%s\"}}", formatKwh(kwh, e->unsynced));
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), ENERGY_QOS, 0);
+	util_free(buf);
+}
 
 /**
  * Handle qstring command
@@ -532,11 +1279,37 @@ LOCAL bool ICACHE_FLASH_ATTR registerCommand(struct jsonparse_state *state )
 
 LOCAL void ICACHE_FLASH_ATTR wifiConnectCb(uint8_t status)
 {
+	char *buf;
+
 	if(status == STATION_GOT_IP){
+		wallclock_sntp_start(configInfoBlock.e[NTPHOST].value);
+		// The muster message goes out with the CONNECT
+		buf = util_zalloc(384);
+		formatConnInfo(buf);
+		MQTT_SetBirth(&mqttClient, infoTopic, buf, os_strlen(buf), 0);
+		util_free(buf);
 		MQTT_Connect(&mqttClient);
+		if(mqttSnEnabled)
+			MQTTSN_Connect(&mqttSnClient);
 	}
 }
 
+/**
+ * Supply the survey results to the streamed publish,
+ * free them when it's done
+ */
+
+LOCAL uint16_t ICACHE_FLASH_ATTR
+surveyFill(void *arg, uint32_t offset, uint8_t *buf, uint16_t len)
+{
+	if(!buf){
+		util_free(arg);
+		return 0;
+	}
+	os_memcpy(buf, (char *) arg + offset, len);
+	return len;
+}
+
 /**
  * Survey complete,
  * publish results
@@ -568,37 +1341,84 @@ surveyCompleteCb(void *arg, STATUS status)
 		
 		INFO("Survey Results:\r\n", buf);
 		INFO(buf);
-		MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
-		util_free(buf);
+		// A crowded site gives more than a queued publish can take
+		if(!MQTT_PublishStream(&mqttClient, statusTopic, os_strlen(buf), 0, surveyFill, buf))
+			util_free(buf);
 	}
 
 }
 
 
 /**
- * MQTT Connect call back
+ * MQTT broker change call back. The muster message sent with the
+ * CONNECT names the broker, so it is made again for the new one.
  */
- 
-LOCAL void ICACHE_FLASH_ATTR mqttConnectedCb(uint32_t *args)
+
+LOCAL void ICACHE_FLASH_ATTR mqttBrokerCb(uint32_t *args)
 {
-	
-	MQTT_Client* client = (MQTT_Client*)args;
+	char *buf = util_zalloc(384);
 
+	formatConnInfo(buf);
+	MQTT_SetBirth(&mqttClient, infoTopic, buf, os_strlen(buf), 0);
+	util_free(buf);
+}
 
-	
-	INFO("MQTT: Connected\r\n");
+/**
+ * Set up the MQTT connection to the brokers in MQTTHOST, a comma separated
+ * list of host[:port]. Those without a port use MQTTPORT. The first is
+ * tried until the client has probed them all.
+ */
 
-	
-	
-	
+LOCAL void ICACHE_FLASH_ATTR initBrokers(void)
+{
+	char list[sizeof(configInfoBlock.e[MQTTHOST].value)];
+	uint32_t defaultPort = (uint32_t) atoi(configInfoBlock.e[MQTTPORT].value);
+	uint8_t security = (uint8_t) atoi(configInfoBlock.e[MQTTSECUR].value);
+	char *host, *p;
+	uint32_t port;
+	bool first = TRUE;
+
+	os_strcpy(list, (char *) configInfoBlock.e[MQTTHOST].value);
+	for(p = list; *p; ){
+		while(*p == ' ')
+			p++;
+		host = p;
+		port = defaultPort;
+		while(*p && *p != ',' && *p != ':')
+			p++;
+		if(*p == ':'){
+			*p++ = 0;
+			port = (uint32_t) atoi(p);
+			while(*p && *p != ',')
+				p++;
+		}
+		if(*p)
+			*p++ = 0;
+		if(!*host)
+			continue;
+		if(first)
+			MQTT_InitConnection(&mqttClient, (uint8_t *) host, port, security);
+		else if(!MQTT_AddBroker(&mqttClient, (uint8_t *) host, port))
+			INFO("Too many brokers, %s ignored\r\n", host);
+		first = FALSE;
+	}
+	// Keep a bad list from leaving the client with no broker at all
+	if(first)
+		MQTT_InitConnection(&mqttClient, configInfoBlock.e[MQTTHOST].value, defaultPort, security);
+}
 
-	publishConnInfo(client);
-	
-	// Subscribe to the control topic
-	MQTT_Subscribe(client, controlTopic, 0);
-	// Subscribe to command topic
-	MQTT_Subscribe(client, commandTopic, 0);
+/**
+ * MQTT Connect call back
+ */
+ 
+LOCAL void ICACHE_FLASH_ATTR mqttConnectedCb(uint32_t *args)
+{
+	INFO("MQTT: Connected\r\n");
+	INFO("Stack high water: %u bytes, free heap: %u bytes\r\n", util_stack_high_water(), system_get_free_heap_size());
 
+	// The muster message and subscriptions went with the CONNECT
+	if(stateConfig.interval)
+		publishRetainedInfo((MQTT_Client *) args);
 }
 
 /**
@@ -623,179 +1443,513 @@ LOCAL void ICACHE_FLASH_ATTR mqttPublishedCb(uint32_t *args)
 }
 
 /**
- * MQTT Data call back
- * Commands are decoded and acted upon here
+ * Read the measurements from the em chip. buf must hold 256 characters.
  */
 
-LOCAL void ICACHE_FLASH_ATTR 
-mqttDataCb(uint32_t *args, const char* topic, uint32_t topic_len, 
-const char *data, uint32_t data_len)
+LOCAL char * ICACHE_FLASH_ATTR formatSnapshot(char *buf)
 {
-	char *topicBuf, *dataBuf, *buf;
-	uint8_t i;
-	struct jsonparse_state state;
-	char command[32];
-	
+	int16_t qmean;
+	uint16_t irms, urms, pmean, freq, powerf, pangle, smean;
+	char irms_s[8], urms_s[8], pmean_s[8], qmean_s[8], freq_s[8], powerf_s[8], pangle_s[8], smean_s[8], kwh_s[16];
+
+	// Get the meter and measurement data from the EM chip
+
+	// RMS Line current
+	irms = em_read_transaction(EM_IRMS);
+	// unsigned 2.3
+	to_fixed_decimal_uint16(irms_s, 3, irms);
+	
+	// RMS Line voltage
+	urms = em_read_transaction(EM_URMS);
+	// unsigned 3.2
+	to_fixed_decimal_uint16(urms_s, 2, urms);
+	
+	// Mean active power
+	pmean = em_read_transaction(EM_PMEAN);
+	// complement 2.3
+	ones_compl_to_fixed_decimal_uint16(pmean_s, 3, pmean);
+	
+	qmean = em_read_transaction(EM_QMEAN);
+	// complement 2.3
+	twos_compl_to_fixed_decimal_int16(qmean_s, 3, qmean);
+	
+	freq = em_read_transaction(EM_FREQ);
+	// unsigned 2.2
+	to_fixed_decimal_uint16(freq_s, 2, freq);
+	
+	powerf = em_read_transaction(EM_POWERF);
+	// signed 1.3
+	twos_compl_to_fixed_decimal_int16(powerf_s, 3, powerf);
+	
+	pangle = em_read_transaction(EM_PANGLE);
+	ones_compl_to_fixed_decimal_uint16(pangle_s, 1, pangle);
+	// signed 3.1
+	
+	smean = em_read_transaction(EM_SMEAN);
+	// complement 2.3
+	ones_compl_to_fixed_decimal_uint16(smean_s, 3, smean);
+	
+	// Total Forward Active Energy
+	// Add what was read to the total.
+	energyPoll();
+	formatKwh(kwh_s, fae_total);
+	
+	/* Encode strings into JSON representation */
+	os_sprintf(buf, "{\"irms\":\"%s\",\"urms\":\"%s\",\"pmean\":\"%s\",\"qmean\":\"%s\",\"freq\":\"%s\",\"powerf\":\"%s\",\"pangle\":\"%s\",\"smean\":\"%s\",\"kwh\":\"%s\"}",
+	irms_s, urms_s, pmean_s, qmean_s, freq_s, powerf_s, pangle_s, smean_s, kwh_s);
+	return buf;
+}
 
-	MQTT_Client* client = (MQTT_Client*)args; // Pointer to MQTT control block passed in as args
-	
-	command[0] = 0; // Zero command string length to prevent stack junk from printing during debug
+/**
+ * Query the em chip and publish the measurements
+ */
 
-	// Save local copies of the topic and data
-	topicBuf = util_strndup(topic, topic_len);
-	dataBuf = util_strndup(data, data_len);
-	buf = (char *) os_zalloc(256);
-	
-	
-	INFO("Receive topic: %s, data: %s \r\n", topicBuf, dataBuf);
+LOCAL void ICACHE_FLASH_ATTR queryCommand(void)
+{
+	char buf[256];
+
+	formatSnapshot(buf);
 	
-	// Control Message?
-	if(!os_strcmp(topicBuf, controlTopic)){
-		jsonparse_setup(&state, dataBuf, data_len);
-		if (util_parse_json_param(&state, "control", command, sizeof(command)) != 2)
-			goto cleanup; /* Control field not present in json object */
-		if(!os_strcmp(command, "muster")){
-			publishConnInfo(&mqttClient);
+	/* Publish data */
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), ENERGY_QOS, 0);
+}
+
+/**
+ * Publish a snapshot retained on the state subtopic. Only the latest one
+ * matters, so it goes in the telemetry lane where a newer one replaces it.
+ * With MQTT 5 the broker drops it if the node stops refreshing it.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR publishState(void)
+{
+	char buf[256];
+
+	formatSnapshot(buf);
+	publishTelemetry(stateTopic, buf, 1, stateConfig.interval * STATE_EXPIRY_INTERVALS);
+}
+
+/**
+ * State timer callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR stateTimerCb(void *arg)
+{
+	publishState();
+}
+
+/**
+ * Start or stop the retained snapshots at the configured interval
+ */
+
+LOCAL void ICACHE_FLASH_ATTR stateStart(void)
+{
+	if(stateConfig.interval > TIMER_INTERVAL_MAX)
+		stateConfig.interval = TIMER_INTERVAL_MAX;
+	os_timer_disarm(&stateTimer);
+	if(stateConfig.interval){
+		os_timer_setfn(&stateTimer, (os_timer_func_t *) stateTimerCb, NULL);
+		os_timer_arm(&stateTimer, stateConfig.interval * 1000, 1);
+	}
+}
+
+/**
+ * Query or change the retained state interval. Turning it off deletes
+ * the retained messages from the broker.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR stateCommand(const char *data, int len)
+{
+	char buf[48];
+	int v;
+
+	// Longer intervals are cut to TIMER_INTERVAL_MAX before saving
+	if(getFixedParam(data, len, "interval", 0, &v) && (v >= 0)){
+		if(v && !stateConfig.interval)
+			publishRetainedInfo(&mqttClient);
+		else if(!v && stateConfig.interval){
+			// An empty retained message clears the topic. The state one
+			// takes the same path as the snapshots, so it can't overtake one.
+			publishTelemetry(stateTopic, "", 1, 0);
+			MQTT_Publish(&mqttClient, nodeInfoTopic, "", 0, 0, 1);
 		}
+		stateConfig.interval = v;
+		stateStart();
+		configBlobSave(stateConfigKey, &stateConfig, sizeof(stateConfig));
+		if(stateConfig.interval)
+			publishState();
 	}
-	
-	// Command Message?
-	else if (!os_strcmp(topicBuf, commandTopic)){ // Check for match to command topic
-		// Parse command
-		jsonparse_setup(&state, dataBuf, data_len);
-		if (util_parse_json_param(&state, "command", command, sizeof(command)) != 2)
-			goto cleanup; /* Command not present in json object */
-				
-		for(i = 0; commandElements[i].command[0]; i++){
-			command_element *ce = &commandElements[i];
-			//INFO("Trying %s\r\n", ce->command);
-			if(CP_NONE == ce->type){ // Parameterless command
-				if(!os_strcmp(command, ce->command)){
-					static uint32_t calc_kwh;
-					static int16_t qmean;
-					static uint16_t irms, urms, pmean, freq, powerf, pangle, smean, fae;
-					static char irms_s[8], urms_s[8], pmean_s[8], qmean_s[8], freq_s[8], powerf_s[8], pangle_s[8], smean_s[8], kwh_s[8];
-					switch(i){
-						case CMD_QUERY:
-							/* Query the em chip */
-							
-							// Get the meter and measurement data from the EM chip
+
+	os_sprintf(buf, "{\"state\":{\"interval\":\"%u\"}}", stateConfig.interval);
+	MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
+}
+
+/**
+ * Muster timer callback
+ */
+
+LOCAL void ICACHE_FLASH_ATTR musterTimerCb(void *arg)
+{
+	musterPending = FALSE;
+	publishConnInfo(&mqttClient);
+}
+
+/**
+ * Answer a muster at a random time in the window, so a fleet doesn't
+ * answer at once. The sequence is seeded from the chip ID, so nodes pick
+ * different slots. A muster which arrives while one is waiting is
+ * answered by it.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR musterSchedule(uint32_t window)
+{
+	if(musterPending)
+		return;
+	if(!window){
+		publishConnInfo(&mqttClient);
+		return;
+	}
+	musterPending = TRUE;
+	os_timer_disarm(&musterTimer);
+	os_timer_setfn(&musterTimer, (os_timer_func_t *) musterTimerCb, NULL);
+	os_timer_arm(&musterTimer, 1 + (util_rand() % window), 0);
+}
+
+/**
+ * Check the filters of a control message. schema must match exactly.
+ * device matches whole path segments at the start of the device path.
+ */
+
+LOCAL bool ICACHE_FLASH_ATTR targetMatch(const char *data, uint32_t data_len)
+{
+	const char *path = (const char *) configInfoBlock.e[MQTTDEVPATH].value;
+	char str[80];
+	int len;
+
+	if(getStringParam(data, data_len, "schema", str, sizeof(str)) && os_strcmp(str, schema))
+		return FALSE;
+	if(getStringParam(data, data_len, "device", str, sizeof(str))){
+		len = os_strlen(str);
+		if(os_strncmp(path, str, len))
+			return FALSE;
+		if(len && (str[len - 1] != '/') && path[len] && (path[len] != '/'))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Publish the captured snapshot
+ */
+
+LOCAL void ICACHE_FLASH_ATTR snapshotPublish(void)
+{
+	if(!snapshotMsg)
+		return;
+	MQTT_Publish(&mqttClient, statusTopic, snapshotMsg, os_strlen(snapshotMsg), ENERGY_QOS, 0);
+	util_free(snapshotMsg);
+	snapshotMsg = NULL;
+}
+
+LOCAL void snapshotTimerCb(void *arg);
+
+/**
+ * Arm the snapshot timer for SNAPSHOT_LEAD ms before the target time
+ */
+
+LOCAL void ICACHE_FLASH_ATTR snapshotArm(void)
+{
+	uint64_t now = wallclock_epoch_ms();
+	uint32_t delay = (snapshotTarget > now) ? (uint32_t) (snapshotTarget - now) : 0;
+
+	os_timer_disarm(&snapshotTimer);
+	os_timer_setfn(&snapshotTimer, (os_timer_func_t *) snapshotTimerCb, NULL);
+	os_timer_arm(&snapshotTimer, (delay > SNAPSHOT_LEAD) ? delay - SNAPSHOT_LEAD : 1, 0);
+}
+
+/**
+ * Snapshot timer callback. Waits out the lead, reads the em chip at the
+ * target time, and publishes at a random time in the window so the fleet
+ * doesn't publish at once. The capture time goes with the readings.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR snapshotTimerCb(void *arg)
+{
+	char meas[256];
+	char t[21], target[21];
+	uint64_t now;
+
+	if(!snapshotTarget){
+		snapshotPublish();
+		return;
+	}
+	// The clock may have been stepped since the timer was armed
+	now = wallclock_epoch_ms();
+	if(snapshotTarget > now + SNAPSHOT_LEAD){
+		snapshotArm();
+		return;
+	}
+	while(wallclock_epoch_ms() < snapshotTarget)
+		;
+	util_u64_to_str(t, wallclock_epoch_ms());
+	formatSnapshot(meas);
+	util_u64_to_str(target, snapshotTarget);
+	snapshotTarget = 0;
+
+	snapshotPublish();
+	snapshotMsg = util_zalloc(320);
+	// Merge the readings into the snapshot object
+	os_sprintf(snapshotMsg, "{\"snapshot\":{\"t\":\"%s\",\"target\":\"%s\",%s}", t, target, meas + 1);
+	INFO("Snapshot: %s\r\n", snapshotMsg);
+	if(!snapshotWindow){
+		snapshotPublish();
+		return;
+	}
+	os_timer_arm(&snapshotTimer, 1 + (util_rand() % snapshotWindow), 0);
+}
+
+/**
+ * Schedule a snapshot at a Unix time in ms. Needs the synchronized
+ * clock. A later snapshot replaces one which hasn't been taken.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR snapshotSchedule(uint64_t target, uint32_t window)
+{
+	uint64_t now;
+
+	if(!wallclock_synced()){
+		INFO("Snapshot ignored, clock not synchronized\r\n");
+		return;
+	}
+	now = wallclock_epoch_ms();
+	if((target <= now) || (target - now > SNAPSHOT_AHEAD_MAX)){
+		INFO("Snapshot ignored, target out of range\r\n");
+		return;
+	}
+	// One waiting to be published goes now, so the timer is free
+	snapshotPublish();
+	snapshotTarget = target;
+	snapshotWindow = window;
+	snapshotArm();
+}
+
+/**
+ * Control message, broadcast to all nodes
+ */
+
+LOCAL void ICACHE_FLASH_ATTR controlMessage(const char *data, uint32_t data_len)
+{
+	struct jsonparse_state state;
+	char command[32];
+	char str[24];
+	uint64_t target;
+	int window;
+
+	jsonparse_setup(&state, data, data_len);
+	if (util_parse_json_param(&state, "control", command, sizeof(command)) != 2)
+		return; /* Control field not present in json object */
+	if(!os_strcmp(command, "muster")){
+		if(!targetMatch(data, data_len))
+			return;
+		if(!getFixedParam(data, data_len, "window", 0, &window) || (window < 0) || (window > MUSTER_WINDOW_MAX))
+			window = MUSTER_WINDOW;
+		musterSchedule(window);
+	}
+	else if(!os_strcmp(command, "snapshot")){
+		if(!targetMatch(data, data_len))
+			return;
+		if(!getStringParam(data, data_len, "t", str, sizeof(str)) || !util_str_to_u64(str, &target))
+			return;
+		if(!getFixedParam(data, data_len, "window", 0, &window) || (window < 0) || (window > MUSTER_WINDOW_MAX))
+			window = MUSTER_WINDOW;
+		snapshotSchedule(target, window);
+	}
+}
+
+/**
+ * Command message, for this node
+ */
+
+LOCAL void ICACHE_FLASH_ATTR commandMessage(const char *data, uint32_t data_len)
+{
+	uint8_t i;
+	struct jsonparse_state state;
+	char command[32];
+	char buf[32];
+
+	// Parse command
+	jsonparse_setup(&state, data, data_len);
+	if (util_parse_json_param(&state, "command", command, sizeof(command)) != 2)
+		return; /* Command not present in json object */
+			
+	for(i = 0; commandElements[i].command[0]; i++){
+		command_element *ce = &commandElements[i];
+		//INFO("Trying %s\r\n", ce->command);
+		if(CP_NONE == ce->type){ // Parameterless command
+			if(!os_strcmp(command, ce->command)){
+				switch(i){
+					case CMD_QUERY:
+						/* Query the em chip */
+						queryCommand();
+						break;
+						
+					case CMD_RESET_KWH:
+						// Credit any residual energy to the time of use registers
+						energyPoll();
+						fae_total = 0;
+						// Send proof the energy register was zeroed.
+						os_sprintf(buf, "{\"resetkwh\":\"%ld\"}", fae_total);
+						MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), ENERGY_QOS, 0);
+						break;
 						
-							// RMS Line current
-							irms = em_read_transaction(EM_IRMS);
-							// unsigned 2.3
-							to_fixed_decimal_uint16(irms_s, 3, irms);
-							
-							// RMS Line voltage
-							urms = em_read_transaction(EM_URMS);
-							// unsigned 3.2
-							to_fixed_decimal_uint16(urms_s, 2, urms);
-							
-							// Mean active power
-							pmean = em_read_transaction(EM_PMEAN);
-							// complement 2.3
-							ones_compl_to_fixed_decimal_uint16(pmean_s, 3, pmean);
-							
-							qmean = em_read_transaction(EM_QMEAN);
-							// complement 2.3
-							twos_compl_to_fixed_decimal_int16(qmean_s, 3, qmean);
-							
-							freq = em_read_transaction(EM_FREQ);
-							// unsigned 2.2
-							to_fixed_decimal_uint16(freq_s, 2, freq);
-							
-							powerf = em_read_transaction(EM_POWERF);
-							// signed 1.3
-							twos_compl_to_fixed_decimal_int16(powerf_s, 3, powerf);
-							
-							pangle = em_read_transaction(EM_PANGLE);
-							ones_compl_to_fixed_decimal_uint16(pangle_s, 1, pangle);
-							// signed 3.1
-							
-							smean = em_read_transaction(EM_SMEAN);
-							// complement 2.3
-							ones_compl_to_fixed_decimal_uint16(smean_s, 3, smean);
-							
-							// Total Forward Active Energy
-							// Add what was read to the total.
-							fae_total += em_read_transaction(EM_APENERGY);
+					case CMD_SURVEY:
+						// Return WIFI survey data
+						wifi_station_scan(NULL, surveyCompleteCb);
+						break;
+						
+					case CMD_RESTART:
+						// Restart the firmware
+						util_restart();
+						break;
+						
+					default:
+						util_assert(FALSE, "Unsupported command: %d", i);
+				}
+				break;
+			}
+		}
 		
-							// KWH is equivalent to  fae_total divided by MC integer pulses 
-							// Since the fractional pulses are included in fae_total,
-							// we need to account for them.  We do this by multiplying
-							// by 1000 so that we get a kwh number which can be represented
-							// with 4 decimal digits.
-							//
-							calc_kwh = ((fae_total * 1000L)/ MC);
-							os_sprintf(kwh_s, "%d.%04d",((uint16_t) (calc_kwh / 10000L)), ((uint16_t) (calc_kwh % 10000L)));
-							
-							/* Encode strings into JSON representation */
-							os_sprintf(buf, "{\"irms\":\"%s\",\"urms\":\"%s\",\"pmean\":\"%s\",\"qmean\":\"%s\",\"freq\":\"%s\",\"powerf\":\"%s\",\"pangle\":\"%s\",\"smean\":\"%s\",\"kwh\":\"%s\"}",
-							irms_s, urms_s, pmean_s, qmean_s, freq_s, powerf_s, pangle_s, smean_s, kwh_s);
-							
-							/* Publish data */
-							MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
-							break;
-							
-						case CMD_RESET_KWH:
-							// Throw away any residual energy
-						    em_read_transaction(EM_APENERGY);
-							fae_total = 0;
-							// Send proof the energy register was zeroed.
-							os_sprintf(buf, "{\"resetkwh\":\"%ld\"}", fae_total);
-							MQTT_Publish(&mqttClient, statusTopic, buf, os_strlen(buf), 0, 0);
-							break;
-							
-						case CMD_SURVEY:
-							// Return WIFI survey data
-							wifi_station_scan(NULL, surveyCompleteCb);
-							break;
-							
-						case CMD_RESTART:
-							// Restart the firmware
-							util_restart();
-							break;
-							
-						default:
-							util_assert(FALSE, "Unsupported command: %d", i);
+		if((CP_INT == ce->type) || (CP_BOOL == ce->type)){ // Integer/bool parameter
+			int arg;
+			if(util_parse_command_int(command, ce->command, data, data_len, &arg)){
+				switch(i){								
+					default:
+						util_assert(FALSE, "Unsupported command: %d", i);
 					}
-					break;
+				break;
+			}				
+		}
+		if(CP_QSTRING == ce->type){ // Query strings
+			char *val = NULL;
+			if(util_parse_command_qstring(command, ce->command, data, data_len, &val) != FALSE){
+				if((CMD_SSID == i) || (CMD_WIFIPASS == i)){ // Qstring command?
+					handleQstringCommand(val, ce);
 				}
 			}
-			
-			if((CP_INT == ce->type) || (CP_BOOL == ce->type)){ // Integer/bool parameter
-				int arg;
-				if(util_parse_command_int(command, ce->command, dataBuf, &arg)){
-					switch(i){								
-						default:
-							util_assert(FALSE, "Unsupported command: %d", i);
-						}
-					break;
-				}				
-			}
-			if(CP_QSTRING == ce->type){ // Query strings
-				char *val = NULL;
-				if(util_parse_command_qstring(command, ce->command, dataBuf, &val) != FALSE){
-					if((CMD_SSID == i) || (CMD_WIFIPASS == i)){ // Qstring command?
-						handleQstringCommand(val, ce);
-					}
+		}
+		if(CP_REGISTER == ce->type){ // EM Chip registers
+				if(!strcmp(command, ce->command))
+					registerCommand(&state);
+		}
+		if(CP_JSON == ce->type){ // Commands with named parameters
+			if(!strcmp(command, ce->command)){
+				switch(i){
+					case CMD_PQ:
+						pqCommand(data, data_len);
+						break;
+
+					case CMD_LOADS:
+						loadsCommand(data, data_len);
+						break;
+
+					case CMD_CYCLES:
+						cyclesCommand(data, data_len);
+						break;
+
+					case CMD_TOU:
+						touCommand(data, data_len);
+						break;
+
+					case CMD_BURST:
+						burstCommand(data, data_len);
+						break;
+
+					case CMD_STATS:
+#ifdef MQTT_METRICS
+						statsCommand(data, data_len);
+#endif
+						break;
+
+					case CMD_STATE:
+						stateCommand(data, data_len);
+						break;
+
+					default:
+						util_assert(FALSE, "Unsupported command: %d", i);
 				}
+				break;
 			}
-			if(CP_REGISTER == ce->type){ // EM Chip registers
-					if(!strcmp(command, ce->command))
-						registerCommand(&state);
+		}
+		
+	} /* END for */
+	kvstore_flush(configHandle); // Flush any changes back to the kvs
+}
+
+/**
+ * Serial console. Each line received on UART0 is handled as a message
+ * on the command topic, and the reply is published as usual. Lines too
+ * long for the buffer are dropped whole.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR serialRxCb(const uint8 *data, uint16 len)
+{
+	uint16 i;
+
+	for(i = 0; i < len; i++){
+		if(data[i] == '\r' || data[i] == '\n'){
+			if(serialLen && !serialOverlong){
+				serialLine[serialLen] = 0;
+				commandMessage(serialLine, serialLen);
 			}
-			
-		} /* END for */
-		kvstore_flush(configHandle); // Flush any changes back to the kvs
-	} /* END if topic test */
-				
-	// Free local copies of the topic and data strings
-	
-cleanup:	
-	util_free(topicBuf);
-	util_free(dataBuf);
-	util_free(buf);
+			serialLen = 0;
+			serialOverlong = FALSE;
+		}
+		else if(serialLen < sizeof(serialLine) - 1)
+			serialLine[serialLen++] = data[i];
+		else
+			serialOverlong = TRUE;
+	}
+}
+
+/**
+ * Add an inbound topic to the dispatch table
+ */
+
+LOCAL void ICACHE_FLASH_ATTR addTopicHandler(const char *topic, topic_handler handler)
+{
+	topic_entry *te;
+
+	if(numTopicHandlers >= MAX_TOPIC_HANDLERS)
+		return;
+	te = &topicHandlers[numTopicHandlers++];
+	te->topic = topic;
+	te->len = os_strlen(topic);
+	te->hash = util_hash(topic, te->len);
+	te->handler = handler;
+}
+
+/**
+ * MQTT Data call back
+ * The topic and data point into the receive buffer and aren't terminated.
+ * Topics are matched by length and hash before comparing, and the
+ * handlers parse the data in place.
+ */
+
+LOCAL void ICACHE_FLASH_ATTR 
+mqttDataCb(uint32_t *args, const char* topic, uint32_t topic_len, 
+const char *data, uint32_t data_len)
+{
+	uint32_t hash = util_hash(topic, topic_len);
+	uint8_t i;
+
+	INFO("Receive topic, %d bytes, data, %d bytes\r\n", topic_len, data_len);
+	
+	for(i = 0; i < numTopicHandlers; i++){
+		topic_entry *te = &topicHandlers[i];
+		if(te->len == topic_len && te->hash == hash && !os_memcmp(te->topic, topic, topic_len)){
+			te->handler(data, data_len);
+			return;
+		}
+	}
 }
 
 
@@ -841,6 +1995,12 @@ LOCAL void ICACHE_FLASH_ATTR sysInit(void)
 	// Uart init
 	uart0_init(BIT_RATE_115200);
 	
+	// Start the 64 bit clock before anything timestamps
+	wallclock_init();
+
+	// Each node follows its own random sequence
+	util_rand_seed(system_get_chip_id());
+	
 	// I/O Pin initialization
 
 	em_init();
@@ -910,6 +2070,50 @@ LOCAL void ICACHE_FLASH_ATTR sysInit(void)
 
 	}
 	
+	// Power quality detector settings
+	if(!configBlobLoad(pqConfigKey, &pqConfig, sizeof(pqConfig))){
+		pq_default_config(&pqConfig, VREF * 100, FNOMINAL);
+		configBlobSave(pqConfigKey, &pqConfig, sizeof(pqConfig));
+	}
+	
+	// Load transition detector settings
+	if(!configBlobLoad(loadsConfigKey, &loadsConfig, sizeof(loadsConfig))){
+		loads_default_config(&loadsConfig);
+		configBlobSave(loadsConfigKey, &loadsConfig, sizeof(loadsConfig));
+	}
+	
+	// Cyclic load analyzer settings
+	if(!configBlobLoad(cyclesConfigKey, &cyclesConfig, sizeof(cyclesConfig))){
+		cycles_default_config(&cyclesConfig);
+		configBlobSave(cyclesConfigKey, &cyclesConfig, sizeof(cyclesConfig));
+	}
+	
+	// Time of use tariff periods and energy registers
+	if(!configBlobLoad(touConfigKey, &touConfig, sizeof(touConfig))){
+		tou_default_config(&touConfig);
+		configBlobSave(touConfigKey, &touConfig, sizeof(touConfig));
+	}
+	// Burst capture settings
+	if(!configBlobLoad(burstConfigKey, &burstConfig, sizeof(burstConfig))){
+		burst_default_config(&burstConfig);
+		configBlobSave(burstConfigKey, &burstConfig, sizeof(burstConfig));
+	}
+	// MQTT client stats settings
+	if(!configBlobLoad(statsConfigKey, &statsConfig, sizeof(statsConfig))){
+		statsConfig.interval = STATS_INTERVAL;
+		configBlobSave(statsConfigKey, &statsConfig, sizeof(statsConfig));
+	}
+	// Retained state settings, off until asked for
+	if(!configBlobLoad(stateConfigKey, &stateConfig, sizeof(stateConfig))){
+		stateConfig.interval = 0;
+		configBlobSave(stateConfigKey, &stateConfig, sizeof(stateConfig));
+	}
+	
+	if(configBlobLoad(touEnergyKey, buf, sizeof(tou_energy_t)))
+		tou_init(&touConfig, (tou_energy_t *) buf);
+	else
+		tou_init(&touConfig, NULL);
+
 	// Write the KVS back out to flash	
 	
 	kvstore_flush(configHandle);
@@ -959,17 +2163,14 @@ LOCAL void ICACHE_FLASH_ATTR sysInit(void)
 	
 	// Initialize MQTT connection 
 	
-	uint8_t *host = configInfoBlock.e[MQTTHOST].value;
-	uint32_t port = (uint32_t) atoi(configInfoBlock.e[MQTTPORT].value);
-	
-	MQTT_InitConnection(&mqttClient, host, port,
-	(uint8_t) atoi(configInfoBlock.e[MQTTSECUR].value));
+	initBrokers();
 
 	MQTT_InitClient(&mqttClient, configInfoBlock.e[MQTTDEVID].value, 
 	configInfoBlock.e[MQTTUSER].value, configInfoBlock.e[MQTTPASS].value,
-	atoi(configInfoBlock.e[MQTTKPALIV].value), 1);
+	atoi(configInfoBlock.e[MQTTKPALIV].value), 0);
 
 	MQTT_OnConnected(&mqttClient, mqttConnectedCb);
+	MQTT_OnBroker(&mqttClient, mqttBrokerCb);
 	MQTT_OnDisconnected(&mqttClient, mqttDisconnectedCb);
 	MQTT_OnPublished(&mqttClient, mqttPublishedCb);
 	MQTT_OnData(&mqttClient, mqttDataCb);
@@ -982,8 +2183,57 @@ LOCAL void ICACHE_FLASH_ATTR sysInit(void)
 	// Subtopics
 	commandTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "command");
 	statusTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "status");
+	eventTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "event");
+	statsTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "stats");
+	packetsTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "stats/packets");
+	stateTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "state");
+	nodeInfoTopic = util_make_sub_topic(configInfoBlock.e[MQTTDEVPATH].value, "info");
 	INFO("Command subtopic: %s\r\n", commandTopic);
 	INFO("Status subtopic: %s\r\n", statusTopic);
+	INFO("Event subtopic: %s\r\n", eventTopic);
+	INFO("Stats subtopic: %s\r\n", statsTopic);
+	INFO("State subtopic: %s\r\n", stateTopic);
+
+	// Subscribe to the control and command topics, sent with each CONNECT
+	addTopicHandler(controlTopic, controlMessage);
+	addTopicHandler(commandTopic, commandMessage);
+	MQTT_Subscribe(&mqttClient, controlTopic, 0);
+	MQTT_Subscribe(&mqttClient, commandTopic, 0);
+	// Commands typed on the serial port are handled the same way
+	uart0_set_rx_callback(serialRxCb);
+
+	// Telemetry through an MQTT-SN gateway, commands stay on MQTT
+	if(configInfoBlock.e[MQTTSNHOST].value[0]){
+		uint16_t statusId = (uint16_t) atoi(configInfoBlock.e[MQTTSNSTID].value);
+
+		MQTTSN_Init(&mqttSnClient, (char *) configInfoBlock.e[MQTTSNHOST].value,
+			(uint16_t) atoi(configInfoBlock.e[MQTTSNPORT].value),
+			(char *) configInfoBlock.e[MQTTDEVID].value, atoi(configInfoBlock.e[MQTTKPALIV].value));
+		MQTTSN_AddTopic(&mqttSnClient, statusTopic, statusId);
+		MQTTSN_AddTopic(&mqttSnClient, stateTopic, 0);
+		mqttSnStatusQos = statusId ? -1 : 0;
+		mqttSnEnabled = TRUE;
+		INFO("MQTT-SN gateway: %s\r\n", configInfoBlock.e[MQTTSNHOST].value);
+	}
+	
+	// Start sampling the em chip
+	sampler_init(SAMPLER_BASE_INTERVAL);
+	pq_init(&pqConfig, pqEventCb);
+	loads_init(&loadsConfig, loadsEventCb);
+	cycles_init(&cyclesConfig, cyclesReportCb);
+	burst_init(&burstConfig, burstCb);
+	
+	// Poll the energy register for the time of use registers
+	os_timer_disarm(&energyTimer);
+	os_timer_setfn(&energyTimer, (os_timer_func_t *) energyTimerCb, NULL);
+	os_timer_arm(&energyTimer, ENERGY_POLL_INTERVAL, 1);
+
+#ifdef MQTT_METRICS
+	// Publish the MQTT client stats
+	statsStart();
+#endif
+	// Keep the retained state fresh
+	stateStart();
 	
 	// Attempt WIFI connection
 	
@@ -1010,6 +2260,7 @@ LOCAL void ICACHE_FLASH_ATTR sysInit(void)
  
 void user_init(void)
 {
+	util_stack_paint();
 	sysInit();
 }
 
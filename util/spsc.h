@@ -0,0 +1,112 @@
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+/*
+ * Single producer, single consumer byte ring for handing data from an
+ * interrupt handler to a task.
+ *
+ * The producer only writes head and the consumer only writes tail, so
+ * neither needs interrupts disabled. The indices run freely and are
+ * masked into the buffer, whose size must be a power of two no larger
+ * than 32768. A barrier orders the slot access against the index update
+ * on each side, so the consumer never sees an index ahead of the data.
+ *
+ * The functions are inline so an interrupt handler in IRAM doesn't call
+ * into flash.
+ */
+
+#ifdef __XTENSA__
+#define SPSC_BARRIER() __asm__ __volatile__("memw" : : : "memory")
+#else
+#define SPSC_BARRIER() __sync_synchronize()
+#endif
+
+typedef struct {
+	uint8_t *buf;
+	uint16_t mask;				// Size - 1
+	volatile uint16_t head;		// Next slot to write, changed only by the producer
+	volatile uint16_t tail;		// Next slot to read, changed only by the consumer
+} SPSC;
+
+/*
+ * Initialize. size must be a power of two.
+ */
+
+static inline void spsc_init(SPSC *q, uint8_t *buf, uint16_t size)
+{
+	q->buf = buf;
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+}
+
+/*
+ * Bytes waiting. Exact for the consumer, a lower bound for anyone else.
+ */
+
+static inline uint16_t spsc_used(const SPSC *q)
+{
+	return (uint16_t) (q->head - q->tail);
+}
+
+/*
+ * Producer: add a byte. Returns FALSE if the ring is full.
+ */
+
+static inline bool spsc_put(SPSC *q, uint8_t c)
+{
+	uint16_t head = q->head;
+
+	if((uint16_t) (head - q->tail) > q->mask)
+		return FALSE;
+	q->buf[head & q->mask] = c;
+	SPSC_BARRIER();				// Byte in place before the consumer can see it
+	q->head = head + 1;
+	return TRUE;
+}
+
+/*
+ * Consumer: take a byte. Returns FALSE if the ring is empty.
+ */
+
+static inline bool spsc_get(SPSC *q, uint8_t *c)
+{
+	uint16_t tail = q->tail;
+
+	if(tail == q->head)
+		return FALSE;
+	SPSC_BARRIER();				// Read the byte only after seeing head move past it
+	*c = q->buf[tail & q->mask];
+	SPSC_BARRIER();				// Byte read before its slot is given back
+	q->tail = tail + 1;
+	return TRUE;
+}
+
+/*
+ * Consumer: take up to len bytes in at most two copies. Returns the
+ * number taken.
+ */
+
+static inline uint16_t spsc_read(SPSC *q, uint8_t *data, uint16_t len)
+{
+	uint16_t tail = q->tail;
+	uint16_t used = (uint16_t) (q->head - tail);
+	uint16_t start, n;
+
+	if(len > used)
+		len = used;
+	if(!len)
+		return 0;
+	SPSC_BARRIER();
+	start = tail & q->mask;
+	n = q->mask + 1 - start;	// Bytes before the end of the buffer
+	if(n > len)
+		n = len;
+	os_memcpy(data, q->buf + start, n);
+	os_memcpy(data + n, q->buf, len - n);
+	SPSC_BARRIER();
+	q->tail = tail + len;
+	return len;
+}
+
+#endif
@@ -70,6 +70,49 @@ char * ICACHE_FLASH_ATTR util_strndup(const char *s, int len)
 	p[len] = 0;
 	return p;
 }
+
+
+/*
+ * FNV-1a hash of len bytes, which needn't be terminated.
+ */
+
+uint32_t ICACHE_FLASH_ATTR util_hash(const char *s, int len)
+{
+	uint32_t h = 2166136261UL;
+
+	while(len--){
+		h ^= (uint8_t) *s++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+LOCAL uint32_t randState = 1;
+
+/*
+ * Seed the pseudo random sequence. Seeded from something unique to the
+ * node, such as the chip ID, nodes follow different sequences.
+ */
+
+void ICACHE_FLASH_ATTR util_rand_seed(uint32_t seed)
+{
+	// Mixed so close seeds don't start close, and never 0
+	randState = util_hash((const char *) &seed, sizeof(seed));
+	if(!randState)
+		randState = 1;
+}
+
+/*
+ * Next pseudo random number (xorshift32)
+ */
+
+uint32_t ICACHE_FLASH_ATTR util_rand(void)
+{
+	randState ^= randState << 13;
+	randState ^= randState >> 17;
+	randState ^= randState << 5;
+	return randState;
+}
  
 
 
@@ -165,7 +208,7 @@ int ICACHE_FLASH_ATTR util_parse_json_param(void *state, const char *paramname,
  * 0,1, and 2 from parse_json_param. -1 indicates the command did not match.
  */
  
-LOCAL int ICACHE_FLASH_ATTR processCommandParam(const char *commandrcvd, const char *command, const char *message, char *param, int paramsize)
+LOCAL int ICACHE_FLASH_ATTR processCommandParam(const char *commandrcvd, const char *command, const char *message, int len, char *param, int paramsize)
 {
 	struct jsonparse_state state;
 	
@@ -173,7 +216,7 @@ LOCAL int ICACHE_FLASH_ATTR processCommandParam(const char *commandrcvd, const c
 		return -1;
 	}
 	param[0] = 0;	
-	jsonparse_setup(&state, message, os_strlen(message));	
+	jsonparse_setup(&state, message, len);	
 	return util_parse_json_param(&state, "param", param, paramsize);
 
 }
@@ -184,13 +227,13 @@ LOCAL int ICACHE_FLASH_ATTR processCommandParam(const char *commandrcvd, const c
  * If the command is not matched, and  the number is not present, FALSE is returned.
  */
 
-bool ICACHE_FLASH_ATTR util_parse_command_int(const char *commandrcvd, const char *command, const char *message, int *val)
+bool ICACHE_FLASH_ATTR util_parse_command_int(const char *commandrcvd, const char *command, const char *message, int len, int *val)
 {
 	int res;
 	char param[32];
 	struct jsonparse_state state;
 	
-	res = processCommandParam(commandrcvd, command, message, param, sizeof(param));
+	res = processCommandParam(commandrcvd, command, message, len, param, sizeof(param));
 
 	if(2 == res){
 		*val = atoi(param);
@@ -206,13 +249,13 @@ bool ICACHE_FLASH_ATTR util_parse_command_int(const char *commandrcvd, const cha
  * value. This string must be freed when no longer required.
  */
  
-bool ICACHE_FLASH_ATTR util_parse_command_qstring(const char *commandrcvd, const char *command, const char *message, char **val)
+bool ICACHE_FLASH_ATTR util_parse_command_qstring(const char *commandrcvd, const char *command, const char *message, int len, char **val)
 {
 	int res;
 	char param[32];
 	struct jsonparse_state state;
 	
-	res = processCommandParam(commandrcvd, command, message, param, sizeof(param));
+	res = processCommandParam(commandrcvd, command, message, len, param, sizeof(param));
 	
 	if(-1 == res)
 		return FALSE;
@@ -227,4 +270,131 @@ bool ICACHE_FLASH_ATTR util_parse_command_qstring(const char *commandrcvd, const
 
 }
 
+/*
+ * Parse a fixed point decimal string such as "-12.34" into an integer
+ * scaled by 10^places. Extra fractional digits are truncated.
+ * Returns FALSE if the string is not a valid number.
+ */
+
+bool ICACHE_FLASH_ATTR util_parse_fixed(const char *s, uint8_t places, int *val)
+{
+	int v = 0;
+	int frac = -1;
+	bool negative = FALSE;
+	bool digits = FALSE;
+
+	if(!s)
+		return FALSE;
+	if(*s == '-'){
+		negative = TRUE;
+		s++;
+	}
+	for(; *s; s++){
+		if(*s == '.'){
+			if(frac >= 0)
+				return FALSE;
+			frac = 0;
+			continue;
+		}
+		if((*s < '0') || (*s > '9'))
+			return FALSE;
+		digits = TRUE;
+		if(frac >= 0){
+			if(frac >= places)
+				continue;
+			frac++;
+		}
+		v = (v * 10) + (*s - '0');
+	}
+	if(!digits)
+		return FALSE;
+	if(frac < 0)
+		frac = 0;
+	for(; frac < places; frac++)
+		v *= 10;
+	*val = negative ? -v : v;
+	return TRUE;
+}
+
+
+/*
+ * Convert an unsigned 64 bit integer to a decimal string.
+ * os_sprintf has no 64 bit conversions. dest must hold 21 characters.
+ */
+
+char * ICACHE_FLASH_ATTR util_u64_to_str(char *dest, uint64_t val)
+{
+	char tmp[21];
+	int i = 0, j = 0;
+
+	do{
+		tmp[i++] = '0' + (char) (val % 10);
+		val /= 10;
+	} while(val);
+	while(i)
+		dest[j++] = tmp[--i];
+	dest[j] = 0;
+	return dest;
+}
+
+/*
+ * Parse an unsigned decimal string into a 64 bit integer.
+ * Returns FALSE if the string is not a valid number or doesn't fit.
+ */
+
+bool ICACHE_FLASH_ATTR util_str_to_u64(const char *s, uint64_t *val)
+{
+	uint64_t v = 0;
+
+	if(!s || !*s)
+		return FALSE;
+	for(; *s; s++){
+		if((*s < '0') || (*s > '9'))
+			return FALSE;
+		if(v > (0xFFFFFFFFFFFFFFFFULL - 9) / 10)
+			return FALSE;
+		v = (v * 10) + (*s - '0');
+	}
+	*val = v;
+	return TRUE;
+}
+
+
+/*
+ * Stack high water mark. The stack below the caller of util_stack_paint
+ * is filled with a pattern, and util_stack_high_water finds the deepest
+ * word which has since been overwritten.
+ */
+
+#define STACK_PAINT 0xA5A5A5A5
+
+LOCAL uint32_t *stackPaintTop;
+LOCAL uint32_t *stackPaintBottom;
+
+void ICACHE_FLASH_ATTR util_stack_paint(void)
+{
+	uint32_t marker;
+	uint32_t *p;
+
+	// Leave this function's own frame alone
+	stackPaintTop = &marker - 16;
+	stackPaintBottom = stackPaintTop - (UTIL_STACK_PAINT_SIZE / sizeof(uint32_t));
+	for(p = stackPaintBottom; p < stackPaintTop; p++)
+		*p = STACK_PAINT;
+}
+
+
+/*
+ * Return the most stack used below the painted area's top, in bytes.
+ * UTIL_STACK_PAINT_SIZE means the whole area has been used.
+ */
+
+uint32_t ICACHE_FLASH_ATTR util_stack_high_water(void)
+{
+	uint32_t *p;
 
+	if(!stackPaintTop)
+		return 0;
+	for(p = stackPaintBottom; p < stackPaintTop && *p == STACK_PAINT; p++);
+	return (uint32_t) (stackPaintTop - p) * sizeof(uint32_t);
+}
@@ -8,6 +8,9 @@
 	}\
 }
 
+/* Stack below user_init checked for the high water mark */
+#define UTIL_STACK_PAINT_SIZE 3072
+
 #define util_zalloc(sz) ((void *) os_zalloc((sz)))
 #define util_free(p) os_free((p))
 
@@ -18,11 +21,14 @@ char * util_string_split(const char *in_str, char **list, char sep, int max_list
 char * util_make_sub_topic(const char *rootTopic, char *subTopic);
 char * util_strdup(const char *s);
 char * util_strndup(const char *s, int len);
+uint32_t util_hash(const char *s, int len);
+void util_rand_seed(uint32_t seed);
+uint32_t util_rand(void);
 int util_parse_json_param(void *state, const char *paramname, char *paramvalue, int paramvaluesize);
-bool util_parse_command_int(const char *commandrcvd, const char *command,  const char *message, int *val);
-bool util_parse_command_qstring(const char *commandrcvd, const char *command,  const char *message, char **val);
-
-
-
-
-
+bool util_parse_command_int(const char *commandrcvd, const char *command,  const char *message, int len, int *val);
+bool util_parse_command_qstring(const char *commandrcvd, const char *command,  const char *message, int len, char **val);
+bool util_parse_fixed(const char *s, uint8_t places, int *val);
+char * util_u64_to_str(char *dest, uint64_t val);
+bool util_str_to_u64(const char *s, uint64_t *val);
+void util_stack_paint(void);
+uint32_t util_stack_high_water(void);
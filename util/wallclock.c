@@ -0,0 +1,247 @@
+#include "ets_sys.h"
+#include "os_type.h"
+#include "mem.h"
+#include "osapi.h"
+#include "debug.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "utils.h"
+#include "util.h"
+#include "wallclock.h"
+
+#define NTP_PACKET_SIZE 48
+#define NTP_UNIX_OFFSET 2208988800UL	// Seconds from 1900 to 1970
+#define WRAP_CHECK_INTERVAL 60000		// ms, must be well under the 71 minute wrap
+
+LOCAL ETSTimer wrapTimer;
+LOCAL ETSTimer sntpTimer;
+LOCAL uint32_t lastMicros;
+LOCAL uint32_t wraps;					// Upper 32 bits of the uptime
+
+LOCAL struct espconn sntpConn;
+LOCAL esp_udp sntpUdp;
+LOCAL ip_addr_t sntpIp;
+LOCAL char *sntpServer;
+LOCAL bool sntpStarted;
+LOCAL bool synced;
+LOCAL uint64_t requestUs;				// Uptime the request was sent (T1)
+LOCAL uint8_t requestStamp[8];			// Transmit timestamp of the request, echoed by the server
+LOCAL int64_t offsetUs;					// Unix time minus uptime
+
+
+/*
+ * Return the uptime in microseconds
+ */
+
+uint64_t ICACHE_FLASH_ATTR wallclock_uptime_us(void)
+{
+	uint32_t now = system_get_time();
+
+	if(now < lastMicros)
+		wraps++;
+	lastMicros = now;
+	return (((uint64_t) wraps) << 32) | now;
+}
+
+
+/*
+ * Return the uptime in milliseconds. Wraps after 49 days.
+ */
+
+uint32_t ICACHE_FLASH_ATTR wallclock_uptime_ms(void)
+{
+	return (uint32_t) (wallclock_uptime_us() / 1000);
+}
+
+
+/*
+ * Return TRUE once the clock has been set from an SNTP server
+ */
+
+bool ICACHE_FLASH_ATTR wallclock_synced(void)
+{
+	return synced;
+}
+
+
+/*
+ * Return Unix time in milliseconds, or 0 if the clock isn't synchronized
+ */
+
+uint64_t ICACHE_FLASH_ATTR wallclock_epoch_ms(void)
+{
+	if(!synced)
+		return 0;
+	return (uint64_t) (((int64_t) wallclock_uptime_us() + offsetUs) / 1000);
+}
+
+
+/*
+ * Convert a recent 32 bit uptime in milliseconds to Unix time in milliseconds.
+ * Returns 0 if the clock isn't synchronized.
+ */
+
+uint64_t ICACHE_FLASH_ATTR wallclock_uptime_to_epoch_ms(uint32_t uptime_ms)
+{
+	uint64_t now = wallclock_uptime_us() / 1000;
+	uint32_t age = ((uint32_t) now) - uptime_ms;
+
+	if(!synced)
+		return 0;
+	return (uint64_t) ((int64_t) (now - age) + (offsetUs / 1000));
+}
+
+
+/*
+ * Keep the wrap count up to date when nothing else reads the clock
+ */
+
+LOCAL void ICACHE_FLASH_ATTR wallclock_wrap_check(void *arg)
+{
+	wallclock_uptime_us();
+}
+
+
+/*
+ * Convert an NTP timestamp to Unix time in microseconds
+ */
+
+LOCAL int64_t ICACHE_FLASH_ATTR ntp_to_unix_us(const uint8_t *p)
+{
+	uint32_t sec = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+	uint32_t frac = ((uint32_t) p[4] << 24) | ((uint32_t) p[5] << 16) | ((uint32_t) p[6] << 8) | p[7];
+
+	return ((int64_t) (sec - NTP_UNIX_OFFSET) * 1000000) + (int64_t) (((uint64_t) frac * 1000000) >> 32);
+}
+
+
+/*
+ * SNTP response received
+ */
+
+LOCAL void ICACHE_FLASH_ATTR sntp_recv(void *arg, char *pdata, unsigned short len)
+{
+	uint8_t *p = (uint8_t *) pdata;
+	int64_t t1, t2, t3, t4;
+
+	t4 = (int64_t) wallclock_uptime_us();
+
+	if(len < NTP_PACKET_SIZE)
+		return;
+	// Server mode, non-zero stratum, and our request's timestamp echoed back
+	if(((p[0] & 0x07) != 4) || (p[1] == 0) || os_memcmp(p + 24, requestStamp, sizeof(requestStamp))){
+		INFO("SNTP: ignoring bad response\r\n");
+		return;
+	}
+	t1 = (int64_t) requestUs;
+	t2 = ntp_to_unix_us(p + 32);
+	t3 = ntp_to_unix_us(p + 40);
+	offsetUs = ((t2 - t1) + (t3 - t4)) / 2;
+
+	if(!synced)
+		INFO("SNTP: clock synchronized\r\n");
+	synced = TRUE;
+
+	os_timer_disarm(&sntpTimer);
+	os_timer_arm(&sntpTimer, SNTP_RESYNC_INTERVAL * 1000UL, 1);
+}
+
+
+/*
+ * Send a request to the resolved server
+ */
+
+LOCAL void ICACHE_FLASH_ATTR sntp_send(void)
+{
+	uint8_t pkt[NTP_PACKET_SIZE];
+	uint32_t r[2];
+
+	os_memset(pkt, 0, sizeof(pkt));
+	pkt[0] = 0x23;					// LI 0, version 4, client mode
+
+	// Use an unpredictable transmit timestamp so stray replies can be recognized
+	r[0] = os_random();
+	r[1] = os_random();
+	os_memcpy(requestStamp, r, sizeof(requestStamp));
+	os_memcpy(pkt + 40, requestStamp, sizeof(requestStamp));
+
+	os_memcpy(sntpUdp.remote_ip, &sntpIp.addr, 4);
+	sntpUdp.remote_port = SNTP_PORT;
+	requestUs = wallclock_uptime_us();
+	espconn_sent(&sntpConn, pkt, sizeof(pkt));
+}
+
+
+/*
+ * DNS callback for the server name
+ */
+
+LOCAL void ICACHE_FLASH_ATTR sntp_dns_found(const char *name, ip_addr_t *ipaddr, void *arg)
+{
+	if(!ipaddr || !ipaddr->addr){
+		INFO("SNTP: can't resolve %s\r\n", name);
+		return;
+	}
+	sntpIp.addr = ipaddr->addr;
+	sntp_send();
+}
+
+
+/*
+ * Periodic synchronization
+ */
+
+LOCAL void ICACHE_FLASH_ATTR sntp_poll(void *arg)
+{
+	if(!synced){
+		os_timer_disarm(&sntpTimer);
+		os_timer_arm(&sntpTimer, SNTP_RETRY_INTERVAL * 1000UL, 1);
+	}
+
+	if(UTILS_StrToIP(sntpServer, &sntpIp.addr))
+		sntp_send();
+	else if(espconn_gethostbyname(&sntpConn, sntpServer, &sntpIp, sntp_dns_found) == ESPCONN_OK)
+		sntp_send();	// Answer was cached
+}
+
+
+/*
+ * Start synchronizing with an SNTP server.
+ * Call once the station has an IP address. Subsequent calls are ignored.
+ */
+
+void ICACHE_FLASH_ATTR wallclock_sntp_start(const char *server)
+{
+	if(sntpStarted || !server || !server[0])
+		return;
+	sntpStarted = TRUE;
+	sntpServer = util_strdup(server);
+
+	os_memset(&sntpConn, 0, sizeof(sntpConn));
+	sntpConn.type = ESPCONN_UDP;
+	sntpConn.state = ESPCONN_NONE;
+	sntpConn.proto.udp = &sntpUdp;
+	sntpUdp.local_port = espconn_port();
+	sntpUdp.remote_port = SNTP_PORT;
+	espconn_regist_recvcb(&sntpConn, sntp_recv);
+	espconn_create(&sntpConn);
+
+	INFO("SNTP: using server %s\r\n", sntpServer);
+
+	os_timer_disarm(&sntpTimer);
+	os_timer_setfn(&sntpTimer, (os_timer_func_t *) sntp_poll, NULL);
+	sntp_poll(NULL);
+}
+
+
+/*
+ * Start tracking the uptime counter wraps
+ */
+
+void ICACHE_FLASH_ATTR wallclock_init(void)
+{
+	lastMicros = system_get_time();
+	os_timer_disarm(&wrapTimer);
+	os_timer_setfn(&wrapTimer, (os_timer_func_t *) wallclock_wrap_check, NULL);
+	os_timer_arm(&wrapTimer, WRAP_CHECK_INTERVAL, 1);
+}
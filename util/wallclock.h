@@ -0,0 +1,25 @@
+#ifndef _WALLCLOCK_H_
+#define _WALLCLOCK_H_
+
+/*
+ * 64 bit monotonic clock and SNTP synchronized wall clock.
+ *
+ * system_get_time() is a 32 bit microsecond counter which wraps about
+ * every 71 minutes. The wrap is tracked here to give a 64 bit uptime,
+ * and an offset obtained from an SNTP server converts uptime to
+ * Unix time.
+ */
+
+#define SNTP_PORT 123
+#define SNTP_RESYNC_INTERVAL 3600		// Seconds between synchronizations
+#define SNTP_RETRY_INTERVAL 15			// Seconds between attempts until synchronized
+
+void wallclock_init(void);
+uint64_t wallclock_uptime_us(void);
+uint32_t wallclock_uptime_ms(void);
+void wallclock_sntp_start(const char *server);
+bool wallclock_synced(void);
+uint64_t wallclock_epoch_ms(void);
+uint64_t wallclock_uptime_to_epoch_ms(uint32_t uptime_ms);
+
+#endif